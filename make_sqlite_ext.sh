@@ -1 +1 @@
-gcc -Wall -Werror -m32 -g -fPIC -shared src/main.c -o fdb.so
+gcc -Wall -Werror -g -fPIC -shared src/main.c -lpthread -o fdb.so
@@ -1,27 +1,49 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+** The structures below are laid out exactly as they are stored in a fdb file.
+** References between them are 32 bit offsets from the start of the image,
+** so the file can be used in place (e.g. mmapped) without rewriting anything.
+** 0xFFFFFFFF marks a missing reference (empty bucket, end of chain).
+**
+** The live client keeps the same layout in memory, but with the offsets already
+** replaced by absolute 32 bit addresses. Such an image is accessed with a base of 0.
+*/
+typedef uint32_t fdb_offset;
+
+#define FDB_NO_OFFSET 0xFFFFFFFF
+
+static inline void* fdb_at(const char* base, fdb_offset offset) {
+	if (offset == FDB_NO_OFFSET) {
+		return NULL;
+	}
+	return (void*) ((uintptr_t) base + offset);
+}
 
 typedef struct {
-	unsigned int data_type;
-	char* name;
+	uint32_t data_type;
+	fdb_offset name;
 } Column;
 
-void fix_pointers_column(Column* col, unsigned int fdb) {
-	col->name = (char*) (fdb + (unsigned int) col->name);
+static inline const char* column_name(const char* base, const Column* col) {
+	return fdb_at(base, col->name);
 }
 
 typedef struct {
-	unsigned int ncolumns;
-	char* name;
-	Column* columns;
+	uint32_t ncolumns;
+	fdb_offset name;
+	fdb_offset columns;
 } TableDescription;
 
-void fix_pointers_table_desc(TableDescription* desc, unsigned int fdb) {
-	desc->name = (char*) (fdb + (unsigned int) desc->name);
-	desc->columns = (Column*) (fdb + (unsigned int) desc->columns);
-	for (unsigned int i = 0; i < desc->ncolumns; i++) {
-		fix_pointers_column(&desc->columns[i], fdb);
-	}
+static inline const char* desc_name(const char* base, const TableDescription* desc) {
+	return fdb_at(base, desc->name);
+}
+
+static inline Column* desc_columns(const char* base, const TableDescription* desc) {
+	return fdb_at(base, desc->columns);
 }
 
 enum fdb_data_type {
@@ -37,90 +59,345 @@ enum fdb_data_type {
 } fdb_data_type;
 
 typedef struct {
-	unsigned int data_type;
+	uint32_t data_type;
 	union value {
-		int i32;
-		unsigned int u32;
+		int32_t i32;
+		uint32_t u32;
 		float real;
 		bool boolean;
-		long long* i64p;
-		unsigned long long* u64p;
-		char* text;
+		// I64, U64, NVARCHAR and TEXT values are stored out of line
+		fdb_offset offset;
 	} value;
 } Value;
 
-void fix_pointers_value(Value* value, unsigned int fdb) {
-	if (value->data_type == FDB_I64 || value->data_type == FDB_U64 || value->data_type == FDB_NVARCHAR || value->data_type == FDB_TEXT) {
-		value->value.u32 = (fdb + (unsigned int) value->value.u32);
+static inline int64_t* value_i64p(const char* base, const Value* value) {
+	return fdb_at(base, value->value.offset);
+}
+
+static inline uint64_t* value_u64p(const char* base, const Value* value) {
+	return fdb_at(base, value->value.offset);
+}
+
+static inline char* value_text(const char* base, const Value* value) {
+	return fdb_at(base, value->value.offset);
+}
+
+/*
+** Read an integer value the way SQLite sees it. Returns false for other types.
+*/
+static inline bool fdb_value_int(const char* base, const Value* value, int64_t* out) {
+	switch (value->data_type) {
+		case FDB_I32: *out = value->value.i32; return true;
+		case FDB_U32: *out = value->value.u32; return true;
+		case FDB_BOOLEAN: *out = value->value.boolean; return true;
+		case FDB_I64: *out = *value_i64p(base, value); return true;
+		case FDB_U64: *out = (int64_t) *value_u64p(base, value); return true;
+		default: return false;
 	}
 }
 
 typedef struct {
-	unsigned int nvalues;
-	Value* values;
+	uint32_t nvalues;
+	fdb_offset values;
 } Row;
 
-void fix_pointers_row(Row* row, unsigned int fdb) {
-	row->values = (Value*) (fdb + (unsigned int) row->values);
-	for (unsigned int i = 0; i < row->nvalues; i++) {
-		fix_pointers_value(&row->values[i], fdb);
-	}
+static inline Value* row_values(const char* base, const Row* row) {
+	return fdb_at(base, row->values);
 }
 
 typedef struct Bucket {
-	Row* row;
-	struct Bucket* next;
+	fdb_offset row;
+	fdb_offset next;
 } Bucket;
 
-void fix_pointers_bucket(Bucket* bucket, unsigned int fdb) {
-	bucket->row = (Row*) (fdb + (unsigned int) bucket->row);
-	fix_pointers_row(bucket->row, fdb);
+static inline Row* bucket_row(const char* base, const Bucket* bucket) {
+	return fdb_at(base, bucket->row);
+}
 
-	if ((int) bucket->next == -1) {
-		bucket->next = NULL;
-	} else {
-		bucket->next = (Bucket*) (fdb + (unsigned int) bucket->next);
-		fix_pointers_bucket(bucket->next, fdb);
-	}
+static inline Bucket* bucket_next(const char* base, const Bucket* bucket) {
+	return fdb_at(base, bucket->next);
 }
 
 typedef struct {
-	unsigned int nbuckets;
-	Bucket** buckets;
+	uint32_t nbuckets;
+	fdb_offset buckets;
 } HashTable;
 
-void fix_pointers_hash_table(HashTable* hash_table, unsigned int fdb) {
-	hash_table->buckets = (Bucket**) (fdb + (unsigned int) hash_table->buckets);
-	for (unsigned int i = 0; i < hash_table->nbuckets; i++) {
-		if ((int) hash_table->buckets[i] == -1) {
-			hash_table->buckets[i] = NULL;
-		} else {
-			hash_table->buckets[i] = (Bucket*) (fdb + (unsigned int) hash_table->buckets[i]);
-			fix_pointers_bucket(hash_table->buckets[i], fdb);
-		}
+static inline fdb_offset* hash_table_buckets(const char* base, const HashTable* hash_table) {
+	return fdb_at(base, hash_table->buckets);
+}
+
+static inline Bucket* hash_table_bucket(const char* base, const HashTable* hash_table, uint32_t i) {
+	return fdb_at(base, hash_table_buckets(base, hash_table)[i]);
+}
+
+/*
+** Rows with integer keys are in bucket key % nbuckets. Text keys are hashed with Paul
+** Hsieh's SuperFastHash over their bytes, as the writers of fdb files do.
+*/
+static inline uint32_t fdb_sfhash(const char* data, size_t len) {
+	#define FDB_GET16(p) ((uint32_t) (uint8_t) (p)[0] | ((uint32_t) (uint8_t) (p)[1] << 8))
+	uint32_t hash = (uint32_t) len;
+	if (len == 0 || data == NULL) {
+		return 0;
+	}
+	size_t rem = len & 3;
+	for (len >>= 2; len > 0; len--) {
+		hash += FDB_GET16(data);
+		uint32_t tmp = (FDB_GET16(data + 2) << 11) ^ hash;
+		hash = (hash << 16) ^ tmp;
+		data += 4;
+		hash += hash >> 11;
+	}
+	switch (rem) {
+		case 3:
+			hash += FDB_GET16(data);
+			hash ^= hash << 16;
+			hash ^= (uint32_t) ((signed char) data[2]) << 18;
+			hash += hash >> 11;
+			break;
+		case 2:
+			hash += FDB_GET16(data);
+			hash ^= hash << 11;
+			hash += hash >> 17;
+			break;
+		case 1:
+			hash += (uint32_t) (signed char) data[0];
+			hash ^= hash << 10;
+			hash += hash >> 1;
+			break;
 	}
+	hash ^= hash << 3;
+	hash += hash >> 5;
+	hash ^= hash << 4;
+	hash += hash >> 17;
+	hash ^= hash << 25;
+	hash += hash >> 6;
+	return hash;
+	#undef FDB_GET16
 }
 
 typedef struct {
-	TableDescription* desc;
-	HashTable* hash_table;
+	fdb_offset desc;
+	fdb_offset hash_table;
 } Table;
 
-void fix_pointers_table(Table* table, unsigned int fdb) {
-	table->desc = (TableDescription*) (fdb + (unsigned int) table->desc);
-	table->hash_table = (HashTable*) (fdb + (unsigned int) table->hash_table);
-	fix_pointers_table_desc(table->desc, fdb);
-	fix_pointers_hash_table(table->hash_table, fdb);
+static inline TableDescription* table_desc(const char* base, const Table* table) {
+	return fdb_at(base, table->desc);
+}
+
+static inline HashTable* table_hash_table(const char* base, const Table* table) {
+	return fdb_at(base, table->hash_table);
 }
 
 typedef struct {
-	unsigned int ntables;
-	Table* tables;
+	uint32_t ntables;
+	fdb_offset tables;
+} FdbHeader;
+
+/*
+** Packed container (see fdb_pack.c): a header, one entry per table, then the table
+** names and every table compressed separately, each as a self-contained fdb image
+** holding just that table.
+*/
+#define FDB_PACK_MAGIC 0x5A424446 /* "FDBZ", no plain fdb has that many tables */
+#define FDB_PACK_VERSION 1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ntables;
+	fdb_offset entries;
+} FdbPackHeader;
+
+typedef struct {
+	fdb_offset name;
+	uint32_t size;         /* Size of the table's image */
+	uint64_t data;         /* Offset of the compressed image in the container */
+	uint32_t packed_size;  /* Size of the compressed image */
+	uint32_t reserved;
+} FdbPackEntry;
+
+/*
+** Snapshots (see fdb_snapshot.c) are plain fdb images followed by this trailer, which
+** identifies the source file they were built from.
+*/
+#define FDB_SNAPSHOT_MAGIC 0x53424446 /* "FDBS" */
+#define FDB_SNAPSHOT_VERSION 1
+#define FDB_SNAPSHOT_VALIDATED 1  /* Every table was fully validated when it was written */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+	uint32_t flags;
+	uint32_t reserved;
+} FdbSnapshotTrailer;
+
+/*
+** One column of a table's columnar copy (see fdb_columnar.c).
+*/
+typedef struct {
+	uint32_t data_type;  /* The column's declared type */
+	uint8_t* nulls;      /* Bit i is set if row i is NULL */
+	void* values;        /* One entry per row, NULL if rows don't all match data_type */
+} ColumnData;
+
+/*
+** Secondary hash index on one column of a table (see fdb_index.c).
+*/
+typedef struct {
+	volatile int32_t refs;   /* One for the table, one for each cursor reading it */
+	uint32_t nslots;         /* Power of 2 */
+	uint32_t* slot_starts;   /* Index into rows of each slot's first entry, nslots + 1 entries */
+	uint32_t* rows;          /* Dense row indices, grouped by slot, NULL if the column can't be indexed */
+	uint32_t nkeys;          /* Slots in use, to estimate rows per key */
+	size_t size;
+} FdbIndex;
+
+/*
+** The rows of a table ordered by one column (see fdb_sorted.c).
+*/
+typedef struct {
+	volatile int32_t refs;  /* One for the table, one for each cursor reading it */
+	uint32_t* rows;         /* Dense row indices, NULLs first, then values of another type */
+	uint32_t first;         /* Index into rows of the first value of the column's type */
+	uint32_t* reversed;     /* rows in reverse, for descending scans, NULL until first needed */
+	size_t size;
+} FdbSorted;
+
+/*
+** The rows holding each trigram of a text column (see fdb_trigram.c).
+*/
+typedef struct {
+	volatile int32_t refs;  /* One for the table, one for each caller using it */
+	uint32_t* keys;         /* Sorted trigrams, three bytes with ASCII letters lowercased */
+	uint32_t* starts;       /* Index into rows of each trigram's rows, nkeys + 1 entries */
+	uint32_t* rows;         /* Dense row indices, ascending for each trigram */
+	uint32_t nkeys;
+	uint32_t* changed;      /* Sorted rows an UPDATE changed since the index was built */
+	uint32_t nchanged;
+	uint32_t capacity;
+	size_t size;
+} FdbTrigrams;
+
+/*
+** What the planner knows about the values of one column (see fdb_cost.c).
+*/
+typedef struct {
+	bool ready;         /* Set once the column has been looked at */
+	bool unique;        /* No two rows share a value, only checked for the key */
+	uint32_t distinct;  /* Estimated number of distinct values, NULL not counted */
+	uint32_t nulls;
+} FdbColumnStats;
+
+/*
+** Runtime state kept alongside each table of a loaded image.
+*/
+typedef struct {
+	const char* name;
+	char* image;      /* Base the table's offsets are relative to, NULL while still packed */
+	Table* table;
+	TableDescription* desc;
+	HashTable* hash_table;
+	const FdbPackEntry* packed;  /* Where to unpack the table from, NULL for plain images */
+	sqlite3_mutex* mutex;        /* Guards preparing, unpacking and evicting the table */
+	uint32_t users;              /* Cursors, plans and writes using the table, unused tables can be evicted */
+	volatile int32_t ready;  /* Set once fdb_prepare_table() has run */
+	uint32_t nrows;
+	uint32_t max_chain;
+	uint64_t chain_squares;   /* Sum of the squared chain lengths, for the chain an existing key is in */
+	int64_t key_min;          /* Range of the integer keys, key_min > key_max if there are none */
+	int64_t key_max;
+	uint64_t prepare_us;
+	Row** rows;               /* Every row in bucket and chain order, nrows entries */
+	uint32_t* bucket_starts;  /* Index into rows of each bucket's first row, nbuckets + 1 entries */
+	ColumnData* columnar;     /* Columnar copy in the order of rows, one entry per column */
+	size_t columnar_size;
+	volatile int32_t columnar_ready;  /* Set once columnar has been built */
+	volatile int32_t columnar_copied; /* Bit j set once column j < 31 of columnar is copied */
+	FdbIndex** indexes;       /* Secondary index of each column, NULL until one is built */
+	uint32_t* index_scans;    /* Full scans for an equal value of each column so far */
+	FdbSorted** sorted;       /* Sorted view of each column, then case-insensitive ones, NULL until one is built */
+	FdbTrigrams** trigrams;   /* Trigram index of each column, NULL unless one is built */
+	uint8_t* typed;           /* Per column, 0 until checked, 1 if it only holds values of its type, 2 if not */
+	FdbColumnStats* stats;    /* Per column, NULL until the planner first needs them */
+	char* extent;         /* Lowest address the table's data occupies, set by fdb_prepare_table() */
+	size_t extent_size;
+	bool locked;          /* The extent is locked into memory */
+} TableInfo;
+
+/*
+** A loaded fdb image.
+*/
+typedef struct Fdb {
+	char* base;       /* Start of the image, NULL if offsets are absolute addresses */
+	size_t size;      /* Size of the image in bytes, 0 if unknown */
+	size_t mapped;    /* Length of the mapping holding the image, can exceed size */
+	bool huge;        /* The image was copied into huge pages */
+	bool lock;        /* Lock tables into memory as they are prepared */
+	bool columnar;    /* Build a columnar copy of a table on its first full scan */
+	uint32_t ntables;
+	Table* tables;    /* NULL for packed images */
+	TableInfo* info;  /* One entry per table */
+	/* Registry bookkeeping, see fdb_file.c */
+	char* path;       /* Canonical path of the file, NULL for the live client image */
+	int64_t mtime;
+	bool validated;   /* Every offset has been checked by fdb_validate() */
+	volatile int32_t refs;
+	struct Fdb* next;
 } Fdb;
 
-void fix_pointers(Fdb* fdb) {
-	fdb->tables = (Table*) ((unsigned int) fdb + (unsigned int) fdb->tables);
-	for (unsigned int i = 0; i < fdb->ntables; i++) {
-		fix_pointers_table(&fdb->tables[i], (unsigned int) fdb);
+static inline bool fdb_alloc_info(Fdb* fdb, char* base, size_t size, uint32_t ntables) {
+	fdb->base = base;
+	fdb->size = size;
+	fdb->mapped = size;
+	fdb->huge = false;
+	fdb->lock = false;
+	fdb->columnar = false;
+	fdb->ntables = ntables;
+	fdb->tables = NULL;
+	fdb->path = NULL;
+	fdb->mtime = 0;
+	fdb->validated = false;
+	fdb->refs = 0;
+	fdb->next = NULL;
+	fdb->info = calloc(ntables, sizeof(TableInfo));
+	if (fdb->info == NULL) {
+		return false;
+	}
+	for (uint32_t i = 0; i < ntables; i++) {
+		fdb->info[i].mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+	}
+	return true;
+}
+
+static inline bool fdb_init(Fdb* fdb, char* base, size_t size, const FdbHeader* header) {
+	if (!fdb_alloc_info(fdb, base, size, header->ntables)) {
+		return false;
+	}
+	fdb->tables = fdb_at(base, header->tables);
+	for (uint32_t i = 0; i < fdb->ntables; i++) {
+		TableInfo* info = &fdb->info[i];
+		info->image = base;
+		info->table = &fdb->tables[i];
+		info->desc = table_desc(base, info->table);
+		info->hash_table = table_hash_table(base, info->table);
+		info->name = desc_name(base, info->desc);
+	}
+	return true;
+}
+
+static inline bool fdb_init_packed(Fdb* fdb, char* base, size_t size, const FdbPackHeader* header) {
+	if (!fdb_alloc_info(fdb, base, size, header->ntables)) {
+		return false;
+	}
+	const FdbPackEntry* entries = fdb_at(base, header->entries);
+	for (uint32_t i = 0; i < fdb->ntables; i++) {
+		fdb->info[i].packed = &entries[i];
+		fdb->info[i].name = fdb_at(base, entries[i].name);
 	}
+	return true;
 }
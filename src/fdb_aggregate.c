@@ -0,0 +1,617 @@
+/*
+** fdb_aggregate is an eponymous table-valued function computing one aggregate of a
+** column of a loaded table, for every value of a grouping column:
+**
+**   SELECT key, value, rows FROM fdb_aggregate('Objects', 'type', 'sum:level');
+**
+** The aggregate is count, sum, total, avg, min or max, followed by ':' and a column;
+** 'count' alone or 'count:*' counts rows. Without a grouping column (NULL or '') there
+** is a single group with a NULL key. rows is the number of rows in each group, and the
+** groups come out ordered by key.
+**
+** SQLite runs every query on one thread. Here the table's rows are split into chunks
+** that worker threads aggregate on their own, each into its own groups, which are
+** merged once all chunks are done. The results are those of SQLite's GROUP BY, but
+** floating point sums may differ in the last bits, as they are added in another
+** order. Summed and grouped columns must hold values of only their declared type.
+** If several loaded files have a table of that name, the most recently loaded one is
+** used.
+*/
+
+#define FDB_AGGREGATE_CHUNKS 64  /* Row ranges the rows are split into */
+
+enum {
+	FDB_AGGREGATE_KEY,
+	FDB_AGGREGATE_VALUE,
+	FDB_AGGREGATE_ROWS,
+	FDB_AGGREGATE_TABLE,
+	FDB_AGGREGATE_GROUP,
+	FDB_AGGREGATE_SPEC,
+};
+
+enum {
+	FDB_AGG_COUNT_ROWS,
+	FDB_AGG_COUNT,
+	FDB_AGG_SUM,
+	FDB_AGG_TOTAL,
+	FDB_AGG_AVG,
+	FDB_AGG_MIN,
+	FDB_AGG_MAX,
+};
+
+static const char* FDB_AGG_NAMES[] = {"count", "count", "sum", "total", "avg", "min", "max"};
+
+/*
+** A group key or a minimum or maximum, as SQLite sees it. Text points into the image.
+*/
+typedef struct {
+	int type;  /* SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT */
+	int64_t i;
+	double r;
+	const char* text;
+} FdbAggValue;
+
+typedef struct {
+	FdbAggValue key;
+	uint32_t hash;
+	int64_t rows;      /* Rows in the group */
+	int64_t count;     /* Non-NULL values of the aggregated column */
+	int64_t isum;      /* Sum of integer values, unless overflowed */
+	bool overflowed;
+	double rsum;       /* Sum of all values, with the error of its additions in rerr */
+	double rerr;
+	FdbAggValue best;  /* Minimum or maximum */
+} FdbGroup;
+
+/*
+** Groups keyed by value, in an open addressing hash table of their indices + 1.
+*/
+typedef struct {
+	FdbGroup* groups;
+	uint32_t ngroups;
+	uint32_t* slots;
+	uint32_t nslots;
+} FdbGroups;
+
+static void fdb_groups_free(FdbGroups* groups) {
+	free(groups->groups);
+	free(groups->slots);
+	memset(groups, 0, sizeof(*groups));
+}
+
+static uint32_t agg_value_hash(const FdbAggValue* value) {
+	uint64_t bits;
+	switch (value->type) {
+		case SQLITE_INTEGER: bits = (uint64_t) value->i; break;
+		case SQLITE_FLOAT: memcpy(&bits, &value->r, sizeof(bits)); break;
+		case SQLITE_TEXT: return fdb_sfhash(value->text, strlen(value->text));
+		default: return 0;
+	}
+	bits *= 0x9E3779B97F4A7C15ull;
+	return (uint32_t) (bits >> 32);
+}
+
+/*
+** Compare two values of the same column, ordered as SQLite orders them with the
+** BINARY collation: NULL first, then numbers, then text.
+*/
+static int agg_value_compare(const FdbAggValue* a, const FdbAggValue* b) {
+	if (a->type != b->type) {
+		return a->type == SQLITE_NULL ? -1 : b->type == SQLITE_NULL ? 1 : a->type == SQLITE_TEXT ? 1 : b->type == SQLITE_TEXT ? -1 : a->type - b->type;
+	}
+	switch (a->type) {
+		case SQLITE_INTEGER: return (a->i > b->i) - (a->i < b->i);
+		case SQLITE_FLOAT: return (a->r > b->r) - (a->r < b->r);
+		case SQLITE_TEXT: return strcmp(a->text, b->text);
+		default: return 0;
+	}
+}
+
+static int compare_groups(const void* a, const void* b) {
+	return agg_value_compare(&((const FdbGroup*) a)->key, &((const FdbGroup*) b)->key);
+}
+
+/*
+** Return the group of a key, adding an empty one if there is none. Returns NULL if
+** out of memory.
+*/
+static FdbGroup* fdb_groups_get(FdbGroups* groups, const FdbAggValue* key, uint32_t hash) {
+	if (groups->nslots > 0) {
+		for (uint32_t s = hash & (groups->nslots - 1); groups->slots[s] != 0; s = (s + 1) & (groups->nslots - 1)) {
+			FdbGroup* group = &groups->groups[groups->slots[s] - 1];
+			if (group->hash == hash && agg_value_compare(&group->key, key) == 0) {
+				return group;
+			}
+		}
+	}
+	if ((groups->ngroups + 1) * 2 > groups->nslots) {
+		uint32_t nslots = groups->nslots > 0 ? groups->nslots * 2 : 64;
+		FdbGroup* grown = realloc(groups->groups, (size_t) nslots / 2 * sizeof(FdbGroup));
+		uint32_t* slots = calloc(nslots, sizeof(uint32_t));
+		if (grown != NULL) {
+			groups->groups = grown;
+		}
+		if (grown == NULL || slots == NULL) {
+			free(slots);
+			return NULL;
+		}
+		for (uint32_t g = 0; g < groups->ngroups; g++) {
+			uint32_t s = groups->groups[g].hash & (nslots - 1);
+			while (slots[s] != 0) {
+				s = (s + 1) & (nslots - 1);
+			}
+			slots[s] = g + 1;
+		}
+		free(groups->slots);
+		groups->slots = slots;
+		groups->nslots = nslots;
+	}
+	uint32_t s = hash & (groups->nslots - 1);
+	while (groups->slots[s] != 0) {
+		s = (s + 1) & (groups->nslots - 1);
+	}
+	groups->slots[s] = groups->ngroups + 1;
+	FdbGroup* group = &groups->groups[groups->ngroups++];
+	memset(group, 0, sizeof(*group));
+	group->key = *key;
+	group->hash = hash;
+	return group;
+}
+
+/*
+** Add r to a floating point sum, keeping the error of the addition the way SQLite's
+** sum() does (Kahan-Babuska-Neumaier summation).
+*/
+static void agg_add_real(FdbGroup* group, double r) {
+	double s = group->rsum;
+	double t = s + r;
+	if ((s < 0 ? -s : s) > (r < 0 ? -r : r)) {
+		group->rerr += (s - t) + r;
+	} else {
+		group->rerr += (r - t) + s;
+	}
+	group->rsum = t;
+}
+
+static void agg_add_int(FdbGroup* group, int64_t i) {
+	if ((i > 0 && group->isum > INT64_MAX - i) || (i < 0 && group->isum < INT64_MIN - i)) {
+		group->overflowed = true;
+	} else {
+		group->isum += i;
+	}
+}
+
+/*
+** Read value j of row i the way SQLite sees it.
+*/
+static FdbAggValue agg_value(const TableInfo* info, uint32_t i, uint32_t j) {
+	FdbAggValue out = {SQLITE_NULL, 0, 0, NULL};
+	const Value* value = batch_value(info, i, j);
+	if (value == NULL) {
+		return out;
+	}
+	if (fdb_value_int(info->image, value, &out.i)) {
+		out.type = SQLITE_INTEGER;
+	} else if (value->data_type == FDB_REAL) {
+		out.type = SQLITE_FLOAT;
+		// -0.0 and 0.0 are the same group
+		out.r = value->value.real == 0 ? 0 : value->value.real;
+	} else if (value->data_type == FDB_NVARCHAR || value->data_type == FDB_TEXT) {
+		out.type = SQLITE_TEXT;
+		out.text = value_text(info->image, value);
+	}
+	return out;
+}
+
+typedef struct {
+	const TableInfo* info;
+	int op;
+	uint32_t group;   /* Grouping column, UINT32_MAX for none */
+	uint32_t column;  /* Aggregated column, UINT32_MAX for rows */
+	uint32_t chunk;   /* Rows per chunk */
+	FdbGroups* chunks;
+	volatile int32_t failed;
+} FdbAggregate;
+
+/*
+** Aggregate the rows of chunk c into its own groups.
+*/
+static void aggregate_chunk(void* ctx, uint32_t c) {
+	FdbAggregate* agg = ctx;
+	const TableInfo* info = agg->info;
+	FdbGroups* groups = &agg->chunks[c];
+	uint32_t start = c * agg->chunk;
+	uint32_t stop = info->nrows - start > agg->chunk ? start + agg->chunk : info->nrows;
+	FdbAggValue none = {SQLITE_NULL, 0, 0, NULL};
+	FdbGroup* group = NULL;
+	for (uint32_t i = start; i < stop; i++) {
+		if (agg->group != UINT32_MAX || group == NULL) {
+			FdbAggValue key = agg->group != UINT32_MAX ? agg_value(info, i, agg->group) : none;
+			group = fdb_groups_get(groups, &key, agg_value_hash(&key));
+			if (group == NULL) {
+				fdb_atomic_store(&agg->failed, 1);
+				return;
+			}
+		}
+		group->rows += 1;
+		if (agg->column == UINT32_MAX) {
+			continue;
+		}
+		FdbAggValue value = agg_value(info, i, agg->column);
+		if (value.type == SQLITE_NULL) {
+			continue;
+		}
+		group->count += 1;
+		if (agg->op == FDB_AGG_MIN || agg->op == FDB_AGG_MAX) {
+			int cmp = group->count == 1 ? 0 : agg_value_compare(&value, &group->best);
+			if (group->count == 1 || (agg->op == FDB_AGG_MIN ? cmp < 0 : cmp > 0)) {
+				group->best = value;
+			}
+		} else if (value.type == SQLITE_INTEGER) {
+			agg_add_int(group, value.i);
+			agg_add_real(group, (double) value.i);
+		} else {
+			agg_add_real(group, value.r);
+		}
+	}
+}
+
+/*
+** Merge the groups of chunk c into those of chunk 0.
+*/
+static bool aggregate_merge(FdbAggregate* agg, uint32_t c) {
+	FdbGroups* into = &agg->chunks[0];
+	FdbGroups* from = &agg->chunks[c];
+	for (uint32_t g = 0; g < from->ngroups; g++) {
+		FdbGroup* src = &from->groups[g];
+		FdbGroup* dst = fdb_groups_get(into, &src->key, src->hash);
+		if (dst == NULL) {
+			return false;
+		}
+		if (src->count > 0 && (agg->op == FDB_AGG_MIN || agg->op == FDB_AGG_MAX)) {
+			int cmp = dst->count == 0 ? 0 : agg_value_compare(&src->best, &dst->best);
+			if (dst->count == 0 || (agg->op == FDB_AGG_MIN ? cmp < 0 : cmp > 0)) {
+				dst->best = src->best;
+			}
+		}
+		dst->rows += src->rows;
+		dst->count += src->count;
+		dst->overflowed = dst->overflowed || src->overflowed;
+		if (!dst->overflowed) {
+			agg_add_int(dst, src->isum);
+		}
+		agg_add_real(dst, src->rsum);
+		dst->rerr += src->rerr;
+	}
+	return true;
+}
+
+typedef struct fdb_aggregate_cursor fdb_aggregate_cursor;
+struct fdb_aggregate_cursor {
+	sqlite3_vtab_cursor base;  /* Base class - must be first */
+	Fdb* fdb;          /* Image of the table, retained while it is used */
+	TableInfo* info;   /* Table whose text the keys point to, in use */
+	int op;
+	int kind;          /* Kind of the aggregated column */
+	FdbGroups groups;  /* Groups in key order */
+	uint32_t index;
+};
+
+static int fdbAggregateConnect(
+	sqlite3 *db,
+	void *pAux,
+	int argc, const char *const*argv,
+	sqlite3_vtab **ppVtab,
+	char **pzErr
+){
+	int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(key, value, rows INTEGER, table_name HIDDEN, group_column HIDDEN, aggregate HIDDEN)");
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+	sqlite3_vtab* pNew = sqlite3_malloc(sizeof(*pNew));
+	*ppVtab = pNew;
+	if (pNew == NULL) {
+		return SQLITE_NOMEM;
+	}
+	memset(pNew, 0, sizeof(*pNew));
+	return SQLITE_OK;
+}
+
+static int fdbAggregateOpen(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
+	fdb_aggregate_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+	if (pCur == NULL) return SQLITE_NOMEM;
+	memset(pCur, 0, sizeof(*pCur));
+	*ppCursor = &pCur->base;
+	return SQLITE_OK;
+}
+
+static void fdbAggregateReset(fdb_aggregate_cursor *pCur) {
+	fdb_groups_free(&pCur->groups);
+	if (pCur->info != NULL) {
+		fdb_table_unuse(pCur->info);
+		pCur->info = NULL;
+	}
+	if (pCur->fdb != NULL) {
+		fdb_release(pCur->fdb);
+		pCur->fdb = NULL;
+	}
+	pCur->index = 0;
+}
+
+static int fdbAggregateClose(sqlite3_vtab_cursor *cur) {
+	fdbAggregateReset((fdb_aggregate_cursor*)cur);
+	sqlite3_free(cur);
+	return SQLITE_OK;
+}
+
+/*
+** The table, grouping column and aggregate are passed as arguments, each bit of idxNum
+** telling whether one of them is. The table and the aggregate are required.
+*/
+static int fdbAggregateBestIndex(sqlite3_vtab* tab, sqlite3_index_info* pIdxInfo) {
+	int args[3] = {-1, -1, -1};
+	for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+		const struct sqlite3_index_constraint* cons = &pIdxInfo->aConstraint[i];
+		if (cons->iColumn < FDB_AGGREGATE_TABLE || cons->op != SQLITE_INDEX_CONSTRAINT_EQ) {
+			continue;
+		}
+		if (!cons->usable) {
+			return SQLITE_CONSTRAINT;
+		}
+		args[cons->iColumn - FDB_AGGREGATE_TABLE] = i;
+	}
+	if (args[0] < 0 || args[2] < 0) {
+		tab->zErrMsg = sqlite3_mprintf("fdb_aggregate: table and aggregate required");
+		return SQLITE_ERROR;
+	}
+	int argc = 0;
+	pIdxInfo->idxNum = 0;
+	for (int a = 0; a < 3; a++) {
+		if (args[a] >= 0) {
+			pIdxInfo->aConstraintUsage[args[a]].argvIndex = ++argc;
+			pIdxInfo->aConstraintUsage[args[a]].omit = true;
+			pIdxInfo->idxNum |= 1 << a;
+		}
+	}
+	pIdxInfo->estimatedCost = 1000;
+	pIdxInfo->estimatedRows = 100;
+	return SQLITE_OK;
+}
+
+/*
+** Find a column of a table by name. Returns UINT32_MAX if there is none.
+*/
+static uint32_t aggregate_column(const TableInfo* info, const char* name) {
+	const Column* columns = desc_columns(info->image, info->desc);
+	for (uint32_t j = 0; j < info->desc->ncolumns; j++) {
+		if (strcmp(column_name(info->image, &columns[j]), name) == 0) {
+			return j;
+		}
+	}
+	return UINT32_MAX;
+}
+
+/*
+** Parse an aggregate like 'sum:level' into its operation and column name. Returns
+** false if it isn't one.
+*/
+static bool aggregate_parse(const char* spec, int* op, const char** column) {
+	const char* colon = strchr(spec, ':');
+	size_t n = colon != NULL ? (size_t) (colon - spec) : strlen(spec);
+	*column = colon != NULL ? colon + 1 : "*";
+	for (int k = FDB_AGG_COUNT; k <= FDB_AGG_MAX; k++) {
+		if (strlen(FDB_AGG_NAMES[k]) == n && sqlite3_strnicmp(spec, FDB_AGG_NAMES[k], (int) n) == 0) {
+			*op = k == FDB_AGG_COUNT && strcmp(*column, "*") == 0 ? FDB_AGG_COUNT_ROWS : k;
+			return k == FDB_AGG_COUNT || colon != NULL;
+		}
+	}
+	return false;
+}
+
+/*
+** Look the table up, check the arguments and aggregate all of its rows. The table stays
+** in use until the cursor is reset, as keys and results may point to its text.
+*/
+static char* fdbAggregateRun(fdb_aggregate_cursor *pCur, const char* zTable, const char* zGroup, const char* zSpec) {
+	const char* zColumn;
+	int op;
+	if (!aggregate_parse(zSpec, &op, &zColumn)) {
+		return sqlite3_mprintf("fdb_aggregate: unknown aggregate: %s", zSpec);
+	}
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	for (Fdb* fdb = fdb_images; fdb != NULL && pCur->fdb == NULL; fdb = fdb->next) {
+		for (uint32_t i = 0; i < fdb->ntables; i++) {
+			if (strcmp(fdb->info[i].name, zTable) == 0) {
+				fdb->refs += 1;
+				pCur->fdb = fdb;
+				pCur->info = &fdb->info[i];
+				break;
+			}
+		}
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+	if (pCur->fdb == NULL) {
+		return sqlite3_mprintf("fdb_aggregate: no such table: %s", zTable);
+	}
+	char* zErr = fdb_table_use(pCur->fdb, pCur->info);
+	if (zErr != NULL) {
+		pCur->info = NULL;
+		return zErr;
+	}
+	TableInfo* info = pCur->info;
+	const Column* columns = desc_columns(info->image, info->desc);
+
+	FdbAggregate agg = {info, op, UINT32_MAX, UINT32_MAX, info->nrows / FDB_AGGREGATE_CHUNKS + 1, NULL, 0};
+	if (zGroup != NULL && zGroup[0] != 0) {
+		agg.group = aggregate_column(info, zGroup);
+		if (agg.group == UINT32_MAX) {
+			return sqlite3_mprintf("fdb_aggregate: no such column: %s.%s", zTable, zGroup);
+		}
+		if (!fdb_column_typed(info, agg.group)) {
+			return sqlite3_mprintf("fdb_aggregate: can't group by %s.%s, it holds values of several types", zTable, zGroup);
+		}
+	}
+	if (op != FDB_AGG_COUNT_ROWS) {
+		agg.column = aggregate_column(info, zColumn);
+		if (agg.column == UINT32_MAX) {
+			return sqlite3_mprintf("fdb_aggregate: no such column: %s.%s", zTable, zColumn);
+		}
+		pCur->kind = fdb_column_kind(columns[agg.column].data_type);
+		if (op != FDB_AGG_COUNT && !fdb_column_typed(info, agg.column)) {
+			return sqlite3_mprintf("fdb_aggregate: can't %s %s.%s, it holds values of several types", FDB_AGG_NAMES[op], zTable, zColumn);
+		}
+		if (op >= FDB_AGG_SUM && op <= FDB_AGG_AVG && pCur->kind == FDB_KIND_TEXT) {
+			return sqlite3_mprintf("fdb_aggregate: can't %s the text of %s.%s", FDB_AGG_NAMES[op], zTable, zColumn);
+		}
+	}
+	pCur->op = op;
+
+	uint32_t nchunks = (info->nrows + agg.chunk - 1) / agg.chunk;
+	agg.chunks = calloc(nchunks > 0 ? nchunks : 1, sizeof(FdbGroups));
+	if (agg.chunks == NULL) {
+		return sqlite3_mprintf("fdb_aggregate: out of memory");
+	}
+	fdb_parallel_for(fdb_cpu_count(), nchunks, aggregate_chunk, &agg);
+	bool ok = !agg.failed;
+	for (uint32_t c = 1; ok && c < nchunks; c++) {
+		ok = aggregate_merge(&agg, c);
+	}
+	if (ok && agg.group == UINT32_MAX && agg.chunks[0].ngroups == 0) {
+		// an empty table still has its one group, as in SQLite without GROUP BY
+		FdbAggValue none = {SQLITE_NULL, 0, 0, NULL};
+		ok = fdb_groups_get(&agg.chunks[0], &none, 0) != NULL;
+	}
+	for (uint32_t c = 1; c < nchunks; c++) {
+		fdb_groups_free(&agg.chunks[c]);
+	}
+	pCur->groups = agg.chunks[0];
+	free(agg.chunks);
+	if (!ok) {
+		return sqlite3_mprintf("fdb_aggregate: out of memory");
+	}
+	qsort(pCur->groups.groups, pCur->groups.ngroups, sizeof(FdbGroup), compare_groups);
+	for (uint32_t g = 0; op == FDB_AGG_SUM && g < pCur->groups.ngroups; g++) {
+		if (pCur->groups.groups[g].overflowed && pCur->kind == FDB_KIND_INT) {
+			return sqlite3_mprintf("integer overflow");
+		}
+	}
+	return NULL;
+}
+
+static int fdbAggregateFilter(
+	sqlite3_vtab_cursor *pVtabCursor,
+	int idxNum, const char *idxStr,
+	int argc, sqlite3_value **argv
+){
+	fdb_aggregate_cursor *pCur = (fdb_aggregate_cursor*)pVtabCursor;
+	fdbAggregateReset(pCur);
+	const char* args[3] = {NULL, NULL, NULL};
+	int k = 0;
+	for (int a = 0; a < 3; a++) {
+		if (idxNum & (1 << a)) {
+			args[a] = (const char*) sqlite3_value_text(argv[k++]);
+		}
+	}
+	if (args[0] == NULL || args[2] == NULL) {
+		pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("fdb_aggregate: table and aggregate required");
+		return SQLITE_ERROR;
+	}
+	char* zErr = fdbAggregateRun(pCur, args[0], args[1], args[2]);
+	if (zErr != NULL) {
+		fdbAggregateReset(pCur);
+		sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+		pVtabCursor->pVtab->zErrMsg = zErr;
+		return SQLITE_ERROR;
+	}
+	return SQLITE_OK;
+}
+
+static int fdbAggregateNext(sqlite3_vtab_cursor *cur) {
+	((fdb_aggregate_cursor*)cur)->index += 1;
+	return SQLITE_OK;
+}
+
+static int fdbAggregateEof(sqlite3_vtab_cursor *cur) {
+	fdb_aggregate_cursor *pCur = (fdb_aggregate_cursor*)cur;
+	return pCur->index >= pCur->groups.ngroups;
+}
+
+static void aggregate_result(sqlite3_context *ctx, const FdbAggValue* value) {
+	switch (value->type) {
+		case SQLITE_INTEGER: sqlite3_result_int64(ctx, value->i); break;
+		case SQLITE_FLOAT: sqlite3_result_double(ctx, value->r); break;
+		case SQLITE_TEXT: sqlite3_result_text(ctx, value->text, -1, SQLITE_TRANSIENT); break;
+	}
+}
+
+static int fdbAggregateColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int i) {
+	fdb_aggregate_cursor *pCur = (fdb_aggregate_cursor*)cur;
+	const FdbGroup* group = &pCur->groups.groups[pCur->index];
+	// integer sums are exact unless they overflowed, as in SQLite's sum()
+	bool exact = pCur->kind == FDB_KIND_INT && !group->overflowed;
+	switch (i) {
+		case FDB_AGGREGATE_KEY:
+			aggregate_result(ctx, &group->key);
+			break;
+		case FDB_AGGREGATE_ROWS:
+			sqlite3_result_int64(ctx, group->rows);
+			break;
+		case FDB_AGGREGATE_VALUE:
+			switch (pCur->op) {
+				case FDB_AGG_COUNT_ROWS: sqlite3_result_int64(ctx, group->rows); break;
+				case FDB_AGG_COUNT: sqlite3_result_int64(ctx, group->count); break;
+				case FDB_AGG_SUM:
+					if (group->count > 0 && exact) {
+						sqlite3_result_int64(ctx, group->isum);
+					} else if (group->count > 0) {
+						sqlite3_result_double(ctx, group->rsum + group->rerr);
+					}
+					break;
+				case FDB_AGG_TOTAL: sqlite3_result_double(ctx, exact ? (double) group->isum : group->rsum + group->rerr); break;
+				case FDB_AGG_AVG:
+					if (group->count > 0) {
+						sqlite3_result_double(ctx, (exact ? (double) group->isum : group->rsum + group->rerr) / group->count);
+					}
+					break;
+				default:
+					if (group->count > 0) {
+						aggregate_result(ctx, &group->best);
+					}
+					break;
+			}
+			break;
+	}
+	return SQLITE_OK;
+}
+
+static int fdbAggregateRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+	*pRowid = ((fdb_aggregate_cursor*)cur)->index;
+	return SQLITE_OK;
+}
+
+static sqlite3_module fdbAggregateModule = {
+	/* iVersion		*/ 0,
+	/* xCreate		 */ 0,
+	/* xConnect		*/ fdbAggregateConnect,
+	/* xBestIndex	*/ fdbAggregateBestIndex,
+	/* xDisconnect */ fdbTablesDisconnect,
+	/* xDestroy		*/ 0,
+	/* xOpen			 */ fdbAggregateOpen,
+	/* xClose			*/ fdbAggregateClose,
+	/* xFilter		 */ fdbAggregateFilter,
+	/* xNext			 */ fdbAggregateNext,
+	/* xEof				*/ fdbAggregateEof,
+	/* xColumn		 */ fdbAggregateColumn,
+	/* xRowid			*/ fdbAggregateRowid,
+	/* xUpdate		 */ 0,
+	/* xBegin			*/ 0,
+	/* xSync			 */ 0,
+	/* xCommit		 */ 0,
+	/* xRollback	 */ 0,
+	/* xFindMethod */ 0,
+	/* xRename		 */ 0,
+	/* xSavepoint	*/ 0,
+	/* xRelease		*/ 0,
+	/* xRollbackTo */ 0,
+	/* xShadowName */ 0
+};
@@ -0,0 +1,220 @@
+/*
+** Columnar copies of tables. Reading one column from the row layout touches each
+** row's Row, its Value array and, for 64 bit integers and text, the out of line data,
+** so scans that aggregate a few columns of a big table pull most of the table through
+** the cache. With the columnar=1 option, the first full scan of a table copies it
+** into one typed array per column plus a null bitmap, in the order of the table's
+** dense rows, and later scans read their columns from there.
+**
+** Scans that read only a column or two (see FDB_NARROW_COLUMNS) get copies of just
+** those columns, without the option, so narrow scans and counts never touch the rows.
+** Columns are copied the first time such a scan needs them and kept in the same array,
+** which a full copy completes. Lookups use the copies once they exist, comparing a
+** bucket's keys in a plain array, but never make them: that would put a pass over the
+** whole table on the path of a single row.
+**
+** Text columns keep pointers into the image rather than copies, so in-place UPDATEs
+** of text are seen by both layouts. Other UPDATEs are written to both.
+*/
+
+#define FDB_NARROW_COLUMNS 2  /* Columns a query reads at most to get copies of them */
+
+static size_t columnar_value_size(uint32_t data_type) {
+	switch (data_type) {
+		case FDB_I32: return sizeof(int32_t);
+		case FDB_U32: return sizeof(uint32_t);
+		case FDB_REAL: return sizeof(float);
+		case FDB_BOOLEAN: return sizeof(uint8_t);
+		case FDB_I64: return sizeof(int64_t);
+		case FDB_U64: return sizeof(uint64_t);
+		case FDB_NVARCHAR:
+		case FDB_TEXT: return sizeof(const char*);
+		default: return 0;
+	}
+}
+
+/*
+** Copy row i of a table into its columnar copy. Returns false if a value doesn't have
+** its column's type, in which case that column has to be read from the rows.
+*/
+static bool columnar_store(const char* image, ColumnData* column, uint32_t i, const Row* row, uint32_t j) {
+	uint8_t bit = 1 << (i & 7);
+	const Value* value = j < row->nvalues ? &row_values(image, row)[j] : NULL;
+	if (value == NULL || value->data_type == FDB_NULL) {
+		column->nulls[i >> 3] |= bit;
+		return true;
+	}
+	column->nulls[i >> 3] &= ~bit;
+	if (value->data_type != column->data_type) {
+		return false;
+	}
+	switch (column->data_type) {
+		case FDB_I32: ((int32_t*) column->values)[i] = value->value.i32; break;
+		case FDB_U32: ((uint32_t*) column->values)[i] = value->value.u32; break;
+		case FDB_REAL: ((float*) column->values)[i] = value->value.real; break;
+		case FDB_BOOLEAN: ((uint8_t*) column->values)[i] = value->value.boolean; break;
+		case FDB_I64: ((int64_t*) column->values)[i] = *value_i64p(image, value); break;
+		case FDB_U64: ((uint64_t*) column->values)[i] = *value_u64p(image, value); break;
+		case FDB_NVARCHAR:
+		case FDB_TEXT: ((const char**) column->values)[i] = value_text(image, value); break;
+	}
+	return true;
+}
+
+void fdb_columnar_free(TableInfo* info) {
+	if (info->columnar != NULL) {
+		for (uint32_t j = 0; j < info->desc->ncolumns; j++) {
+			free(info->columnar[j].nulls);
+			free(info->columnar[j].values);
+		}
+		free(info->columnar);
+	}
+	info->columnar = NULL;
+	info->columnar_size = 0;
+	fdb_atomic_store(&info->columnar_ready, 0);
+	fdb_atomic_store(&info->columnar_copied, 0);
+}
+
+/*
+** Bit of column j in a mask of columns like sqlite3_index_info.colUsed, where the last
+** bit stands for all columns from 63 on.
+*/
+static inline uint64_t fdb_column_bit(uint32_t j) {
+	return (uint64_t) 1 << (j < 63 ? j : 63);
+}
+
+/*
+** Copy the columns of a mask that haven't been copied yet, which have no null bitmap.
+** Called with the table's mutex held; cursors only read the columns they had copied
+** under the mutex, so others can be added while they run.
+*/
+static char* columnar_build(TableInfo* info, uint64_t used) {
+	uint32_t ncolumns = info->desc->ncolumns;
+	uint32_t nrows = info->nrows;
+	const Column* columns = desc_columns(info->image, info->desc);
+	if (info->columnar == NULL) {
+		info->columnar = calloc(ncolumns > 0 ? ncolumns : 1, sizeof(ColumnData));
+		if (info->columnar == NULL) {
+			return sqlite3_mprintf("fdb: out of memory building columns of %s", info->name);
+		}
+	}
+	size_t nbytes = ((size_t) nrows + 7) / 8;
+	bool* copying = calloc(ncolumns > 0 ? ncolumns : 1, sizeof(bool));  /* Columns copied now */
+	if (copying == NULL) {
+		return sqlite3_mprintf("fdb: out of memory building columns of %s", info->name);
+	}
+	uint32_t ncopying = 0;
+	for (uint32_t j = 0; j < ncolumns; j++) {
+		ColumnData* column = &info->columnar[j];
+		if (column->nulls != NULL || !(used & fdb_column_bit(j))) {
+			continue;
+		}
+		column->data_type = columns[j].data_type;
+		size_t value_size = columnar_value_size(column->data_type);
+		column->nulls = malloc(nbytes > 0 ? nbytes : 1);
+		column->values = value_size > 0 ? malloc(nrows > 0 ? (size_t) nrows * value_size : 1) : NULL;
+		copying[j] = true;
+		ncopying += 1;
+		if (column->nulls == NULL || (value_size > 0 && column->values == NULL)) {
+			for (uint32_t k = 0; k <= j; k++) {
+				if (copying[k]) {
+					free(info->columnar[k].nulls);
+					free(info->columnar[k].values);
+					info->columnar[k].nulls = NULL;
+					info->columnar[k].values = NULL;
+				}
+			}
+			free(copying);
+			return sqlite3_mprintf("fdb: out of memory building columns of %s", info->name);
+		}
+	}
+	int32_t copied = fdb_atomic_load(&info->columnar_copied);
+	for (uint32_t j = 0; j < ncolumns; j++) {
+		if (copying[j]) {
+			info->columnar_size += nbytes + (size_t) nrows * columnar_value_size(info->columnar[j].data_type);
+			copied |= j < 31 ? (int32_t) 1 << j : 0;
+		}
+	}
+
+	// row by row, so every row is read only once
+	for (uint32_t i = 0; i < nrows && ncopying > 0; i++) {
+		const Row* row = info->rows[i];
+		for (uint32_t j = 0; j < ncolumns; j++) {
+			ColumnData* column = &info->columnar[j];
+			if (copying[j] && column->values != NULL && !columnar_store(info->image, column, i, row, j)) {
+				info->columnar_size -= (size_t) nrows * columnar_value_size(column->data_type);
+				free(column->values);
+				column->values = NULL;
+			}
+		}
+	}
+	// published once the copies are complete, see fdb_table_columns()
+	fdb_atomic_store(&info->columnar_copied, copied);
+	free(copying);
+	return NULL;
+}
+
+/*
+** Return the columnar copy of a prepared table, building it if needed. Returns NULL
+** if it can't be built, scans then simply read from the rows.
+*/
+ColumnData* fdb_table_columnar(TableInfo* info) {
+	if (!fdb_atomic_load(&info->columnar_ready)) {
+		sqlite3_mutex_enter(info->mutex);
+		if (!fdb_atomic_load(&info->columnar_ready)) {
+			char* zErr = columnar_build(info, UINT64_MAX);
+			if (zErr == NULL) {
+				fdb_atomic_store(&info->columnar_ready, 1);
+			}
+			sqlite3_free(zErr);
+		}
+		sqlite3_mutex_leave(info->mutex);
+	}
+	return fdb_atomic_load(&info->columnar_ready) ? info->columnar : NULL;
+}
+
+/*
+** Return the columnar copy of a prepared table with at least the columns of a mask
+** copied, copying them if needed and build is set. Other columns may be missing.
+** Returns NULL if the columns aren't or can't be copied.
+*/
+ColumnData* fdb_table_columns(TableInfo* info, uint64_t used, bool build) {
+	if (fdb_atomic_load(&info->columnar_ready)) {
+		return info->columnar;
+	}
+	// without taking the mutex if the columns have been copied, for lookups
+	if (used >> 31 == 0 && (used & ~(uint64_t) (uint32_t) fdb_atomic_load(&info->columnar_copied)) == 0) {
+		return info->columnar;
+	}
+	if (!build) {
+		return NULL;
+	}
+	sqlite3_mutex_enter(info->mutex);
+	char* zErr = columnar_build(info, used);
+	ColumnData* columnar = zErr == NULL ? info->columnar : NULL;
+	sqlite3_mutex_leave(info->mutex);
+	sqlite3_free(zErr);
+	return columnar;
+}
+
+/*
+** Bring the columnar copy of row i up to date after an UPDATE.
+*/
+void fdb_columnar_update(TableInfo* info, uint32_t i) {
+	sqlite3_mutex_enter(info->mutex);
+	for (uint32_t j = 0; info->columnar != NULL && j < info->desc->ncolumns; j++) {
+		ColumnData* column = &info->columnar[j];
+		if (column->values != NULL) {
+			// updates never change a value's type, so this can't fail
+			columnar_store(info->image, column, i, info->rows[i], j);
+		}
+	}
+	sqlite3_mutex_leave(info->mutex);
+}
+
+size_t fdb_columnar_size(TableInfo* info) {
+	sqlite3_mutex_enter(info->mutex);
+	size_t size = info->columnar_size;
+	sqlite3_mutex_leave(info->mutex);
+	return size;
+}
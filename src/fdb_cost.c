@@ -0,0 +1,262 @@
+/*
+** Statistics for fdbBestIndex(), so the planner gets row counts and costs close to
+** the real ones and picks sensible join orders. What the hash table looks like is
+** recorded while the table is prepared (see fdb_prepare_table()). Per column
+** statistics take a pass over the column's values and are gathered the first time a
+** plan needs them.
+**
+** Costs are in rows read.
+*/
+
+#define FDB_COST_SKETCH 256  /* Smallest hashes kept to estimate distinct values */
+#define FDB_COST_IN_LIST 25  /* Values assumed in an IN list, SQLite guesses the same */
+#define FDB_COST_PREFIX 0.0625  /* Rows left by a pattern's prefix, as by two bounds */
+
+/*
+** Add a hash to a sketch of the n smallest distinct hashes seen, kept sorted.
+*/
+static void sketch_add(uint64_t* sketch, uint32_t* n, uint64_t hash) {
+	if (*n == FDB_COST_SKETCH && hash >= sketch[FDB_COST_SKETCH - 1]) {
+		return;
+	}
+	uint32_t lo = 0;
+	uint32_t hi = *n;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (sketch[mid] < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo < *n && sketch[lo] == hash) {
+		return;
+	}
+	uint32_t kept = *n < FDB_COST_SKETCH ? *n : FDB_COST_SKETCH - 1;
+	memmove(sketch + lo + 1, sketch + lo, (kept - lo) * sizeof(uint64_t));
+	sketch[lo] = hash;
+	*n = kept + 1;
+}
+
+static int compare_hashes(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+/*
+** Look at every value of column j: count NULLs, estimate how many distinct values
+** there are from the smallest hashes, and for the key check whether a row shares its
+** key with another one in the same bucket. Equal hashes are taken as equal keys.
+*/
+static void column_stats_build(const TableInfo* info, uint32_t j, FdbColumnStats* stats) {
+	int kind = fdb_column_kind(desc_columns(info->image, info->desc)[j].data_type);
+	uint64_t sketch[FDB_COST_SKETCH];
+	uint32_t n = 0;
+	uint64_t* chain = j == 0 ? malloc((info->max_chain > 0 ? info->max_chain : 1) * sizeof(uint64_t)) : NULL;
+	stats->unique = chain != NULL;
+	stats->nulls = 0;
+	for (uint32_t b = 0; b < info->hash_table->nbuckets; b++) {
+		uint32_t nchain = 0;
+		for (uint32_t i = info->bucket_starts[b]; i < info->bucket_starts[b + 1]; i++) {
+			uint64_t hash;
+			bool odd = false;
+			if (!index_hash_value(info, i, j, kind, &hash, &odd)) {
+				stats->nulls += 1;
+				continue;
+			}
+			sketch_add(sketch, &n, hash);
+			if (chain != NULL) {
+				chain[nchain++] = hash;
+			}
+		}
+		if (chain != NULL && stats->unique && nchain > 1) {
+			qsort(chain, nchain, sizeof(uint64_t), compare_hashes);
+			for (uint32_t k = 1; k < nchain; k++) {
+				stats->unique = stats->unique && chain[k] != chain[k - 1];
+			}
+		}
+	}
+	free(chain);
+	uint32_t values = info->nrows - stats->nulls;
+	if (n < FDB_COST_SKETCH) {
+		stats->distinct = n;
+	} else {
+		double estimate = (double) (FDB_COST_SKETCH - 1) * 18446744073709551616.0 / (double) sketch[FDB_COST_SKETCH - 1];
+		stats->distinct = estimate < values ? (uint32_t) estimate : values;
+	}
+	stats->ready = true;
+}
+
+/*
+** Return the statistics of column j of a prepared table, gathering them if needed.
+** Without memory for them, nothing is known: every row is taken to be distinct.
+*/
+static FdbColumnStats fdb_column_stats(TableInfo* info, uint32_t j) {
+	FdbColumnStats stats = { true, false, info->nrows, 0 };
+	sqlite3_mutex_enter(info->mutex);
+	if (info->stats == NULL) {
+		info->stats = calloc(info->desc->ncolumns > 0 ? info->desc->ncolumns : 1, sizeof(FdbColumnStats));
+	}
+	if (info->stats != NULL) {
+		if (!info->stats[j].ready) {
+			column_stats_build(info, j, &info->stats[j]);
+		}
+		stats = info->stats[j];
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return stats;
+}
+
+/*
+** Forget the statistics of column j after an UPDATE changed the column.
+*/
+static void fdb_column_stats_drop(TableInfo* info, uint32_t j) {
+	sqlite3_mutex_enter(info->mutex);
+	if (info->stats != NULL) {
+		info->stats[j].ready = false;
+	}
+	sqlite3_mutex_leave(info->mutex);
+}
+
+/*
+** Estimate the fraction of rows a predicate on column j lets through.
+*/
+static double fdb_cost_selectivity(TableInfo* info, uint32_t j, int op) {
+	if (info->nrows == 0) {
+		return 1;
+	}
+	FdbColumnStats stats;
+	switch (op) {
+		case SQLITE_INDEX_CONSTRAINT_EQ:
+		case SQLITE_INDEX_CONSTRAINT_IS:
+			stats = fdb_column_stats(info, j);
+			return stats.distinct > 0 ? (double) (info->nrows - stats.nulls) / info->nrows / stats.distinct : 0;
+		case SQLITE_INDEX_CONSTRAINT_NE:
+			stats = fdb_column_stats(info, j);
+			return stats.distinct > 0 ? (double) (info->nrows - stats.nulls) / info->nrows * (1 - 1.0 / stats.distinct) : 0;
+		case SQLITE_INDEX_CONSTRAINT_ISNOT:
+			// NULLs pass as well
+			stats = fdb_column_stats(info, j);
+			return stats.distinct > 0 ? 1 - (double) (info->nrows - stats.nulls) / info->nrows / stats.distinct : 1;
+		case SQLITE_INDEX_CONSTRAINT_ISNULL:
+			return (double) fdb_column_stats(info, j).nulls / info->nrows;
+		case SQLITE_INDEX_CONSTRAINT_ISNOTNULL:
+			return 1 - (double) fdb_column_stats(info, j).nulls / info->nrows;
+		default:
+			// a bound lets through a quarter of the rows, a guess SQLite makes as well
+			return 0.25;
+	}
+}
+
+/*
+** Rows of the chain the average existing key is in. Buckets are weighed by their
+** rows, as longer chains hold more of the keys looked up.
+*/
+static double fdb_cost_chain(const TableInfo* info) {
+	return info->nrows > 0 ? (double) info->chain_squares / info->nrows : 0;
+}
+
+/*
+** Estimate the rows an equality lookup of a key returns and reads. If the key is
+** known, its bucket is looked at: the rows read are exact and so are the rows
+** returned, unless some of the bucket's keys have another type.
+*/
+static void fdb_cost_key_eq(TableInfo* info, sqlite3_value* rhs, double* rows, double* read) {
+	uint32_t data_type = desc_columns(info->image, info->desc)[0].data_type;
+	uint32_t nbuckets = info->hash_table->nbuckets;
+	FdbPredicate pred;
+	if (rhs != NULL && nbuckets > 0 && fdb_predicate_init(&pred, 0, data_type, SQLITE_INDEX_CONSTRAINT_EQ, rhs)) {
+		uint32_t bucket = UINT32_MAX;
+		if (pred.op == FDB_PRED_EQ && pred.kind == FDB_KIND_TEXT) {
+			bucket = fdb_sfhash(pred.text, pred.ntext) & (nbuckets - 1);
+		} else if (pred.op == FDB_PRED_EQ && pred.kind == FDB_KIND_INT) {
+			bucket = (uint64_t) pred.i & (nbuckets - 1);
+		}
+		if (bucket != UINT32_MAX) {
+			uint32_t start = info->bucket_starts[bucket];
+			uint32_t stop = info->bucket_starts[bucket + 1];
+			uint32_t matches = 0;
+			for (uint32_t i = start; i < stop; i += FDB_BATCH) {
+				uint32_t n = stop - i < FDB_BATCH ? stop - i : FDB_BATCH;
+				matches += fdb_popcount64(fdb_predicates_test(info, NULL, &pred, 1, NULL, i, n));
+			}
+			sqlite3_free(pred.text);
+			*rows = matches;
+			*read = stop - start;
+			return;
+		}
+		sqlite3_free(pred.text);
+	}
+	FdbColumnStats stats = fdb_column_stats(info, 0);
+	*rows = stats.distinct > 0 ? (double) (info->nrows - stats.nulls) / stats.distinct : 0;
+	*read = fdb_cost_chain(info);
+}
+
+/*
+** Estimate the fraction of the rows whose integer key lies in [lo, hi], taking keys
+** to be spread evenly between the smallest and the largest one.
+*/
+static double fdb_cost_key_range(const TableInfo* info, int64_t lo, int64_t hi) {
+	if (info->key_min > info->key_max) {
+		return 0.25;
+	}
+	lo = lo > info->key_min ? lo : info->key_min;
+	hi = hi < info->key_max ? hi : info->key_max;
+	if (lo > hi) {
+		return 0;
+	}
+	return ((double) hi - (double) lo + 1) / ((double) info->key_max - (double) info->key_min + 1);
+}
+
+/*
+** Narrow [*lo, *hi] by a bound (<, <=, >, >=) on an integer key. Returns false if
+** the bound's constant isn't a known integer.
+*/
+static bool fdb_cost_bound(int op, sqlite3_value* rhs, int64_t* lo, int64_t* hi) {
+	if (rhs == NULL || sqlite3_value_type(rhs) != SQLITE_INTEGER) {
+		return false;
+	}
+	int64_t c = sqlite3_value_int64(rhs);
+	if (op == SQLITE_INDEX_CONSTRAINT_LT || op == SQLITE_INDEX_CONSTRAINT_LE) {
+		c = op == SQLITE_INDEX_CONSTRAINT_LT && c > INT64_MIN ? c - 1 : c;
+		*hi = c < *hi ? c : *hi;
+	} else {
+		c = op == SQLITE_INDEX_CONSTRAINT_GT && c < INT64_MAX ? c + 1 : c;
+		*lo = c > *lo ? c : *lo;
+	}
+	return true;
+}
+
+/*
+** Estimate the fraction of the rows of column j a LIKE or GLOB pattern leaves to read:
+** those starting with its prefix, or those holding its rarest trigram if the prefix is
+** short and the column has a trigram index. A pattern not known while planning is
+** guessed to leave a quarter of them.
+*/
+static double fdb_cost_pattern(TableInfo* info, uint32_t j, sqlite3_value* pattern, int op) {
+	if (pattern == NULL) {
+		return 0.25;
+	}
+	const char* text = sqlite3_value_type(pattern) == SQLITE_TEXT ? (const char*) sqlite3_value_text(pattern) : NULL;
+	size_t n = text != NULL ? fdb_pattern_prefix(text, op) : 0;
+	if (n >= 3 || text == NULL) {
+		return n > 0 ? FDB_COST_PREFIX : 1;
+	}
+	uint32_t rows = fdb_trigrams_estimate(info, j, text, op);
+	if (rows != UINT32_MAX && info->nrows > 0) {
+		return (double) rows / info->nrows;
+	}
+	return n > 0 ? FDB_COST_PREFIX : 1;
+}
+
+/*
+** Rows read by a binary search of a sorted view.
+*/
+static double fdb_cost_search(const TableInfo* info) {
+	double steps = 1;
+	for (uint32_t n = info->nrows; n > 1; n >>= 1) {
+		steps += 1;
+	}
+	return steps;
+}
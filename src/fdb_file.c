@@ -0,0 +1,407 @@
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+
+/*
+** Options that can be given when opening a fdb file, as 'name=value' arguments
+** to fdb_load() or the fdb module.
+*/
+typedef struct {
+	bool eager;        /* prepare=eager: prepare all tables at load instead of on first use */
+	uint32_t threads;  /* threads=N: worker threads for eager preparation, 0 = one per CPU */
+	bool validate;     /* validate=1: check every offset in the file once at load */
+	bool snapshot;     /* snapshot=1: open through a flattened, validated copy kept next to the file */
+	int hugepages;     /* hugepages=off|transparent|explicit: copy the image into huge pages at load */
+	bool lock;         /* mlock=1: lock tables into memory as they are prepared */
+	bool columnar;     /* columnar=1: keep a columnar copy of tables that are scanned in full */
+	int advice;        /* madvise=normal|random|sequential: access pattern hint for the mapping */
+} FdbOptions;
+
+/*
+** Parse a single 'name=value' option. Returns false and sets *pzErr for unknown options.
+*/
+bool fdb_parse_option(FdbOptions* options, const char* arg, char** pzErr) {
+	const char* eq = strchr(arg, '=');
+	if (eq == NULL) {
+		*pzErr = sqlite3_mprintf("fdb: expected name=value option, got '%s'", arg);
+		return false;
+	}
+	size_t nname = eq - arg;
+	const char* value = eq + 1;
+	if (nname == 7 && strncmp(arg, "prepare", nname) == 0) {
+		if (strcmp(value, "eager") == 0) {
+			options->eager = true;
+			return true;
+		}
+		if (strcmp(value, "lazy") == 0) {
+			options->eager = false;
+			return true;
+		}
+	} else if (nname == 7 && strncmp(arg, "threads", nname) == 0) {
+		options->threads = (uint32_t) atoi(value);
+		return true;
+	} else if (nname == 8 && strncmp(arg, "validate", nname) == 0) {
+		options->validate = atoi(value) != 0;
+		return true;
+	} else if (nname == 8 && strncmp(arg, "snapshot", nname) == 0) {
+		options->snapshot = atoi(value) != 0;
+		return true;
+	} else if (nname == 9 && strncmp(arg, "hugepages", nname) == 0) {
+		const char* modes[] = {"off", "transparent", "explicit"};
+		for (int i = 0; i < 3; i++) {
+			if (strcmp(value, modes[i]) == 0) {
+				options->hugepages = i;
+				return true;
+			}
+		}
+	} else if (nname == 8 && strncmp(arg, "columnar", nname) == 0) {
+		options->columnar = atoi(value) != 0;
+		return true;
+	} else if (nname == 5 && strncmp(arg, "mlock", nname) == 0) {
+		options->lock = atoi(value) != 0;
+		return true;
+	} else if (nname == 7 && strncmp(arg, "madvise", nname) == 0) {
+		const char* advice[] = {"normal", "random", "sequential"};
+		for (int i = 0; i < 3; i++) {
+			if (strcmp(value, advice[i]) == 0) {
+				options->advice = FDB_ADVICE_NORMAL + i;
+				return true;
+			}
+		}
+	}
+	*pzErr = sqlite3_mprintf("fdb: unknown option '%s'", arg);
+	return false;
+}
+
+void fdb_unmap(char* base, size_t size) {
+	#ifdef _WIN32
+		UnmapViewOfFile(base);
+	#else
+		munmap(base, size);
+	#endif
+}
+
+/*
+** Map a fdb file into memory. The mapping is private, so the file is never modified:
+** pages are shared with other processes through the page cache until an UPDATE
+** writes to them, at which point that page is copied.
+*/
+Fdb* get_fdb_from_file(const char* path, const FdbOptions* options, char** pzErr) {
+	char* base;
+	size_t size;
+	#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			*pzErr = sqlite3_mprintf("fdb: can't open '%s'", path);
+			return NULL;
+		}
+		LARGE_INTEGER fsize;
+		if (!GetFileSizeEx(file, &fsize) || fsize.QuadPart < sizeof(FdbHeader)) {
+			CloseHandle(file);
+			*pzErr = sqlite3_mprintf("fdb: file too small");
+			return NULL;
+		}
+		size = (size_t) fsize.QuadPart;
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		CloseHandle(file);
+		if (mapping == NULL) {
+			*pzErr = sqlite3_mprintf("fdb: can't map '%s'", path);
+			return NULL;
+		}
+		base = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		CloseHandle(mapping);
+		if (base == NULL) {
+			*pzErr = sqlite3_mprintf("fdb: can't map '%s'", path);
+			return NULL;
+		}
+	#else
+		int fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			*pzErr = sqlite3_mprintf("fdb: can't open '%s'", path);
+			return NULL;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < sizeof(FdbHeader)) {
+			close(fd);
+			*pzErr = sqlite3_mprintf("fdb: file too small");
+			return NULL;
+		}
+		size = (size_t) st.st_size;
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) {
+			*pzErr = sqlite3_mprintf("fdb: can't map '%s'", path);
+			return NULL;
+		}
+	#endif
+
+	bool packed = ((FdbPackHeader*) base)->magic == FDB_PACK_MAGIC;
+	*pzErr = packed ? fdb_validate_pack_header(base, size) : fdb_validate_header(base, size);
+	if (*pzErr != NULL) {
+		fdb_unmap(base, size);
+		return NULL;
+	}
+
+	Fdb* fdb = malloc(sizeof(Fdb));
+	if (fdb == NULL) {
+		fdb_unmap(base, size);
+		*pzErr = sqlite3_mprintf("fdb: out of memory");
+		return NULL;
+	}
+	size_t mapped = size;
+	char* copy = NULL;
+	if (!packed && options->hugepages != FDB_HUGEPAGES_OFF) {
+		// the copy is no longer backed by the file, if huge pages aren't available keep the file mapping
+		copy = fdb_map_huge(base, size, options->hugepages, &mapped);
+		if (copy != NULL) {
+			fdb_unmap(base, size);
+			base = copy;
+		}
+	}
+	if (!(packed ? fdb_init_packed(fdb, base, size, (FdbPackHeader*) base) : fdb_init(fdb, base, size, (FdbHeader*) base))) {
+		fdb_unmap(base, mapped);
+		free(fdb);
+		*pzErr = sqlite3_mprintf("fdb: out of memory");
+		return NULL;
+	}
+	fdb->mapped = mapped;
+	fdb->huge = copy != NULL;
+	return fdb;
+}
+
+void close_fdb(Fdb* fdb) {
+	for (uint32_t i = 0; i < fdb->ntables; i++) {
+		fdb_table_clear(&fdb->info[i]);
+		if (fdb->info[i].packed != NULL) {
+			fdb_unlock_table(&fdb->info[i]);
+			free(fdb->info[i].image);
+		}
+		sqlite3_mutex_free(fdb->info[i].mutex);
+	}
+	free(fdb->info);
+	free(fdb->path);
+	fdb_unmap(fdb->base, fdb->mapped);
+	free(fdb);
+}
+
+/*
+** Process-wide registry of loaded images, so that every connection and every table
+** opened from the same file share one mapping. Images are keyed by canonical path
+** and modification time: if the file changes on disk, the next open loads it anew
+** while existing users keep the old image until they release it.
+*/
+static Fdb* fdb_images = NULL;
+
+static sqlite3_mutex* fdb_registry_mutex() {
+	return sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP2);
+}
+
+/*
+** Add an image that isn't backed by a file (the live client image) to the registry,
+** so it shows up in fdb_tables. It is never unloaded.
+*/
+void fdb_register_image(Fdb* fdb) {
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	if (fdb->refs == 0) {
+		fdb->refs = 1;
+		fdb->next = fdb_images;
+		fdb_images = fdb;
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+}
+
+void fdb_retain(Fdb* fdb) {
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	fdb->refs += 1;
+	sqlite3_mutex_leave(fdb_registry_mutex());
+}
+
+/*
+** Drop a reference taken by fdb_acquire() or fdb_retain(), unloading the image once
+** nobody uses it anymore.
+*/
+void fdb_release(void* data) {
+	Fdb* fdb = data;
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	fdb->refs -= 1;
+	bool unload = fdb->refs == 0 && fdb->path != NULL;
+	if (unload) {
+		for (Fdb** p = &fdb_images; *p != NULL; p = &(*p)->next) {
+			if (*p == fdb) {
+				*p = fdb->next;
+				break;
+			}
+		}
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+	if (unload) {
+		close_fdb(fdb);
+	}
+}
+
+/*
+** Return the canonical path of an existing file, with its modification time and size,
+** or NULL if there is no such file. The path is freed with free().
+*/
+static char* fdb_canonical_path(const char* path, int64_t* mtime, size_t* size) {
+	#ifdef _WIN32
+		char* canonical = _fullpath(NULL, path, 0);
+		struct _stat64 st;
+		bool exists = canonical != NULL && _stat64(canonical, &st) == 0;
+	#else
+		char* canonical = realpath(path, NULL);
+		struct stat st;
+		bool exists = canonical != NULL && stat(canonical, &st) == 0;
+	#endif
+	if (!exists) {
+		free(canonical);
+		return NULL;
+	}
+	*mtime = (int64_t) st.st_mtime;
+	*size = (size_t) st.st_size;
+	return canonical;
+}
+
+/*
+** Return true if any image of the file at path is loaded, however old.
+*/
+bool fdb_path_loaded(const char* path) {
+	int64_t mtime;
+	size_t size;
+	char* canonical = fdb_canonical_path(path, &mtime, &size);
+	if (canonical == NULL) {
+		return false;
+	}
+	bool loaded = false;
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	for (Fdb* fdb = fdb_images; fdb != NULL && !loaded; fdb = fdb->next) {
+		loaded = fdb->path != NULL && strcmp(fdb->path, canonical) == 0;
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+	free(canonical);
+	return loaded;
+}
+
+/*
+** Return the image for the file at path, loading it if no up to date copy is loaded
+** yet. Each successful call must be paired with a call to fdb_release().
+*/
+Fdb* fdb_acquire(const char* path, const FdbOptions* options, char** pzErr) {
+	int64_t mtime;
+	size_t size;
+	char* canonical = fdb_canonical_path(path, &mtime, &size);
+	if (canonical == NULL) {
+		*pzErr = sqlite3_mprintf("fdb: can't open '%s'", path);
+		return NULL;
+	}
+
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	Fdb* fdb;
+	for (fdb = fdb_images; fdb != NULL; fdb = fdb->next) {
+		if (fdb->path != NULL && strcmp(fdb->path, canonical) == 0 && fdb->mtime == mtime && fdb->size == size) {
+			break;
+		}
+	}
+	if (fdb != NULL) {
+		fdb->refs += 1;
+		free(canonical);
+	} else {
+		fdb = get_fdb_from_file(canonical, options, pzErr);
+		if (fdb == NULL) {
+			sqlite3_mutex_leave(fdb_registry_mutex());
+			free(canonical);
+			return NULL;
+		}
+		fdb->path = canonical;
+		fdb->mtime = mtime;
+		fdb->refs = 1;
+		fdb->next = fdb_images;
+		fdb_images = fdb;
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+
+	if (options->validate && !fdb->validated) {
+		*pzErr = fdb_validate(fdb);
+		if (*pzErr != NULL) {
+			fdb_release(fdb);
+			return NULL;
+		}
+		fdb->validated = true;
+	}
+	if (options->advice != FDB_ADVICE_NONE) {
+		fdb_advise(fdb->base, fdb->mapped, options->advice);
+	}
+	if (options->lock && !fdb->lock) {
+		fdb->lock = true;
+		for (uint32_t i = 0; i < fdb->ntables; i++) {
+			TableInfo* info = &fdb->info[i];
+			sqlite3_mutex_enter(info->mutex);
+			if (fdb_atomic_load(&info->ready)) {
+				fdb_lock_table(info);
+			}
+			sqlite3_mutex_leave(info->mutex);
+		}
+	}
+	if (options->columnar) {
+		fdb->columnar = true;
+	}
+	if (options->eager) {
+		fdb_prepare_tables(fdb, options->threads);
+	}
+	return fdb;
+}
+
+/*
+** Load an image of the file at path of its own, outside the registry, so it holds
+** what the file holds and none of the UPDATEs made to loaded images of it. It is
+** released with fdb_release() like other images.
+*/
+Fdb* fdb_acquire_private(const char* path, char** pzErr) {
+	int64_t mtime;
+	size_t size;
+	char* canonical = fdb_canonical_path(path, &mtime, &size);
+	if (canonical == NULL) {
+		*pzErr = sqlite3_mprintf("fdb: can't open '%s'", path);
+		return NULL;
+	}
+	FdbOptions options = {0};
+	Fdb* fdb = get_fdb_from_file(canonical, &options, pzErr);
+	if (fdb == NULL) {
+		free(canonical);
+		return NULL;
+	}
+	fdb->path = canonical;
+	fdb->mtime = mtime;
+	fdb->refs = 1;
+	return fdb;
+}
+
+/*
+** Copy a module argument, removing SQL quotes around it if there are any.
+*/
+char* fdb_dequote(const char* arg) {
+	size_t len = strlen(arg);
+	char quote = arg[0];
+	if (len < 2 || (quote != '\'' && quote != '"' && quote != '`' && quote != '[')) {
+		return sqlite3_mprintf("%s", arg);
+	}
+	if (quote == '[') {
+		quote = ']';
+	}
+	char* out = sqlite3_malloc64(len);
+	if (out == NULL) {
+		return NULL;
+	}
+	size_t j = 0;
+	for (size_t i = 1; i < len - 1; i++) {
+		out[j++] = arg[i];
+		if (arg[i] == quote && arg[i+1] == quote) {
+			i++;
+		}
+	}
+	out[j] = 0;
+	return out;
+}
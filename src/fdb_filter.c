@@ -0,0 +1,627 @@
+/*
+** Predicates pushed down from WHERE clauses into scans. Rows are tested 64 at a time:
+** each predicate loads its column for the batch into an array, from the columnar copy
+** if the table has one, compares the array against its constant with the kernels of
+** fdb_simd.c and yields a bitmask of the rows that match. The masks of all predicates
+** are ANDed, and only rows left in the result are returned to SQLite.
+**
+** Predicates only ever reject rows SQLite would reject too. Where the outcome depends
+** on SQLite's affinity rules (a text constant against a number column, a number against
+** a text column) or a value doesn't have its column's declared type, rows are let
+** through, and SQLite still tests every row that passes. Predicates that always decide
+** like SQLite does (see fdb_predicate_exact()) are left to the table alone, so SQLite
+** neither reads their columns nor compares them again.
+*/
+
+#define FDB_BATCH 64
+
+enum {
+	FDB_PRED_EQ,
+	FDB_PRED_NE,
+	FDB_PRED_LT,
+	FDB_PRED_LE,
+	FDB_PRED_GT,
+	FDB_PRED_GE,
+	FDB_PRED_ISNOT,    /* Not equal, or NULL */
+	FDB_PRED_ISNULL,
+	FDB_PRED_NOTNULL,  /* Every value but NULL matches */
+	FDB_PRED_NONE,     /* Nothing matches */
+	FDB_PRED_ALL,      /* Can't be decided here, every row passes */
+	FDB_PRED_IN,       /* Equal to one of a list of constants */
+};
+
+enum {
+	FDB_KIND_INT,
+	FDB_KIND_REAL,
+	FDB_KIND_TEXT,
+};
+
+typedef struct {
+	uint32_t column;
+	uint8_t op;
+	uint8_t kind;  /* How the column's values are compared */
+	int64_t i;
+	double r;
+	char* text;
+	int ntext;
+	int64_t* ints;    /* Sorted constants of FDB_PRED_IN on integers, without duplicates */
+	char** texts;     /* Or on text */
+	uint32_t nlist;
+} FdbPredicate;
+
+static inline int fdb_column_kind(uint32_t data_type) {
+	return data_type == FDB_NVARCHAR || data_type == FDB_TEXT ? FDB_KIND_TEXT : data_type == FDB_REAL ? FDB_KIND_REAL : FDB_KIND_INT;
+}
+
+/*
+** Return true for the constraint operators fdb_predicate_init() understands.
+*/
+static bool fdb_predicate_op(int op) {
+	switch (op) {
+		case SQLITE_INDEX_CONSTRAINT_EQ:
+		case SQLITE_INDEX_CONSTRAINT_NE:
+		case SQLITE_INDEX_CONSTRAINT_LT:
+		case SQLITE_INDEX_CONSTRAINT_LE:
+		case SQLITE_INDEX_CONSTRAINT_GT:
+		case SQLITE_INDEX_CONSTRAINT_GE:
+		case SQLITE_INDEX_CONSTRAINT_IS:
+		case SQLITE_INDEX_CONSTRAINT_ISNOT:
+		case SQLITE_INDEX_CONSTRAINT_ISNULL:
+		case SQLITE_INDEX_CONSTRAINT_ISNOTNULL:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+** Turn a comparison of integers with a real constant into one with an integer
+** constant, e.g. x < 10.5 into x < 11, the way SQLite compares integers and reals.
+*/
+static void predicate_int_bound(FdbPredicate* pred, double r) {
+	const double limit = 9223372036854775808.0;  /* 2^63 */
+	if (r >= limit || r < -limit) {
+		// beyond every 64 bit integer
+		switch (pred->op) {
+			case FDB_PRED_EQ: pred->op = FDB_PRED_NONE; break;
+			case FDB_PRED_NE: pred->op = FDB_PRED_NOTNULL; break;
+			case FDB_PRED_ISNOT: pred->op = FDB_PRED_ALL; break;
+			case FDB_PRED_LT:
+			case FDB_PRED_LE: pred->op = r > 0 ? FDB_PRED_NOTNULL : FDB_PRED_NONE; break;
+			case FDB_PRED_GT:
+			case FDB_PRED_GE: pred->op = r > 0 ? FDB_PRED_NONE : FDB_PRED_NOTNULL; break;
+		}
+		return;
+	}
+	int64_t t = (int64_t) r;
+	int64_t floor = t > r ? t - 1 : t;
+	int64_t ceil = t < r ? t + 1 : t;
+	switch (pred->op) {
+		case FDB_PRED_EQ: pred->op = floor == ceil ? FDB_PRED_EQ : FDB_PRED_NONE; pred->i = t; break;
+		case FDB_PRED_NE: pred->op = floor == ceil ? FDB_PRED_NE : FDB_PRED_NOTNULL; pred->i = t; break;
+		case FDB_PRED_ISNOT: pred->op = floor == ceil ? FDB_PRED_ISNOT : FDB_PRED_ALL; pred->i = t; break;
+		case FDB_PRED_LT:
+		case FDB_PRED_GE: pred->i = ceil; break;
+		case FDB_PRED_LE:
+		case FDB_PRED_GT: pred->i = floor; break;
+	}
+}
+
+/*
+** Set up a predicate comparing a column of the given declared type with rhs. Text
+** constants are copied, as rhs only lives as long as the xFilter call. Returns false
+** if out of memory.
+*/
+static bool fdb_predicate_init(FdbPredicate* pred, uint32_t column, uint32_t data_type, int op, sqlite3_value* rhs) {
+	memset(pred, 0, sizeof(*pred));
+	pred->column = column;
+	pred->kind = fdb_column_kind(data_type);
+	switch (op) {
+		case SQLITE_INDEX_CONSTRAINT_EQ: pred->op = FDB_PRED_EQ; break;
+		case SQLITE_INDEX_CONSTRAINT_NE: pred->op = FDB_PRED_NE; break;
+		case SQLITE_INDEX_CONSTRAINT_LT: pred->op = FDB_PRED_LT; break;
+		case SQLITE_INDEX_CONSTRAINT_LE: pred->op = FDB_PRED_LE; break;
+		case SQLITE_INDEX_CONSTRAINT_GT: pred->op = FDB_PRED_GT; break;
+		case SQLITE_INDEX_CONSTRAINT_GE: pred->op = FDB_PRED_GE; break;
+		// IS compares NULL with NULL, a column's NULLs equal no other value
+		case SQLITE_INDEX_CONSTRAINT_IS:
+			pred->op = sqlite3_value_type(rhs) == SQLITE_NULL ? FDB_PRED_ISNULL : FDB_PRED_EQ;
+			if (pred->op == FDB_PRED_ISNULL) {
+				return true;
+			}
+			break;
+		case SQLITE_INDEX_CONSTRAINT_ISNOT:
+			pred->op = sqlite3_value_type(rhs) == SQLITE_NULL ? FDB_PRED_NOTNULL : FDB_PRED_ISNOT;
+			if (pred->op == FDB_PRED_NOTNULL) {
+				return true;
+			}
+			break;
+		case SQLITE_INDEX_CONSTRAINT_ISNULL: pred->op = FDB_PRED_ISNULL; return true;
+		case SQLITE_INDEX_CONSTRAINT_ISNOTNULL: pred->op = FDB_PRED_NOTNULL; return true;
+		default: pred->op = FDB_PRED_ALL; return true;
+	}
+
+	int type = sqlite3_value_type(rhs);
+	sqlite3_value* numeric = NULL;
+	if (type == SQLITE_TEXT && pred->kind != FDB_KIND_TEXT) {
+		// the column's numeric affinity applies to the constant, whatever its own affinity
+		numeric = sqlite3_value_dup(rhs);
+		if (numeric == NULL) {
+			return false;
+		}
+		type = sqlite3_value_numeric_type(numeric);
+		rhs = numeric;
+	}
+	if (type == SQLITE_NULL) {
+		// comparisons with NULL are never true
+		pred->op = FDB_PRED_NONE;
+	} else if (pred->kind == FDB_KIND_TEXT) {
+		const char* text = (const char*) sqlite3_value_text(rhs);
+		int n = sqlite3_value_bytes(rhs);
+		if (type != SQLITE_TEXT || text == NULL || memchr(text, 0, n) != NULL) {
+			pred->op = FDB_PRED_ALL;
+			return true;
+		}
+		pred->text = sqlite3_malloc(n + 1);
+		if (pred->text == NULL) {
+			return false;
+		}
+		memcpy(pred->text, text, n + 1);
+		pred->ntext = n;
+	} else if (type == SQLITE_INTEGER) {
+		pred->i = sqlite3_value_int64(rhs);
+		if (pred->kind == FDB_KIND_REAL) {
+			// every float converts to double exactly, integers only up to 2^53
+			bool exact = pred->i <= ((int64_t) 1 << 53) && pred->i >= -((int64_t) 1 << 53);
+			pred->op = exact ? pred->op : FDB_PRED_ALL;
+			pred->r = (double) pred->i;
+		}
+	} else if (type == SQLITE_FLOAT) {
+		pred->r = sqlite3_value_double(rhs);
+		if (pred->kind == FDB_KIND_INT) {
+			predicate_int_bound(pred, pred->r);
+		}
+	} else {
+		pred->op = FDB_PRED_ALL;
+	}
+	sqlite3_value_free(numeric);
+	return true;
+}
+
+/*
+** Adjust a predicate to what its column holds, once it is set up. On a column
+** fdb_column_typed() vouches for, predicates left to SQLite (FDB_PRED_ALL) are decided
+** where that's possible without knowing the constant's affinity: text and blobs sort
+** after every number, and text with NULs equals no text in the file. On other columns,
+** a constant no value of the column's kind matches, like 7.5 for integers, can still
+** match a value of another type, so it is left to SQLite.
+*/
+static void fdb_predicate_typed(FdbPredicate* pred, int op, sqlite3_value* rhs, bool typed) {
+	int type = sqlite3_value_type(rhs);
+	if (type == SQLITE_NULL || (pred->op != FDB_PRED_ALL && pred->op != FDB_PRED_NONE)) {
+		return;
+	}
+	if (!typed) {
+		pred->op = FDB_PRED_ALL;
+		return;
+	}
+	if (pred->op != FDB_PRED_ALL || pred->kind == FDB_KIND_REAL || (pred->kind == FDB_KIND_TEXT && type != SQLITE_TEXT)) {
+		return;
+	}
+	bool below = pred->kind == FDB_KIND_INT;
+	switch (op) {
+		case SQLITE_INDEX_CONSTRAINT_EQ:
+		case SQLITE_INDEX_CONSTRAINT_IS: pred->op = FDB_PRED_NONE; break;
+		case SQLITE_INDEX_CONSTRAINT_NE: pred->op = FDB_PRED_NOTNULL; break;
+		case SQLITE_INDEX_CONSTRAINT_LT:
+		case SQLITE_INDEX_CONSTRAINT_LE: pred->op = below ? FDB_PRED_NOTNULL : FDB_PRED_ALL; break;
+		case SQLITE_INDEX_CONSTRAINT_GT:
+		case SQLITE_INDEX_CONSTRAINT_GE: pred->op = below ? FDB_PRED_NONE : FDB_PRED_ALL; break;
+	}
+}
+
+static int compare_ints(const void* a, const void* b) {
+	int64_t x = *(const int64_t*) a;
+	int64_t y = *(const int64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static int compare_texts(const void* a, const void* b) {
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/*
+** Set up a predicate testing a column for membership in the values of an IN list
+** handed over all at once (see sqlite3_vtab_in()). Only integer and text columns take
+** lists, others let every row pass, as does a list with a value whose comparison
+** depends on affinity. If the column is typed (see fdb_column_typed()), values no row
+** can equal are dropped instead. Returns SQLITE_NOMEM if out of memory, or the error
+** reading the list's values ran into; values read so far are left in the predicate.
+*/
+static int fdb_predicate_init_in(FdbPredicate* pred, uint32_t column, uint32_t data_type, bool typed, sqlite3_value* list) {
+	memset(pred, 0, sizeof(*pred));
+	pred->column = column;
+	pred->kind = fdb_column_kind(data_type);
+	pred->op = FDB_PRED_IN;
+	if (pred->kind == FDB_KIND_REAL) {
+		pred->op = FDB_PRED_ALL;
+		return SQLITE_OK;
+	}
+	uint32_t capacity = 0;
+	sqlite3_value* value;
+	int rc;
+	for (rc = sqlite3_vtab_in_first(list, &value); rc == SQLITE_OK && value != NULL; rc = sqlite3_vtab_in_next(list, &value)) {
+		int type = sqlite3_value_type(value);
+		FdbPredicate one;
+		if (type == SQLITE_NULL) {
+			// NULL is never equal to anything
+			continue;
+		}
+		if (pred->kind == FDB_KIND_TEXT && type != SQLITE_TEXT) {
+			pred->op = FDB_PRED_ALL;
+			break;
+		}
+		if (!fdb_predicate_init(&one, column, data_type, SQLITE_INDEX_CONSTRAINT_EQ, value)) {
+			return SQLITE_NOMEM;
+		}
+		fdb_predicate_typed(&one, SQLITE_INDEX_CONSTRAINT_EQ, value, typed);
+		if (one.op != FDB_PRED_EQ) {
+			// a value no row equals, or one left to SQLite
+			pred->op = one.op == FDB_PRED_NONE ? pred->op : FDB_PRED_ALL;
+			sqlite3_free(one.text);
+			if (pred->op == FDB_PRED_ALL) {
+				break;
+			}
+			continue;
+		}
+		if (pred->nlist == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 16;
+			void* grown = pred->kind == FDB_KIND_TEXT ? sqlite3_realloc64(pred->texts, capacity * sizeof(char*)) : sqlite3_realloc64(pred->ints, capacity * sizeof(int64_t));
+			if (grown == NULL) {
+				sqlite3_free(one.text);
+				return SQLITE_NOMEM;
+			}
+			if (pred->kind == FDB_KIND_TEXT) {
+				pred->texts = grown;
+			} else {
+				pred->ints = grown;
+			}
+		}
+		if (pred->kind == FDB_KIND_TEXT) {
+			pred->texts[pred->nlist++] = one.text;
+		} else {
+			pred->ints[pred->nlist++] = one.i;
+		}
+	}
+	if (rc != SQLITE_OK && rc != SQLITE_DONE) {
+		// the list may be omitted by SQLite, a partial one would drop rows silently
+		return rc;
+	}
+	if (pred->op == FDB_PRED_ALL) {
+		return SQLITE_OK;
+	}
+
+	// sort and remove duplicates, so rows are tested by binary search
+	uint32_t n = 0;
+	if (pred->kind == FDB_KIND_TEXT) {
+		qsort(pred->texts, pred->nlist, sizeof(char*), compare_texts);
+		for (uint32_t i = 0; i < pred->nlist; i++) {
+			if (n > 0 && strcmp(pred->texts[n - 1], pred->texts[i]) == 0) {
+				sqlite3_free(pred->texts[i]);
+			} else {
+				pred->texts[n++] = pred->texts[i];
+			}
+		}
+	} else {
+		qsort(pred->ints, pred->nlist, sizeof(int64_t), compare_ints);
+		for (uint32_t i = 0; i < pred->nlist; i++) {
+			if (n == 0 || pred->ints[n - 1] != pred->ints[i]) {
+				pred->ints[n++] = pred->ints[i];
+			}
+		}
+	}
+	pred->nlist = n;
+	pred->op = n > 0 ? FDB_PRED_IN : FDB_PRED_NONE;
+	return SQLITE_OK;
+}
+
+static void fdb_predicates_free(FdbPredicate* preds, uint32_t npreds) {
+	for (uint32_t p = 0; p < npreds; p++) {
+		sqlite3_free(preds[p].text);
+		for (uint32_t i = 0; preds[p].texts != NULL && i < preds[p].nlist; i++) {
+			sqlite3_free(preds[p].texts[i]);
+		}
+		sqlite3_free(preds[p].texts);
+		sqlite3_free(preds[p].ints);
+	}
+	sqlite3_free(preds);
+}
+
+static inline uint32_t batch_row(const uint32_t* order, uint32_t start, uint32_t k) {
+	return order != NULL ? order[start + k] : start + k;
+}
+
+static inline const Value* batch_value(const TableInfo* info, uint32_t i, uint32_t j) {
+	const Row* row = info->rows[i];
+	if (j >= row->nvalues) {
+		return NULL;
+	}
+	const Value* value = &row_values(info->image, row)[j];
+	return value->data_type == FDB_NULL ? NULL : value;
+}
+
+static inline bool batch_null(const ColumnData* column, uint32_t i) {
+	return column->nulls[i >> 3] & (1 << (i & 7));
+}
+
+/*
+** Return true if every value of column j of a prepared table is NULL or of the kind
+** the column is declared as, which makes predicates on it exact once
+** fdb_predicate_typed() has been applied. Values keep their type through UPDATE, so
+** each column is only checked once.
+*/
+static bool fdb_column_typed(TableInfo* info, uint32_t j) {
+	sqlite3_mutex_enter(info->mutex);
+	if (info->typed == NULL) {
+		info->typed = calloc(info->desc->ncolumns > 0 ? info->desc->ncolumns : 1, sizeof(uint8_t));
+	}
+	if (info->typed != NULL && info->typed[j] == 0) {
+		uint32_t data_type = desc_columns(info->image, info->desc)[j].data_type;
+		int kind = fdb_column_kind(data_type);
+		bool typed = data_type != FDB_NULL;
+		for (uint32_t i = 0; i < info->nrows && typed; i++) {
+			const Value* value = batch_value(info, i, j);
+			typed = value == NULL || (value->data_type <= FDB_TEXT && fdb_column_kind(value->data_type) == kind);
+		}
+		info->typed[j] = typed ? 1 : 2;
+	}
+	bool typed = info->typed != NULL && info->typed[j] == 1;
+	sqlite3_mutex_leave(info->mutex);
+	return typed;
+}
+
+/*
+** Return true if a predicate on column j decides every row the way SQLite does,
+** whatever constant it is given at xFilter time; rhs is the constant if it is known
+** while planning. NULL tests always do. Comparisons do on integer columns
+** fdb_column_typed() vouches for, as the constant gets the column's numeric affinity
+** in fdb_predicate_init() like in SQLite, and fdb_predicate_typed() decides the rest.
+** On text columns the affinity of the other side decides whether the column's values
+** are compared as numbers, so only (in)equality with a known text constant is exact.
+** Reals aren't, integers beyond 2^53 are compared with them by SQLite alone.
+*/
+static bool fdb_predicate_exact(TableInfo* info, uint32_t j, int op, sqlite3_value* rhs) {
+	if (op == SQLITE_INDEX_CONSTRAINT_ISNULL || op == SQLITE_INDEX_CONSTRAINT_ISNOTNULL) {
+		return true;
+	}
+	int kind = fdb_column_kind(desc_columns(info->image, info->desc)[j].data_type);
+	if (kind == FDB_KIND_REAL || !fdb_column_typed(info, j)) {
+		return false;
+	}
+	if (kind == FDB_KIND_INT) {
+		return true;
+	}
+	return rhs != NULL && sqlite3_value_type(rhs) == SQLITE_TEXT && (
+		   op == SQLITE_INDEX_CONSTRAINT_EQ
+		|| op == SQLITE_INDEX_CONSTRAINT_NE
+		|| op == SQLITE_INDEX_CONSTRAINT_IS
+		|| op == SQLITE_INDEX_CONSTRAINT_ISNOT
+	);
+}
+
+/*
+** Load column j of n rows (see fdb_predicates_test()) as integers. Rows where the
+** column is NULL are flagged in *nulls, rows where it isn't an integer in *odd.
+*/
+static void batch_load_int(const TableInfo* info, const ColumnData* column, uint32_t j, const uint32_t* order, uint32_t start, uint32_t n, int64_t* out, uint64_t* nulls, uint64_t* odd) {
+	if (column != NULL && column->values != NULL) {
+		for (uint32_t k = 0; k < n; k++) {
+			*nulls |= (uint64_t) batch_null(column, batch_row(order, start, k)) << k;
+		}
+		switch (column->data_type) {
+			case FDB_I32: for (uint32_t k = 0; k < n; k++) out[k] = ((int32_t*) column->values)[batch_row(order, start, k)]; return;
+			case FDB_U32: for (uint32_t k = 0; k < n; k++) out[k] = ((uint32_t*) column->values)[batch_row(order, start, k)]; return;
+			case FDB_BOOLEAN: for (uint32_t k = 0; k < n; k++) out[k] = ((uint8_t*) column->values)[batch_row(order, start, k)]; return;
+			case FDB_I64: for (uint32_t k = 0; k < n; k++) out[k] = ((int64_t*) column->values)[batch_row(order, start, k)]; return;
+			case FDB_U64: for (uint32_t k = 0; k < n; k++) out[k] = (int64_t) ((uint64_t*) column->values)[batch_row(order, start, k)]; return;
+		}
+	}
+	for (uint32_t k = 0; k < n; k++) {
+		const Value* value = batch_value(info, batch_row(order, start, k), j);
+		out[k] = 0;
+		if (value == NULL) {
+			*nulls |= (uint64_t) 1 << k;
+			continue;
+		}
+		switch (value->data_type) {
+			case FDB_I32: out[k] = value->value.i32; break;
+			case FDB_U32: out[k] = value->value.u32; break;
+			case FDB_BOOLEAN: out[k] = value->value.boolean; break;
+			case FDB_I64: out[k] = *value_i64p(info->image, value); break;
+			case FDB_U64: out[k] = (int64_t) *value_u64p(info->image, value); break;
+			default: *odd |= (uint64_t) 1 << k; break;
+		}
+	}
+}
+
+/*
+** Same as batch_load_int() for reals. NaN counts as NULL, as SQLite turns it into one.
+*/
+static void batch_load_real(const TableInfo* info, const ColumnData* column, uint32_t j, const uint32_t* order, uint32_t start, uint32_t n, double* out, uint64_t* nulls, uint64_t* odd) {
+	if (column != NULL && column->values != NULL) {
+		for (uint32_t k = 0; k < n; k++) {
+			out[k] = ((float*) column->values)[batch_row(order, start, k)];
+			*nulls |= (uint64_t) (batch_null(column, batch_row(order, start, k)) || out[k] != out[k]) << k;
+		}
+		return;
+	}
+	for (uint32_t k = 0; k < n; k++) {
+		const Value* value = batch_value(info, batch_row(order, start, k), j);
+		out[k] = 0;
+		if (value == NULL) {
+			*nulls |= (uint64_t) 1 << k;
+		} else if (value->data_type != FDB_REAL) {
+			*odd |= (uint64_t) 1 << k;
+		} else {
+			out[k] = value->value.real;
+			*nulls |= (uint64_t) (out[k] != out[k]) << k;
+		}
+	}
+}
+
+/*
+** Compare a NUL terminated string with one of n bytes without NULs, as memcmp()
+** followed by the lengths, SQLite's BINARY collation.
+*/
+static inline int text_compare(const char* a, const char* b, int n) {
+	int c = strncmp(a, b, n);
+	return c != 0 ? c : a[n] != 0;
+}
+
+/*
+** Check whether a value is in the sorted list of an FDB_PRED_IN predicate.
+*/
+static bool in_list_int(const FdbPredicate* pred, int64_t v) {
+	uint32_t lo = 0;
+	uint32_t hi = pred->nlist;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (pred->ints[mid] < v) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < pred->nlist && pred->ints[lo] == v;
+}
+
+static bool in_list_text(const FdbPredicate* pred, const char* text) {
+	uint32_t lo = 0;
+	uint32_t hi = pred->nlist;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (strcmp(pred->texts[mid], text) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < pred->nlist && strcmp(pred->texts[lo], text) == 0;
+}
+
+static uint64_t batch_test_text(const TableInfo* info, const ColumnData* column, const FdbPredicate* pred, const uint32_t* order, uint32_t start, uint32_t n, uint64_t* nulls, uint64_t* odd) {
+	uint64_t hits = 0;
+	bool columnar = column != NULL && column->values != NULL;
+	for (uint32_t k = 0; k < n; k++) {
+		const char* text;
+		if (columnar) {
+			if (batch_null(column, batch_row(order, start, k))) {
+				*nulls |= (uint64_t) 1 << k;
+				continue;
+			}
+			text = ((const char**) column->values)[batch_row(order, start, k)];
+		} else {
+			const Value* value = batch_value(info, batch_row(order, start, k), pred->column);
+			if (value == NULL) {
+				*nulls |= (uint64_t) 1 << k;
+				continue;
+			}
+			if (value->data_type != FDB_NVARCHAR && value->data_type != FDB_TEXT) {
+				*odd |= (uint64_t) 1 << k;
+				continue;
+			}
+			text = value_text(info->image, value);
+		}
+		if (pred->op == FDB_PRED_IN) {
+			hits |= (uint64_t) in_list_text(pred, text) << k;
+			continue;
+		}
+		if (pred->op >= FDB_PRED_ISNULL) {
+			continue;
+		}
+		int c = text_compare(text, pred->text, pred->ntext);
+		bool hit;
+		switch (pred->op) {
+			case FDB_PRED_EQ: hit = c == 0; break;
+			case FDB_PRED_NE:
+			case FDB_PRED_ISNOT: hit = c != 0; break;
+			case FDB_PRED_LT: hit = c < 0; break;
+			case FDB_PRED_LE: hit = c <= 0; break;
+			case FDB_PRED_GT: hit = c > 0; break;
+			default: hit = c >= 0; break;
+		}
+		hits |= (uint64_t) hit << k;
+	}
+	return hits;
+}
+
+/*
+** Map a comparison onto the kernel computing it or its negation. Returns true if the
+** kernel's result has to be negated.
+*/
+static inline bool predicate_kernel(uint8_t op, int* cmp) {
+	switch (op) {
+		case FDB_PRED_EQ: *cmp = FDB_CMP_EQ; return false;
+		case FDB_PRED_NE:
+		case FDB_PRED_ISNOT: *cmp = FDB_CMP_EQ; return true;
+		case FDB_PRED_LT: *cmp = FDB_CMP_LT; return false;
+		case FDB_PRED_GE: *cmp = FDB_CMP_LT; return true;
+		case FDB_PRED_GT: *cmp = FDB_CMP_GT; return false;
+		default: *cmp = FDB_CMP_GT; return true;  /* FDB_PRED_LE */
+	}
+}
+
+static uint64_t batch_test(const TableInfo* info, const ColumnData* columnar, const FdbPredicate* pred, const uint32_t* order, uint32_t start, uint32_t n) {
+	if (pred->op == FDB_PRED_ALL) {
+		return ~(uint64_t) 0;
+	}
+	if (pred->op == FDB_PRED_NONE) {
+		return 0;
+	}
+	const ColumnData* column = columnar != NULL ? &columnar[pred->column] : NULL;
+	uint64_t nulls = 0;
+	uint64_t odd = 0;
+	uint64_t hits = 0;
+	if (pred->kind == FDB_KIND_TEXT) {
+		hits = batch_test_text(info, column, pred, order, start, n, &nulls, &odd);
+	} else if (pred->kind == FDB_KIND_REAL) {
+		double values[FDB_BATCH];
+		batch_load_real(info, column, pred->column, order, start, n, values, &nulls, &odd);
+		int cmp;
+		if (pred->op < FDB_PRED_ISNULL) {
+			bool negate = predicate_kernel(pred->op, &cmp);
+			hits = fdb_compare_f64(values, n, cmp, pred->r) ^ (negate ? ~(uint64_t) 0 : 0);
+		}
+	} else {
+		int64_t values[FDB_BATCH];
+		batch_load_int(info, column, pred->column, order, start, n, values, &nulls, &odd);
+		int cmp;
+		if (pred->op == FDB_PRED_IN) {
+			for (uint32_t k = 0; k < n; k++) {
+				hits |= (uint64_t) in_list_int(pred, values[k]) << k;
+			}
+		} else if (pred->op < FDB_PRED_ISNULL) {
+			bool negate = predicate_kernel(pred->op, &cmp);
+			hits = fdb_compare_i64(values, n, cmp, pred->i) ^ (negate ? ~(uint64_t) 0 : 0);
+		}
+	}
+	switch (pred->op) {
+		case FDB_PRED_ISNULL: return nulls;
+		case FDB_PRED_NOTNULL: return ~nulls;
+		case FDB_PRED_ISNOT: return (hits & ~nulls & ~odd) | odd | nulls;
+		default: return (hits & ~nulls & ~odd) | odd;
+	}
+}
+
+/*
+** Test n rows of a table against all predicates, n is at most FDB_BATCH: the rows
+** order[start], ..., order[start + n - 1], or [start, start + n) if order is NULL.
+** Returns a mask with bit k set if the k-th of them passes.
+*/
+uint64_t fdb_predicates_test(const TableInfo* info, const ColumnData* columnar, const FdbPredicate* preds, uint32_t npreds, const uint32_t* order, uint32_t start, uint32_t n) {
+	uint64_t mask = n < FDB_BATCH ? ((uint64_t) 1 << n) - 1 : ~(uint64_t) 0;
+	for (uint32_t p = 0; p < npreds && mask != 0; p++) {
+		mask &= batch_test(info, columnar, &preds[p], order, start, n);
+	}
+	return mask;
+}
@@ -0,0 +1,262 @@
+/*
+** Secondary hash indexes. Only the key column has a hash table in the file, so
+** lookups by any other column (reverse lookups like ComponentsRegistry by
+** component_id) scan the whole table. An index maps the hash of every value of one
+** column to the dense indices of the rows holding it, so an equality lookup only
+** reads the rows of one slot; the lookup's predicate drops rows of other values that
+** landed in the same slot.
+**
+** Indexes are built by fdb_index(table, column), or automatically once a column has
+** been scanned for an equal value FDB_INDEX_AUTO_SCANS times. Cursors hold a reference
+** to the index they read, so an UPDATE of the column can drop the index while a scan
+** still uses it. Dropped indexes are rebuilt automatically.
+*/
+
+#define FDB_INDEX_AUTO_SCANS 4
+
+static inline uint64_t index_mix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t index_hash_text(const char* text, size_t n) {
+	uint64_t h = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i < n; i++) {
+		h = (h ^ (uint8_t) text[i]) * 0x100000001B3ull;
+	}
+	return index_mix(h);
+}
+
+static inline uint64_t index_hash_real(double r) {
+	uint64_t bits;
+	// 0.0 and -0.0 are equal
+	r = r == 0 ? 0 : r;
+	memcpy(&bits, &r, sizeof(bits));
+	return index_mix(bits);
+}
+
+/*
+** Hash the value of row i in column j, as the column's kind of values. Returns false
+** if the value is NULL, and sets *odd if it isn't of that kind.
+*/
+static bool index_hash_value(const TableInfo* info, uint32_t i, uint32_t j, int kind, uint64_t* hash, bool* odd) {
+	const Value* value = batch_value(info, i, j);
+	if (value == NULL) {
+		return false;
+	}
+	int64_t n;
+	switch (value->data_type) {
+		case FDB_I32: n = value->value.i32; break;
+		case FDB_U32: n = value->value.u32; break;
+		case FDB_BOOLEAN: n = value->value.boolean; break;
+		case FDB_I64: n = *value_i64p(info->image, value); break;
+		case FDB_U64: n = (int64_t) *value_u64p(info->image, value); break;
+		case FDB_REAL:
+			if (value->value.real != value->value.real) {
+				// NaN reads as NULL
+				return false;
+			}
+			*odd = *odd || kind != FDB_KIND_REAL;
+			*hash = index_hash_real(value->value.real);
+			return true;
+		case FDB_NVARCHAR:
+		case FDB_TEXT: {
+			const char* text = value_text(info->image, value);
+			*odd = *odd || kind != FDB_KIND_TEXT;
+			*hash = index_hash_text(text, strlen(text));
+			return true; }
+		default:
+			*odd = true;
+			*hash = 0;
+			return true;
+	}
+	*odd = *odd || kind != FDB_KIND_INT;
+	*hash = index_mix((uint64_t) n);
+	return true;
+}
+
+/*
+** Hash the constant of an equality predicate the way its column's values are hashed.
+*/
+static uint64_t fdb_predicate_hash(const FdbPredicate* pred) {
+	switch (pred->kind) {
+		case FDB_KIND_TEXT: return index_hash_text(pred->text, pred->ntext);
+		case FDB_KIND_REAL: return index_hash_real(pred->r);
+		default: return index_mix((uint64_t) pred->i);
+	}
+}
+
+static void fdb_index_release(FdbIndex* index) {
+	if (index != NULL && fdb_atomic_fetch_add(&index->refs, -1) == 1) {
+		free(index->slot_starts);
+		free(index->rows);
+		free(index);
+	}
+}
+
+/*
+** Build the index on column j of a prepared table. A column holding values of another
+** type than it's declared as gets an index without rows, which marks it as not
+** indexable. Returns NULL if out of memory.
+*/
+static FdbIndex* index_build(const TableInfo* info, uint32_t j) {
+	uint32_t nrows = info->nrows;
+	int kind = fdb_column_kind(desc_columns(info->image, info->desc)[j].data_type);
+	FdbIndex* index = calloc(1, sizeof(FdbIndex));
+	if (index == NULL) {
+		return NULL;
+	}
+	index->refs = 1;
+	index->nslots = 1;
+	while (index->nslots < nrows && index->nslots < (1u << 31)) {
+		index->nslots <<= 1;
+	}
+	uint32_t* slots = malloc((nrows > 0 ? nrows : 1) * sizeof(uint32_t));
+	uint32_t* starts = calloc((size_t) index->nslots + 1, sizeof(uint32_t));
+	if (slots == NULL || starts == NULL) {
+		free(slots);
+		free(starts);
+		free(index);
+		return NULL;
+	}
+
+	bool odd = false;
+	for (uint32_t i = 0; i < nrows && !odd; i++) {
+		uint64_t hash;
+		if (index_hash_value(info, i, j, kind, &hash, &odd)) {
+			slots[i] = (uint32_t) hash & (index->nslots - 1);
+			starts[slots[i] + 1] += 1;
+		} else {
+			// NULLs are never equal to anything
+			slots[i] = UINT32_MAX;
+		}
+	}
+	if (odd) {
+		free(slots);
+		free(starts);
+		return index;
+	}
+
+	for (uint32_t s = 0; s < index->nslots; s++) {
+		index->nkeys += starts[s + 1] > 0;
+		starts[s + 1] += starts[s];
+	}
+	uint32_t nentries = starts[index->nslots];
+	index->rows = malloc((nentries > 0 ? nentries : 1) * sizeof(uint32_t));
+	if (index->rows == NULL) {
+		free(slots);
+		free(starts);
+		free(index);
+		return NULL;
+	}
+	// filling moves each slot's start to the next slot's, shift them back afterwards
+	for (uint32_t i = 0; i < nrows; i++) {
+		if (slots[i] != UINT32_MAX) {
+			index->rows[starts[slots[i]]++] = i;
+		}
+	}
+	memmove(starts + 1, starts, (size_t) index->nslots * sizeof(uint32_t));
+	starts[0] = 0;
+	free(slots);
+	index->slot_starts = starts;
+	index->size = sizeof(FdbIndex) + ((size_t) index->nslots + 1 + nentries) * sizeof(uint32_t);
+	return index;
+}
+
+/*
+** Return the index on column j of a prepared table, with a reference for the caller,
+** or NULL if there is none. If build is set, or the column has now been scanned for an
+** equal value often enough, the index is built first.
+*/
+FdbIndex* fdb_table_index(TableInfo* info, uint32_t j, bool build) {
+	FdbIndex* index = NULL;
+	sqlite3_mutex_enter(info->mutex);
+	if (info->indexes == NULL) {
+		uint32_t ncolumns = info->desc->ncolumns;
+		info->indexes = calloc(ncolumns > 0 ? ncolumns : 1, sizeof(FdbIndex*));
+		info->index_scans = calloc(ncolumns > 0 ? ncolumns : 1, sizeof(uint32_t));
+		if (info->indexes == NULL || info->index_scans == NULL) {
+			free(info->indexes);
+			free(info->index_scans);
+			info->indexes = NULL;
+			info->index_scans = NULL;
+		}
+	}
+	if (info->indexes != NULL) {
+		if (info->indexes[j] == NULL && (build || ++info->index_scans[j] >= FDB_INDEX_AUTO_SCANS)) {
+			info->indexes[j] = index_build(info, j);
+		}
+		index = info->indexes[j];
+		if (index != NULL && index->rows != NULL) {
+			fdb_atomic_fetch_add(&index->refs, 1);
+		} else {
+			index = NULL;
+		}
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return index;
+}
+
+/*
+** Estimate how many rows an equality lookup through the index on column j reads,
+** 0 if there is no index.
+*/
+uint32_t fdb_index_rows_per_key(TableInfo* info, uint32_t j) {
+	uint32_t n = 0;
+	sqlite3_mutex_enter(info->mutex);
+	FdbIndex* index = info->indexes != NULL ? info->indexes[j] : NULL;
+	if (index != NULL && index->rows != NULL && index->nkeys > 0) {
+		n = (index->slot_starts[index->nslots] + index->nkeys - 1) / index->nkeys;
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return n;
+}
+
+/*
+** Find the rows an equality predicate can match: index->rows[*start, *stop).
+*/
+void fdb_index_lookup(const FdbIndex* index, const FdbPredicate* pred, uint32_t* start, uint32_t* stop) {
+	uint32_t slot = (uint32_t) fdb_predicate_hash(pred) & (index->nslots - 1);
+	*start = index->slot_starts[slot];
+	*stop = index->slot_starts[slot + 1];
+}
+
+/*
+** Drop the index on column j after an UPDATE changed the column.
+*/
+void fdb_index_drop(TableInfo* info, uint32_t j) {
+	sqlite3_mutex_enter(info->mutex);
+	if (info->indexes != NULL && info->indexes[j] != NULL) {
+		fdb_index_release(info->indexes[j]);
+		info->indexes[j] = NULL;
+		info->index_scans[j] = 0;
+	}
+	sqlite3_mutex_leave(info->mutex);
+}
+
+size_t fdb_index_size(TableInfo* info) {
+	size_t size = 0;
+	sqlite3_mutex_enter(info->mutex);
+	for (uint32_t j = 0; info->indexes != NULL && j < info->desc->ncolumns; j++) {
+		size += info->indexes[j] != NULL ? info->indexes[j]->size : 0;
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return size;
+}
+
+/*
+** Free all indexes of a table. Only called when no cursor can use them.
+*/
+void fdb_index_free(TableInfo* info) {
+	for (uint32_t j = 0; info->indexes != NULL && j < info->desc->ncolumns; j++) {
+		fdb_index_release(info->indexes[j]);
+	}
+	free(info->indexes);
+	free(info->index_scans);
+	info->indexes = NULL;
+	info->index_scans = NULL;
+}
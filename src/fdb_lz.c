@@ -0,0 +1,158 @@
+/*
+** A small LZ77 block codec in the style of LZ4, used for packed containers.
+**
+** A block is a sequence of (literals, match) pairs. Each starts with a token byte
+** holding the literal count in the high and the match length - 4 in the low nibble,
+** a nibble of 15 meaning more length bytes follow (each adding up to 255). Then come
+** the literals, and, except for the last pair, a 16 bit little endian match offset.
+** Compression is a single greedy pass with a hash table of recent positions, which
+** keeps it fast enough to pack a whole cdclient in well under a second.
+*/
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t lz_read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline size_t lz_write_length(uint8_t* dst, size_t op, size_t len) {
+	while (len >= 255) {
+		dst[op++] = 255;
+		len -= 255;
+	}
+	dst[op++] = (uint8_t) len;
+	return op;
+}
+
+/*
+** Worst case compressed size of n bytes.
+*/
+size_t fdb_lz_bound(size_t n) {
+	return n + n / 255 + 16;
+}
+
+static size_t lz_emit(uint8_t* dst, size_t op, const uint8_t* literals, size_t nliterals, size_t offset, size_t match) {
+	size_t token = op++;
+	dst[token] = (uint8_t) ((nliterals >= 15 ? 15 : nliterals) << 4);
+	if (nliterals >= 15) {
+		op = lz_write_length(dst, op, nliterals - 15);
+	}
+	memcpy(dst + op, literals, nliterals);
+	op += nliterals;
+	if (match != 0) {
+		dst[op++] = (uint8_t) (offset & 0xFF);
+		dst[op++] = (uint8_t) (offset >> 8);
+		size_t len = match - LZ_MIN_MATCH;
+		dst[token] |= (uint8_t) (len >= 15 ? 15 : len);
+		if (len >= 15) {
+			op = lz_write_length(dst, op, len - 15);
+		}
+	}
+	return op;
+}
+
+/*
+** Compress n bytes from src into dst, which must hold fdb_lz_bound(n) bytes.
+** Returns the compressed size, or 0 if out of memory.
+*/
+size_t fdb_lz_compress(const uint8_t* src, size_t n, uint8_t* dst) {
+	// positions are stored + 1 so that 0 means empty
+	uint32_t* table = calloc(1 << LZ_HASH_BITS, sizeof(uint32_t));
+	if (table == NULL) {
+		return 0;
+	}
+	size_t ip = 0;
+	size_t anchor = 0;
+	size_t op = 0;
+	// the last bytes are always literals, which keeps the match loop free of bound checks
+	size_t limit = n > 12 ? n - 12 : 0;
+	while (ip < limit) {
+		uint32_t seq = lz_read32(src + ip);
+		uint32_t h = lz_hash(seq);
+		size_t ref = table[h];
+		table[h] = (uint32_t) ip + 1;
+		if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || lz_read32(src + ref - 1) != seq) {
+			ip += 1;
+			continue;
+		}
+		ref -= 1;
+		size_t match = LZ_MIN_MATCH;
+		while (ip + match < n - 5 && src[ref + match] == src[ip + match]) {
+			match += 1;
+		}
+		op = lz_emit(dst, op, src + anchor, ip - anchor, ip - ref, match);
+		ip += match;
+		anchor = ip;
+	}
+	op = lz_emit(dst, op, src + anchor, n - anchor, 0, 0);
+	free(table);
+	return op;
+}
+
+/*
+** Decompress a block into exactly n bytes at dst. Every length and offset is checked,
+** so a corrupt block makes this return false rather than read or write out of bounds.
+*/
+bool fdb_lz_decompress(const uint8_t* src, size_t nsrc, uint8_t* dst, size_t n) {
+	size_t ip = 0;
+	size_t op = 0;
+	while (ip < nsrc) {
+		uint8_t token = src[ip++];
+		size_t nliterals = token >> 4;
+		if (nliterals == 15) {
+			uint8_t b;
+			do {
+				if (ip >= nsrc) return false;
+				b = src[ip++];
+				nliterals += b;
+			} while (b == 255);
+		}
+		if (nliterals > nsrc - ip || nliterals > n - op) {
+			return false;
+		}
+		memcpy(dst + op, src + ip, nliterals);
+		ip += nliterals;
+		op += nliterals;
+		if (ip == nsrc) {
+			break;
+		}
+
+		if (nsrc - ip < 2) {
+			return false;
+		}
+		size_t offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		size_t match = token & 15;
+		if (match == 15) {
+			uint8_t b;
+			do {
+				if (ip >= nsrc) return false;
+				b = src[ip++];
+				match += b;
+			} while (b == 255);
+		}
+		match += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || match > n - op) {
+			return false;
+		}
+		const uint8_t* ref = dst + op - offset;
+		if (offset >= match) {
+			memcpy(dst + op, ref, match);
+		} else {
+			// overlapping match repeating the last offset bytes
+			for (size_t i = 0; i < match; i++) {
+				dst[op + i] = ref[i];
+			}
+		}
+		op += match;
+	}
+	return op == n;
+}
@@ -0,0 +1,149 @@
+/*
+** Control over how a loaded image is backed by memory, for lower latency on random
+** lookups into big images:
+**
+** - hugepages copies the image into huge pages, so point lookups spread over the whole
+**   image need far fewer TLB entries. 'transparent' asks the kernel for transparent
+**   huge pages, 'explicit' takes them from the preallocated hugetlbfs pool and falls
+**   back to transparent ones if the pool is empty.
+** - mlock locks each table into memory once it is prepared, so lookups in tables that
+**   are in use never take a major fault.
+** - madvise tells the kernel how the file mapping will be accessed, 'random' turns off
+**   readahead for workloads of point lookups.
+**
+** All of these are Linux (mlock and madvise: POSIX) features, elsewhere they are
+** accepted but do nothing except for mlock on Windows.
+*/
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+enum {
+	FDB_HUGEPAGES_OFF,
+	FDB_HUGEPAGES_TRANSPARENT,
+	FDB_HUGEPAGES_EXPLICIT,
+};
+
+enum {
+	FDB_ADVICE_NONE,
+	FDB_ADVICE_NORMAL,
+	FDB_ADVICE_RANDOM,
+	FDB_ADVICE_SEQUENTIAL,
+};
+
+#define FDB_HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
+static size_t fdb_page_size() {
+	#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+	#else
+		return (size_t) sysconf(_SC_PAGESIZE);
+	#endif
+}
+
+/*
+** Expand [p, p + n) to whole pages, as mlock and madvise want them.
+*/
+static void fdb_page_range(const char* p, size_t n, char** start, size_t* len) {
+	uintptr_t page = fdb_page_size();
+	uintptr_t lo = (uintptr_t) p & ~(page - 1);
+	uintptr_t hi = ((uintptr_t) p + n + page - 1) & ~(page - 1);
+	*start = (char*) lo;
+	*len = hi - lo;
+}
+
+bool fdb_lock_range(const char* p, size_t n) {
+	char* start;
+	size_t len;
+	fdb_page_range(p, n, &start, &len);
+	#ifdef _WIN32
+		return VirtualLock(start, len);
+	#else
+		return mlock(start, len) == 0;
+	#endif
+}
+
+void fdb_unlock_range(const char* p, size_t n) {
+	char* start;
+	size_t len;
+	fdb_page_range(p, n, &start, &len);
+	#ifdef _WIN32
+		VirtualUnlock(start, len);
+	#else
+		munlock(start, len);
+	#endif
+}
+
+void fdb_advise(char* base, size_t size, int advice) {
+	#ifndef _WIN32
+		int flag = advice == FDB_ADVICE_RANDOM ? MADV_RANDOM : advice == FDB_ADVICE_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_NORMAL;
+		madvise(base, size, flag);
+	#endif
+}
+
+/*
+** Copy an image into anonymous memory backed by huge pages. Returns NULL if huge pages
+** aren't available, otherwise the copy, whose mapping is *mapped bytes long.
+*/
+char* fdb_map_huge(const char* image, size_t size, int mode, size_t* mapped) {
+	#if defined(__linux__) && defined(MADV_HUGEPAGE)
+		size_t len = (size + FDB_HUGE_PAGE_SIZE - 1) & ~(FDB_HUGE_PAGE_SIZE - 1);
+		char* copy = MAP_FAILED;
+		#ifdef MAP_HUGETLB
+			if (mode == FDB_HUGEPAGES_EXPLICIT) {
+				copy = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			}
+		#endif
+		if (copy == MAP_FAILED) {
+			// transparent huge pages need 2MB alignment, map one more page and trim
+			char* raw = mmap(NULL, len + FDB_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (raw == MAP_FAILED) {
+				return NULL;
+			}
+			copy = (char*) (((uintptr_t) raw + FDB_HUGE_PAGE_SIZE - 1) & ~(FDB_HUGE_PAGE_SIZE - 1));
+			if (copy > raw) {
+				munmap(raw, copy - raw);
+			}
+			munmap(copy + len, raw + FDB_HUGE_PAGE_SIZE - copy);
+			if (madvise(copy, len, MADV_HUGEPAGE) != 0) {
+				munmap(copy, len);
+				return NULL;
+			}
+		}
+		memcpy(copy, image, size);
+		*mapped = len;
+		return copy;
+	#else
+		return NULL;
+	#endif
+}
+
+/*
+** Lock a prepared table's data into memory. Tables of packed containers are locked
+** in full, their image holds nothing else.
+*/
+void fdb_lock_table(TableInfo* info) {
+	if (info->locked) {
+		return;
+	}
+	if (info->packed != NULL) {
+		info->locked = fdb_lock_range(info->image, info->packed->size);
+	} else if (info->extent_size > 0) {
+		info->locked = fdb_lock_range(info->extent, info->extent_size);
+	}
+}
+
+void fdb_unlock_table(TableInfo* info) {
+	if (!info->locked) {
+		return;
+	}
+	if (info->packed != NULL) {
+		fdb_unlock_range(info->image, info->packed->size);
+	} else {
+		fdb_unlock_range(info->extent, info->extent_size);
+	}
+	info->locked = false;
+}
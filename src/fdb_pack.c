@@ -0,0 +1,231 @@
+/*
+** Packed containers store every table of a fdb file compressed on its own, so that
+** only the tables a session actually uses have to be decompressed. Each table is
+** rewritten into a self-contained single-table fdb image before compressing it, so
+** once unpacked it is accessed exactly like a table of a plain file.
+**
+** Containers are written with fdb_pack(source, destination) and opened like any
+** other fdb file.
+*/
+
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+} PackBuffer;
+
+/*
+** Reserve n zeroed, 4 byte aligned bytes in the buffer and return their offset,
+** or FDB_NO_OFFSET if out of memory or past what 32 bit offsets can address.
+*/
+static fdb_offset pack_alloc(PackBuffer* buf, size_t n) {
+	size_t offset = buf->size;
+	size_t end = (offset + n + 3) & ~(size_t) 3;
+	if (end >= FDB_NO_OFFSET) {
+		return FDB_NO_OFFSET;
+	}
+	if (end > buf->capacity) {
+		size_t capacity = buf->capacity > 0 ? buf->capacity : 4096;
+		while (capacity < end) {
+			capacity *= 2;
+		}
+		uint8_t* data = realloc(buf->data, capacity);
+		if (data == NULL) {
+			return FDB_NO_OFFSET;
+		}
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+	memset(buf->data + offset, 0, end - offset);
+	buf->size = end;
+	return (fdb_offset) offset;
+}
+
+static fdb_offset pack_string(PackBuffer* buf, const char* str) {
+	size_t len = strlen(str) + 1;
+	fdb_offset offset = pack_alloc(buf, len);
+	if (offset != FDB_NO_OFFSET) {
+		memcpy(buf->data + offset, str, len);
+	}
+	return offset;
+}
+
+#define PACK_AT(buf, type, offset) ((type*) ((buf)->data + (offset)))
+#define PACK_CHECK(offset) if ((offset) == FDB_NO_OFFSET) return false
+
+/*
+** Copy one row into the buffer, returning the offset of its Row.
+*/
+static bool pack_row(PackBuffer* buf, const char* image, const Row* row, fdb_offset* out) {
+	fdb_offset new_row = pack_alloc(buf, sizeof(Row));
+	PACK_CHECK(new_row);
+	fdb_offset new_values = pack_alloc(buf, row->nvalues * sizeof(Value));
+	PACK_CHECK(new_values);
+	PACK_AT(buf, Row, new_row)->nvalues = row->nvalues;
+	PACK_AT(buf, Row, new_row)->values = new_values;
+
+	const Value* values = row_values(image, row);
+	for (uint32_t i = 0; i < row->nvalues; i++) {
+		Value value = values[i];
+		switch (value.data_type) {
+			case FDB_I64:
+			case FDB_U64: {
+				fdb_offset p = pack_alloc(buf, sizeof(int64_t));
+				PACK_CHECK(p);
+				memcpy(buf->data + p, value_i64p(image, &value), sizeof(int64_t));
+				value.value.offset = p;
+				break; }
+			case FDB_NVARCHAR:
+			case FDB_TEXT:
+				value.value.offset = pack_string(buf, value_text(image, &value));
+				PACK_CHECK(value.value.offset);
+				break;
+		}
+		PACK_AT(buf, Value, new_values)[i] = value;
+	}
+	*out = new_row;
+	return true;
+}
+
+/*
+** Copy a ready table's description and hash table into buf and fill in *table.
+*/
+static bool pack_table(PackBuffer* buf, const TableInfo* info, fdb_offset table) {
+	const char* image = info->image;
+	fdb_offset desc = pack_alloc(buf, sizeof(TableDescription));
+	PACK_CHECK(desc);
+	fdb_offset columns = pack_alloc(buf, info->desc->ncolumns * sizeof(Column));
+	PACK_CHECK(columns);
+	fdb_offset name = pack_string(buf, info->name);
+	PACK_CHECK(name);
+	*PACK_AT(buf, TableDescription, desc) = (TableDescription) {info->desc->ncolumns, name, columns};
+	const Column* src_columns = desc_columns(image, info->desc);
+	for (uint32_t i = 0; i < info->desc->ncolumns; i++) {
+		fdb_offset column_name_offset = pack_string(buf, column_name(image, &src_columns[i]));
+		PACK_CHECK(column_name_offset);
+		*PACK_AT(buf, Column, columns + i * sizeof(Column)) = (Column) {src_columns[i].data_type, column_name_offset};
+	}
+
+	uint32_t nbuckets = info->hash_table->nbuckets;
+	fdb_offset hash_table = pack_alloc(buf, sizeof(HashTable));
+	PACK_CHECK(hash_table);
+	fdb_offset buckets = pack_alloc(buf, nbuckets * sizeof(fdb_offset));
+	PACK_CHECK(buckets);
+	*PACK_AT(buf, HashTable, hash_table) = (HashTable) {nbuckets, buckets};
+	*PACK_AT(buf, Table, table) = (Table) {desc, hash_table};
+
+	const fdb_offset* src_buckets = hash_table_buckets(image, info->hash_table);
+	for (uint32_t i = 0; i < nbuckets; i++) {
+		// link each copied bucket into the slot that pointed at the original
+		fdb_offset slot = buckets + i * sizeof(fdb_offset);
+		*PACK_AT(buf, fdb_offset, slot) = FDB_NO_OFFSET;
+		for (Bucket* bucket = fdb_at(image, src_buckets[i]); bucket != NULL; bucket = bucket_next(image, bucket)) {
+			fdb_offset new_bucket = pack_alloc(buf, sizeof(Bucket));
+			PACK_CHECK(new_bucket);
+			fdb_offset new_row;
+			if (!pack_row(buf, image, bucket_row(image, bucket), &new_row)) {
+				return false;
+			}
+			*PACK_AT(buf, Bucket, new_bucket) = (Bucket) {new_row, FDB_NO_OFFSET};
+			*PACK_AT(buf, fdb_offset, slot) = new_bucket;
+			slot = new_bucket + offsetof(Bucket, next);
+		}
+	}
+	return true;
+}
+
+/*
+** Write ready tables as a plain fdb image into buf.
+*/
+static bool pack_tables(PackBuffer* buf, TableInfo* const* infos, uint32_t ntables) {
+	fdb_offset header = pack_alloc(buf, sizeof(FdbHeader));
+	PACK_CHECK(header);
+	fdb_offset tables = pack_alloc(buf, ntables * sizeof(Table));
+	PACK_CHECK(tables);
+	*PACK_AT(buf, FdbHeader, header) = (FdbHeader) {ntables, tables};
+	for (uint32_t i = 0; i < ntables; i++) {
+		if (!pack_table(buf, infos[i], tables + i * sizeof(Table))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+** Write every table of src into a new packed container at path. The container is
+** written to a temporary file first and renamed into place, so processes that mapped
+** an older file at path keep reading it.
+*/
+char* fdb_pack(Fdb* src, const char* path) {
+	char* zTemp = sqlite3_mprintf("%s.%u.tmp", path, (unsigned) fdb_now_us());
+	FILE* file = zTemp != NULL ? fopen(zTemp, "wb") : NULL;
+	if (file == NULL) {
+		sqlite3_free(zTemp);
+		return sqlite3_mprintf("fdb_pack: can't create '%s'", path);
+	}
+
+	// header, entries and names go first, the compressed tables follow
+	PackBuffer head = {0};
+	fdb_offset header = pack_alloc(&head, sizeof(FdbPackHeader));
+	fdb_offset entries = pack_alloc(&head, src->ntables * sizeof(FdbPackEntry));
+	bool ok = header != FDB_NO_OFFSET && entries != FDB_NO_OFFSET;
+	for (uint32_t i = 0; ok && i < src->ntables; i++) {
+		fdb_offset name = pack_string(&head, src->info[i].name);
+		ok = name != FDB_NO_OFFSET;
+		if (ok) {
+			PACK_AT(&head, FdbPackEntry, entries)[i].name = name;
+		}
+	}
+	if (ok) {
+		*PACK_AT(&head, FdbPackHeader, header) = (FdbPackHeader) {FDB_PACK_MAGIC, FDB_PACK_VERSION, src->ntables, entries};
+	}
+
+	char* zErr = NULL;
+	uint64_t data = head.size;
+	fseek(file, (long) data, SEEK_SET);
+	PackBuffer buf = {0};
+	for (uint32_t i = 0; ok && i < src->ntables; i++) {
+		TableInfo* info = &src->info[i];
+		zErr = fdb_table_use(src, info);
+		if (zErr != NULL) {
+			break;
+		}
+		buf.size = 0;
+		ok = pack_tables(&buf, &info, 1);
+		fdb_table_unuse(info);
+		uint8_t* packed = ok ? malloc(fdb_lz_bound(buf.size)) : NULL;
+		size_t packed_size = packed != NULL ? fdb_lz_compress(buf.data, buf.size, packed) : 0;
+		ok = packed_size > 0 && packed_size < FDB_NO_OFFSET && fwrite(packed, 1, packed_size, file) == packed_size;
+		free(packed);
+		FdbPackEntry* entry = &PACK_AT(&head, FdbPackEntry, entries)[i];
+		entry->size = (uint32_t) buf.size;
+		entry->data = data;
+		entry->packed_size = (uint32_t) packed_size;
+		data += packed_size;
+	}
+	free(buf.data);
+
+	if (ok && zErr == NULL) {
+		fseek(file, 0, SEEK_SET);
+		ok = fwrite(head.data, 1, head.size, file) == head.size;
+	}
+	free(head.data);
+	if (fclose(file) != 0) {
+		ok = false;
+	}
+	if (ok && zErr == NULL) {
+		#ifdef _WIN32
+			ok = MoveFileExA(zTemp, path, MOVEFILE_REPLACE_EXISTING);
+		#else
+			ok = rename(zTemp, path) == 0;
+		#endif
+	}
+	if (zErr == NULL && !ok) {
+		zErr = sqlite3_mprintf("fdb_pack: error writing '%s'", path);
+	}
+	if (zErr != NULL) {
+		remove(zTemp);
+	}
+	sqlite3_free(zTemp);
+	return zErr;
+}
@@ -0,0 +1,194 @@
+/*
+** Vectorized helpers. Every function has a plain C fallback, SSE2 is used wherever
+** the compiler targets it (always the case on x86-64), and AVX2 is picked at runtime
+** on GCC and Clang when the CPU supports it.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FDB_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(FDB_SSE2) && (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32)
+#define FDB_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef FDB_AVX2
+__attribute__((target("avx2")))
+static bool offsets_in_range_avx2(const fdb_offset* offsets, uint32_t n, uint32_t limit) {
+	const __m256i bias = _mm256_set1_epi32((int32_t) 0x80000000);
+	const __m256i none = _mm256_set1_epi32((int32_t) FDB_NO_OFFSET);
+	const __m256i max = _mm256_xor_si256(_mm256_set1_epi32((int32_t) limit), bias);
+	__m256i bad = _mm256_setzero_si256();
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) &offsets[i]);
+		__m256i over = _mm256_cmpgt_epi32(_mm256_xor_si256(v, bias), max);
+		bad = _mm256_or_si256(bad, _mm256_andnot_si256(_mm256_cmpeq_epi32(v, none), over));
+	}
+	for (; i < n; i++) {
+		if (offsets[i] != FDB_NO_OFFSET && offsets[i] > limit) {
+			return false;
+		}
+	}
+	return _mm256_testz_si256(bad, bad);
+}
+#endif
+
+/*
+** Check that every entry of an offset array is either FDB_NO_OFFSET or at most limit.
+*/
+bool fdb_offsets_in_range(const fdb_offset* offsets, uint32_t n, uint32_t limit) {
+	uint32_t i = 0;
+	#ifdef FDB_AVX2
+		if (__builtin_cpu_supports("avx2")) {
+			return offsets_in_range_avx2(offsets, n, limit);
+		}
+	#endif
+	#ifdef FDB_SSE2
+		// SSE2 only has signed comparisons, flipping the sign bit makes them unsigned
+		const __m128i bias = _mm_set1_epi32((int32_t) 0x80000000);
+		const __m128i none = _mm_set1_epi32((int32_t) FDB_NO_OFFSET);
+		const __m128i max = _mm_xor_si128(_mm_set1_epi32((int32_t) limit), bias);
+		__m128i bad = _mm_setzero_si128();
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i*) &offsets[i]);
+			__m128i over = _mm_cmpgt_epi32(_mm_xor_si128(v, bias), max);
+			bad = _mm_or_si128(bad, _mm_andnot_si128(_mm_cmpeq_epi32(v, none), over));
+		}
+		if (_mm_movemask_epi8(bad) != 0) {
+			return false;
+		}
+	#endif
+	for (; i < n; i++) {
+		if (offsets[i] != FDB_NO_OFFSET && offsets[i] > limit) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+** Comparison kernels for predicate pushdown. Each compares up to 64 values against a
+** constant and returns a bitmask with bit i set if v[i] is equal to (FDB_CMP_EQ),
+** greater than (FDB_CMP_GT) or less than (FDB_CMP_LT) the constant.
+*/
+enum {
+	FDB_CMP_EQ,
+	FDB_CMP_GT,
+	FDB_CMP_LT,
+};
+
+#ifdef FDB_AVX2
+__attribute__((target("avx2")))
+static uint64_t compare_i64_avx2(const int64_t* v, uint32_t n, int cmp, int64_t rhs) {
+	const __m256i c = _mm256_set1_epi64x(rhs);
+	uint64_t mask = 0;
+	uint32_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) &v[i]);
+		__m256i m = cmp == FDB_CMP_EQ ? _mm256_cmpeq_epi64(x, c) : cmp == FDB_CMP_GT ? _mm256_cmpgt_epi64(x, c) : _mm256_cmpgt_epi64(c, x);
+		mask |= (uint64_t) _mm256_movemask_pd(_mm256_castsi256_pd(m)) << i;
+	}
+	for (; i < n; i++) {
+		bool hit = cmp == FDB_CMP_EQ ? v[i] == rhs : cmp == FDB_CMP_GT ? v[i] > rhs : v[i] < rhs;
+		mask |= (uint64_t) hit << i;
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t compare_f64_avx2(const double* v, uint32_t n, int cmp, double rhs) {
+	const __m256d c = _mm256_set1_pd(rhs);
+	uint64_t mask = 0;
+	uint32_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d x = _mm256_loadu_pd(&v[i]);
+		__m256d m = cmp == FDB_CMP_EQ ? _mm256_cmp_pd(x, c, _CMP_EQ_OQ) : cmp == FDB_CMP_GT ? _mm256_cmp_pd(x, c, _CMP_GT_OQ) : _mm256_cmp_pd(x, c, _CMP_LT_OQ);
+		mask |= (uint64_t) _mm256_movemask_pd(m) << i;
+	}
+	for (; i < n; i++) {
+		bool hit = cmp == FDB_CMP_EQ ? v[i] == rhs : cmp == FDB_CMP_GT ? v[i] > rhs : v[i] < rhs;
+		mask |= (uint64_t) hit << i;
+	}
+	return mask;
+}
+#endif
+
+uint64_t fdb_compare_i64(const int64_t* v, uint32_t n, int cmp, int64_t rhs) {
+	#ifdef FDB_AVX2
+		if (__builtin_cpu_supports("avx2")) {
+			return compare_i64_avx2(v, n, cmp, rhs);
+		}
+	#endif
+	// SSE2 has no 64 bit comparisons, this loop is left to the compiler
+	uint64_t mask = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		bool hit = cmp == FDB_CMP_EQ ? v[i] == rhs : cmp == FDB_CMP_GT ? v[i] > rhs : v[i] < rhs;
+		mask |= (uint64_t) hit << i;
+	}
+	return mask;
+}
+
+uint64_t fdb_compare_f64(const double* v, uint32_t n, int cmp, double rhs) {
+	uint32_t i = 0;
+	uint64_t mask = 0;
+	#ifdef FDB_AVX2
+		if (__builtin_cpu_supports("avx2")) {
+			return compare_f64_avx2(v, n, cmp, rhs);
+		}
+	#endif
+	#ifdef FDB_SSE2
+		const __m128d c = _mm_set1_pd(rhs);
+		for (; i + 2 <= n; i += 2) {
+			__m128d x = _mm_loadu_pd(&v[i]);
+			__m128d m = cmp == FDB_CMP_EQ ? _mm_cmpeq_pd(x, c) : cmp == FDB_CMP_GT ? _mm_cmpgt_pd(x, c) : _mm_cmplt_pd(x, c);
+			mask |= (uint64_t) _mm_movemask_pd(m) << i;
+		}
+	#endif
+	for (; i < n; i++) {
+		bool hit = cmp == FDB_CMP_EQ ? v[i] == rhs : cmp == FDB_CMP_GT ? v[i] > rhs : v[i] < rhs;
+		mask |= (uint64_t) hit << i;
+	}
+	return mask;
+}
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static inline uint32_t fdb_ctz64(uint64_t x) {
+	#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+		unsigned long i;
+		_BitScanForward64(&i, x);
+		return i;
+	#elif defined(_MSC_VER)
+		// 32-bit targets only scan 32 bits at a time
+		unsigned long i;
+		if (_BitScanForward(&i, (uint32_t) x)) {
+			return i;
+		}
+		_BitScanForward(&i, (uint32_t) (x >> 32));
+		return i + 32;
+	#else
+		return __builtin_ctzll(x);
+	#endif
+}
+
+static inline uint32_t fdb_popcount64(uint64_t x) {
+	#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_popcountll(x);
+	#else
+		x = x - ((x >> 1) & 0x5555555555555555ull);
+		x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+		x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+		return (uint32_t) ((x * 0x0101010101010101ull) >> 56);
+	#endif
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define fdb_prefetch(p) __builtin_prefetch(p)
+#elif defined(FDB_SSE2)
+#define fdb_prefetch(p) _mm_prefetch((const char*) (p), _MM_HINT_T0)
+#else
+#define fdb_prefetch(p) ((void) (p))
+#endif
@@ -0,0 +1,227 @@
+/*
+** Snapshots let short-lived processes skip the work of opening a file the slow way
+** (unpacking a packed container, validating every offset) when the file hasn't
+** changed. With snapshot=1, the first open writes all tables, unpacked and fully
+** validated, as one plain image to '<path>.snapshot', followed by a trailer with
+** the source's size, modification time and content hash. Later opens map the
+** snapshot directly if it still matches the source: size and modification time are
+** compared first, and only if the time differs is the source hashed.
+*/
+
+static bool snapshot_stat(const char* path, uint64_t* size, int64_t* mtime) {
+	#ifdef _WIN32
+		struct _stat64 st;
+		if (_stat64(path, &st) != 0) {
+			return false;
+		}
+	#else
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			return false;
+		}
+	#endif
+	*size = (uint64_t) st.st_size;
+	#ifdef __linux__
+		// whole seconds would miss a file replaced right after its snapshot was written
+		*mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	#else
+		*mtime = (int64_t) st.st_mtime;
+	#endif
+	return true;
+}
+
+/*
+** Hash a file's contents, 8 bytes at a time. This only needs to tell apart different
+** versions of the same file, not resist deliberate collisions.
+*/
+static bool snapshot_hash(const char* path, uint64_t* hash) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	uint64_t h = 0x9E3779B97F4A7C15ull;
+	uint64_t* chunk = malloc(1 << 20);
+	size_t n = 0;
+	while (chunk != NULL && (n = fread(chunk, 1, 1 << 20, file)) > 0) {
+		// zero the tail of a short read so it hashes as whole words
+		memset((char*) chunk + n, 0, (8 - n % 8) % 8);
+		for (size_t i = 0; i < (n + 7) / 8; i++) {
+			h = (h ^ chunk[i]) * 0xFF51AFD7ED558CCDull;
+			h ^= h >> 32;
+		}
+		h ^= n;
+	}
+	bool ok = chunk != NULL && !ferror(file);
+	free(chunk);
+	fclose(file);
+	*hash = h;
+	return ok;
+}
+
+static bool snapshot_read_trailer(const char* path, FdbSnapshotTrailer* trailer) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	bool ok = fseek(file, -(long) sizeof(FdbSnapshotTrailer), SEEK_END) == 0 && fread(trailer, sizeof(FdbSnapshotTrailer), 1, file) == 1;
+	fclose(file);
+	return ok && trailer->magic == FDB_SNAPSHOT_MAGIC && trailer->version == FDB_SNAPSHOT_VERSION;
+}
+
+/*
+** Record a new modification time for a source whose contents turned out unchanged,
+** so the next open doesn't have to hash it again.
+*/
+static void snapshot_touch_trailer(const char* path, const FdbSnapshotTrailer* trailer) {
+	FILE* file = fopen(path, "r+b");
+	if (file == NULL) {
+		return;
+	}
+	if (fseek(file, -(long) sizeof(FdbSnapshotTrailer), SEEK_END) == 0) {
+		fwrite(trailer, sizeof(FdbSnapshotTrailer), 1, file);
+	}
+	fclose(file);
+}
+
+/*
+** Write all tables of src with the trailer to path. The tables must be ready. The
+** snapshot is written to a temporary file first and renamed into place, so concurrent
+** processes never see a partial one.
+*/
+static bool snapshot_write(Fdb* src, TableInfo* const* infos, const char* path, const FdbSnapshotTrailer* trailer) {
+	PackBuffer buf = {0};
+	bool ok = pack_tables(&buf, infos, src->ntables);
+	char* zTemp = ok ? sqlite3_mprintf("%s.%u.tmp", path, (unsigned) fdb_now_us()) : NULL;
+	FILE* file = zTemp != NULL ? fopen(zTemp, "wb") : NULL;
+	ok = file != NULL;
+	if (ok) {
+		ok = fwrite(buf.data, 1, buf.size, file) == buf.size && fwrite(trailer, sizeof(FdbSnapshotTrailer), 1, file) == 1;
+		ok = fclose(file) == 0 && ok;
+		#ifdef _WIN32
+			ok = ok && MoveFileExA(zTemp, path, MOVEFILE_REPLACE_EXISTING);
+		#else
+			ok = ok && rename(zTemp, path) == 0;
+		#endif
+		if (!ok) {
+			remove(zTemp);
+		}
+	}
+	sqlite3_free(zTemp);
+	free(buf.data);
+	return ok;
+}
+
+/*
+** Validate every table of src and unpack it if needed, so it can be written to a
+** snapshot. On success, every table has been marked used and is listed in infos.
+*/
+static char* snapshot_use_tables(Fdb* src, TableInfo** infos) {
+	char* zErr = src->validated ? NULL : fdb_validate(src);
+	uint32_t used = 0;
+	for (; zErr == NULL && used < src->ntables; used++) {
+		// tables of packed containers are validated as they are unpacked
+		zErr = fdb_table_use(src, &src->info[used]);
+		if (zErr != NULL) {
+			break;
+		}
+		infos[used] = &src->info[used];
+	}
+	if (zErr != NULL) {
+		for (uint32_t i = 0; i < used; i++) {
+			fdb_table_unuse(infos[i]);
+		}
+	}
+	return zErr;
+}
+
+/*
+** Open a fdb file as fdb_acquire() does, going through its snapshot if the snapshot
+** option is set. If no snapshot can be written next to the file, the file itself is
+** used.
+*/
+Fdb* fdb_open(const char* path, const FdbOptions* options, char** pzErr) {
+	if (!options->snapshot) {
+		return fdb_acquire(path, options, pzErr);
+	}
+	FdbSnapshotTrailer source = {FDB_SNAPSHOT_MAGIC, FDB_SNAPSHOT_VERSION};
+	if (!snapshot_stat(path, &source.source_size, &source.source_mtime)) {
+		*pzErr = sqlite3_mprintf("fdb: can't open '%s'", path);
+		return NULL;
+	}
+	char* zSnapshot = sqlite3_mprintf("%s.snapshot", path);
+	if (zSnapshot == NULL) {
+		*pzErr = sqlite3_mprintf("fdb: out of memory");
+		return NULL;
+	}
+	FdbOptions plain = *options;
+	plain.snapshot = false;
+
+	FdbSnapshotTrailer trailer;
+	bool hashed = false;
+	bool fresh = false;
+	if (snapshot_read_trailer(zSnapshot, &trailer) && trailer.source_size == source.source_size) {
+		fresh = trailer.source_mtime == source.source_mtime;
+		if (!fresh && snapshot_hash(path, &source.source_hash)) {
+			hashed = true;
+			fresh = trailer.source_hash == source.source_hash;
+			if (fresh) {
+				trailer.source_mtime = source.source_mtime;
+				snapshot_touch_trailer(zSnapshot, &trailer);
+			}
+		}
+	}
+	if (fresh) {
+		FdbOptions snapshot_options = plain;
+		snapshot_options.validate = plain.validate && !(trailer.flags & FDB_SNAPSHOT_VALIDATED);
+		Fdb* fdb = fdb_acquire(zSnapshot, &snapshot_options, pzErr);
+		if (fdb != NULL) {
+			fdb->validated = fdb->validated || (trailer.flags & FDB_SNAPSHOT_VALIDATED);
+			sqlite3_free(zSnapshot);
+			return fdb;
+		}
+		// a damaged snapshot is simply rebuilt
+		sqlite3_free(*pzErr);
+		*pzErr = NULL;
+	}
+
+	// loaded images of the file may carry UPDATEs, the snapshot must hold the file itself
+	Fdb* src = fdb_acquire_private(path, pzErr);
+	if (src == NULL) {
+		sqlite3_free(zSnapshot);
+		return NULL;
+	}
+	if (!hashed && !snapshot_hash(path, &source.source_hash)) {
+		fdb_release(src);
+		sqlite3_free(zSnapshot);
+		*pzErr = sqlite3_mprintf("fdb: can't read '%s'", path);
+		return NULL;
+	}
+	TableInfo** infos = malloc((src->ntables > 0 ? src->ntables : 1) * sizeof(TableInfo*));
+	*pzErr = infos == NULL ? sqlite3_mprintf("fdb: out of memory") : snapshot_use_tables(src, infos);
+	if (*pzErr != NULL) {
+		free(infos);
+		fdb_release(src);
+		sqlite3_free(zSnapshot);
+		return NULL;
+	}
+	source.flags = FDB_SNAPSHOT_VALIDATED;
+	bool written = snapshot_write(src, infos, zSnapshot, &source);
+	for (uint32_t i = 0; i < src->ntables; i++) {
+		fdb_table_unuse(infos[i]);
+	}
+	free(infos);
+	fdb_release(src);
+
+	Fdb* fdb;
+	if (written) {
+		plain.validate = false;
+		fdb = fdb_acquire(zSnapshot, &plain, pzErr);
+		if (fdb != NULL) {
+			fdb->validated = true;
+		}
+	} else {
+		fdb = fdb_acquire(path, &plain, pzErr);
+	}
+	sqlite3_free(zSnapshot);
+	return fdb;
+}
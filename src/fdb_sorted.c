@@ -0,0 +1,300 @@
+/*
+** Sorted views of columns: the dense row indices of a table ordered by the values of
+** one column, so range constraints the hash table can't answer, like bounds on text
+** keys, are found by binary search. Rows where the column is NULL come first, then
+** rows whose value doesn't have the column's type, then the values in SQLite's order
+** (BINARY collation for text), ties in the order of the table's rows.
+**
+** Views are built the first time they are needed and shared like secondary indexes
+** (see fdb_index.c): cursors hold a reference, and an UPDATE of the column drops the
+** view. Descending scans read a reversed copy of the rows, made the first time one is
+** needed.
+**
+** Text columns can also have a view ignoring the case of ASCII letters, the way LIKE
+** compares, so the values starting with a LIKE pattern's prefix are next to each other.
+** These are kept after the views of all columns in info->sorted.
+*/
+
+typedef struct {
+	union {
+		int64_t i;
+		double r;
+		const char* text;
+	} value;
+	uint32_t row;
+	uint8_t rank;  /* 0 for NULL, 1 for a value of another type, 2 otherwise */
+	uint8_t kind;
+} SortEntry;
+
+static int sort_compare(const void* a, const void* b) {
+	const SortEntry* x = a;
+	const SortEntry* y = b;
+	int c = 0;
+	if (x->rank != y->rank) {
+		return x->rank < y->rank ? -1 : 1;
+	}
+	if (x->rank == 2) {
+		switch (x->kind) {
+			case FDB_KIND_TEXT: c = strcmp(x->value.text, y->value.text); break;
+			case FDB_KIND_REAL: c = (x->value.r > y->value.r) - (x->value.r < y->value.r); break;
+			default: c = (x->value.i > y->value.i) - (x->value.i < y->value.i); break;
+		}
+	}
+	return c != 0 ? c : (x->row > y->row) - (x->row < y->row);
+}
+
+static inline int fold_ascii(unsigned char c) {
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/*
+** Compare at most n bytes of two strings ignoring the case of ASCII letters, like
+** LIKE does. Bytes are compared unsigned.
+*/
+static int text_compare_nocase(const char* a, const char* b, size_t n) {
+	for (size_t k = 0; k < n; k++) {
+		int c = fold_ascii(a[k]) - fold_ascii(b[k]);
+		if (c != 0 || a[k] == 0) {
+			return c;
+		}
+	}
+	return 0;
+}
+
+static int sort_compare_nocase(const void* a, const void* b) {
+	const SortEntry* x = a;
+	const SortEntry* y = b;
+	if (x->rank != y->rank) {
+		return x->rank < y->rank ? -1 : 1;
+	}
+	int c = x->rank == 2 ? text_compare_nocase(x->value.text, y->value.text, SIZE_MAX) : 0;
+	return c != 0 ? c : (x->row > y->row) - (x->row < y->row);
+}
+
+/*
+** Read the value of row i in column j for sorting.
+*/
+static void sort_entry(const TableInfo* info, uint32_t i, uint32_t j, int kind, SortEntry* entry) {
+	const Value* value = batch_value(info, i, j);
+	entry->row = i;
+	entry->kind = kind;
+	entry->rank = 1;
+	entry->value.i = 0;
+	if (value == NULL || (value->data_type == FDB_REAL && value->value.real != value->value.real)) {
+		entry->rank = 0;
+		return;
+	}
+	switch (value->data_type) {
+		case FDB_I32: entry->value.i = value->value.i32; break;
+		case FDB_U32: entry->value.i = value->value.u32; break;
+		case FDB_BOOLEAN: entry->value.i = value->value.boolean; break;
+		case FDB_I64: entry->value.i = *value_i64p(info->image, value); break;
+		case FDB_U64: entry->value.i = (int64_t) *value_u64p(info->image, value); break;
+		case FDB_REAL: entry->value.r = value->value.real; entry->rank += kind == FDB_KIND_REAL; return;
+		case FDB_NVARCHAR:
+		case FDB_TEXT: entry->value.text = value_text(info->image, value); entry->rank += kind == FDB_KIND_TEXT; return;
+		default: return;
+	}
+	entry->rank += kind == FDB_KIND_INT;
+}
+
+static FdbSorted* sorted_build(const TableInfo* info, uint32_t j, bool nocase) {
+	uint32_t nrows = info->nrows;
+	int kind = fdb_column_kind(desc_columns(info->image, info->desc)[j].data_type);
+	FdbSorted* sorted = calloc(1, sizeof(FdbSorted));
+	SortEntry* entries = malloc((nrows > 0 ? nrows : 1) * sizeof(SortEntry));
+	uint32_t* rows = malloc((nrows > 0 ? nrows : 1) * sizeof(uint32_t));
+	if (sorted == NULL || entries == NULL || rows == NULL) {
+		free(sorted);
+		free(entries);
+		free(rows);
+		return NULL;
+	}
+	for (uint32_t i = 0; i < nrows; i++) {
+		sort_entry(info, i, j, kind, &entries[i]);
+	}
+	qsort(entries, nrows, sizeof(SortEntry), nocase ? sort_compare_nocase : sort_compare);
+	sorted->first = nrows;
+	for (uint32_t i = 0; i < nrows; i++) {
+		rows[i] = entries[i].row;
+		if (entries[i].rank == 2 && sorted->first == nrows) {
+			sorted->first = i;
+		}
+	}
+	free(entries);
+	sorted->refs = 1;
+	sorted->rows = rows;
+	sorted->size = sizeof(FdbSorted) + (size_t) nrows * sizeof(uint32_t);
+	return sorted;
+}
+
+static void fdb_sorted_release(FdbSorted* sorted) {
+	if (sorted != NULL && fdb_atomic_fetch_add(&sorted->refs, -1) == 1) {
+		free(sorted->rows);
+		free(sorted->reversed);
+		free(sorted);
+	}
+}
+
+static FdbSorted* sorted_get(TableInfo* info, uint32_t j, bool nocase) {
+	FdbSorted* sorted = NULL;
+	uint32_t slot = nocase ? info->desc->ncolumns + j : j;
+	sqlite3_mutex_enter(info->mutex);
+	if (info->sorted == NULL) {
+		info->sorted = calloc(info->desc->ncolumns > 0 ? 2 * info->desc->ncolumns : 1, sizeof(FdbSorted*));
+	}
+	if (info->sorted != NULL) {
+		if (info->sorted[slot] == NULL) {
+			info->sorted[slot] = sorted_build(info, j, nocase);
+		}
+		sorted = info->sorted[slot];
+		if (sorted != NULL) {
+			fdb_atomic_fetch_add(&sorted->refs, 1);
+		}
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return sorted;
+}
+
+/*
+** Return the sorted view of column j of a prepared table, building it if needed, with
+** a reference for the caller. Returns NULL if out of memory.
+*/
+FdbSorted* fdb_table_sorted(TableInfo* info, uint32_t j) {
+	return sorted_get(info, j, false);
+}
+
+/*
+** Same for the view of text column j that ignores the case of ASCII letters.
+*/
+FdbSorted* fdb_table_sorted_nocase(TableInfo* info, uint32_t j) {
+	return sorted_get(info, j, true);
+}
+
+/*
+** Return the rows of a sorted view in descending order, NULLs last, reversing them
+** on first use. Returns NULL if out of memory.
+*/
+const uint32_t* fdb_sorted_reversed(TableInfo* info, FdbSorted* sorted) {
+	sqlite3_mutex_enter(info->mutex);
+	if (sorted->reversed == NULL) {
+		uint32_t nrows = info->nrows;
+		uint32_t* reversed = malloc((nrows > 0 ? nrows : 1) * sizeof(uint32_t));
+		if (reversed != NULL) {
+			for (uint32_t i = 0; i < nrows; i++) {
+				reversed[i] = sorted->rows[nrows - 1 - i];
+			}
+			sorted->reversed = reversed;
+			sorted->size += (size_t) nrows * sizeof(uint32_t);
+		}
+	}
+	const uint32_t* reversed = sorted->reversed;
+	sqlite3_mutex_leave(info->mutex);
+	return reversed;
+}
+
+/*
+** Compare the value of row i with the constant of a predicate on the same column.
+** The row must hold a value of the column's type.
+*/
+static int sorted_compare(const TableInfo* info, uint32_t i, const FdbPredicate* pred) {
+	SortEntry entry;
+	sort_entry(info, i, pred->column, pred->kind, &entry);
+	switch (pred->kind) {
+		case FDB_KIND_TEXT: return text_compare(entry.value.text, pred->text, pred->ntext);
+		case FDB_KIND_REAL: return (entry.value.r > pred->r) - (entry.value.r < pred->r);
+		default: return (entry.value.i > pred->i) - (entry.value.i < pred->i);
+	}
+}
+
+/*
+** Return the position in a sorted view of the first value greater than (strict) or
+** greater than or equal to the predicate's constant.
+*/
+uint32_t fdb_sorted_search(const TableInfo* info, const FdbSorted* sorted, const FdbPredicate* pred, bool strict) {
+	uint32_t lo = sorted->first;
+	uint32_t hi = info->nrows;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c = sorted_compare(info, sorted->rows[mid], pred);
+		if (c < 0 || (strict && c == 0)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+** Return the length of the literal prefix of a LIKE or GLOB pattern, the bytes before
+** its first wildcard.
+*/
+static size_t fdb_pattern_prefix(const char* pattern, int op) {
+	const char* wildcards = op == SQLITE_INDEX_CONSTRAINT_GLOB ? "*?[" : "%_";
+	size_t n = 0;
+	while (pattern[n] != 0 && strchr(wildcards, pattern[n]) == NULL) {
+		n++;
+	}
+	return n;
+}
+
+/*
+** Find the positions [*start, *stop) in a sorted view of text column j of the values
+** starting with the n bytes of prefix, ignoring the case of ASCII letters if the view
+** does (nocase).
+*/
+void fdb_sorted_prefix(const TableInfo* info, const FdbSorted* sorted, uint32_t j, const char* prefix, size_t n, bool nocase, uint32_t* start, uint32_t* stop) {
+	uint32_t bounds[2];
+	for (int upper = 0; upper < 2; upper++) {
+		// the first value starting with the prefix or after it, then the first after it
+		uint32_t lo = sorted->first;
+		uint32_t hi = info->nrows;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			const char* text = value_text(info->image, batch_value(info, sorted->rows[mid], j));
+			int c = nocase ? text_compare_nocase(text, prefix, n) : strncmp(text, prefix, n);
+			if (c < 0 || (upper && c == 0)) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		bounds[upper] = lo;
+	}
+	*start = bounds[0];
+	*stop = bounds[1];
+}
+
+/*
+** Drop the sorted views of column j after an UPDATE changed the column.
+*/
+void fdb_sorted_drop(TableInfo* info, uint32_t j) {
+	sqlite3_mutex_enter(info->mutex);
+	for (uint32_t slot = j; info->sorted != NULL && slot < 2 * info->desc->ncolumns; slot += info->desc->ncolumns) {
+		fdb_sorted_release(info->sorted[slot]);
+		info->sorted[slot] = NULL;
+	}
+	sqlite3_mutex_leave(info->mutex);
+}
+
+/*
+** Free all sorted views of a table. Only called when no cursor can use them.
+*/
+void fdb_sorted_free(TableInfo* info) {
+	for (uint32_t j = 0; info->sorted != NULL && j < 2 * info->desc->ncolumns; j++) {
+		fdb_sorted_release(info->sorted[j]);
+	}
+	free(info->sorted);
+	info->sorted = NULL;
+}
+
+size_t fdb_sorted_size(TableInfo* info) {
+	size_t size = 0;
+	sqlite3_mutex_enter(info->mutex);
+	for (uint32_t j = 0; info->sorted != NULL && j < 2 * info->desc->ncolumns; j++) {
+		size += info->sorted[j] != NULL ? info->sorted[j]->size : 0;
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return size;
+}
@@ -0,0 +1,409 @@
+/*
+** fdb_tables is an eponymous virtual table listing the tables of all loaded images
+** together with what was measured while preparing them:
+**
+**   SELECT name, rows, prepare_us FROM fdb_tables ORDER BY prepare_us DESC;
+*/
+
+typedef struct fdb_tables_cursor fdb_tables_cursor;
+struct fdb_tables_cursor {
+	sqlite3_vtab_cursor base;  /* Base class - must be first */
+	Fdb** images;  /* Images loaded when the scan started, each retained */
+	uint32_t nimages;
+	uint32_t image;
+	uint32_t index;
+};
+
+enum {
+	FDB_TABLES_NAME,
+	FDB_TABLES_ROWS,
+	FDB_TABLES_BUCKETS,
+	FDB_TABLES_MAX_CHAIN,
+	FDB_TABLES_READY,
+	FDB_TABLES_PREPARE_US,
+	FDB_TABLES_PATH,
+	FDB_TABLES_COLUMNAR_BYTES,
+	FDB_TABLES_INDEX_BYTES,
+};
+
+static int fdbTablesConnect(
+	sqlite3 *db,
+	void *pAux,
+	int argc, const char *const*argv,
+	sqlite3_vtab **ppVtab,
+	char **pzErr
+){
+	int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(name TEXT, rows INTEGER, buckets INTEGER, max_chain INTEGER, ready INTEGER, prepare_us INTEGER, path TEXT, columnar_bytes INTEGER, index_bytes INTEGER)");
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+	sqlite3_vtab* pNew = sqlite3_malloc(sizeof(*pNew));
+	*ppVtab = pNew;
+	if (pNew == NULL) {
+		return SQLITE_NOMEM;
+	}
+	memset(pNew, 0, sizeof(*pNew));
+	return SQLITE_OK;
+}
+
+static int fdbTablesDisconnect(sqlite3_vtab *pVtab) {
+	sqlite3_free(pVtab);
+	return SQLITE_OK;
+}
+
+static int fdbTablesOpen(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
+	fdb_tables_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+	if (pCur == NULL) return SQLITE_NOMEM;
+	memset(pCur, 0, sizeof(*pCur));
+	*ppCursor = &pCur->base;
+	return SQLITE_OK;
+}
+
+static void fdbTablesReset(fdb_tables_cursor *pCur) {
+	for (uint32_t i = 0; i < pCur->nimages; i++) {
+		fdb_release(pCur->images[i]);
+	}
+	sqlite3_free(pCur->images);
+	pCur->images = NULL;
+	pCur->nimages = 0;
+}
+
+static int fdbTablesClose(sqlite3_vtab_cursor *cur) {
+	fdbTablesReset((fdb_tables_cursor*)cur);
+	sqlite3_free(cur);
+	return SQLITE_OK;
+}
+
+/*
+** Skip over images without tables, so the cursor always points at a valid table
+** unless at EOF.
+*/
+static void fdbTablesSkipEmpty(fdb_tables_cursor *pCur) {
+	while (pCur->image < pCur->nimages && pCur->index >= pCur->images[pCur->image]->ntables) {
+		pCur->image += 1;
+		pCur->index = 0;
+	}
+}
+
+static int fdbTablesFilter(
+	sqlite3_vtab_cursor *pVtabCursor,
+	int idxNum, const char *idxStr,
+	int argc, sqlite3_value **argv
+){
+	fdb_tables_cursor *pCur = (fdb_tables_cursor*)pVtabCursor;
+	fdbTablesReset(pCur);
+
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	uint32_t nimages = 0;
+	for (Fdb* fdb = fdb_images; fdb != NULL; fdb = fdb->next) {
+		nimages += 1;
+	}
+	pCur->images = sqlite3_malloc64(nimages * sizeof(Fdb*));
+	if (pCur->images == NULL && nimages > 0) {
+		sqlite3_mutex_leave(fdb_registry_mutex());
+		return SQLITE_NOMEM;
+	}
+	for (Fdb* fdb = fdb_images; fdb != NULL; fdb = fdb->next) {
+		fdb->refs += 1;
+		pCur->images[pCur->nimages++] = fdb;
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+
+	pCur->image = 0;
+	pCur->index = 0;
+	fdbTablesSkipEmpty(pCur);
+	return SQLITE_OK;
+}
+
+static int fdbTablesNext(sqlite3_vtab_cursor *cur) {
+	fdb_tables_cursor *pCur = (fdb_tables_cursor*)cur;
+	pCur->index += 1;
+	fdbTablesSkipEmpty(pCur);
+	return SQLITE_OK;
+}
+
+static int fdbTablesEof(sqlite3_vtab_cursor *cur) {
+	fdb_tables_cursor *pCur = (fdb_tables_cursor*)cur;
+	return pCur->image >= pCur->nimages;
+}
+
+static int fdbTablesColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int i) {
+	fdb_tables_cursor *pCur = (fdb_tables_cursor*)cur;
+	Fdb* fdb = pCur->images[pCur->image];
+	TableInfo* info = &fdb->info[pCur->index];
+	bool ready = fdb_atomic_load(&info->ready);
+	switch (i) {
+		case FDB_TABLES_NAME:
+			sqlite3_result_text(ctx, info->name, -1, SQLITE_STATIC);
+			break;
+		case FDB_TABLES_ROWS:
+			if (ready) sqlite3_result_int64(ctx, info->nrows);
+			break;
+		case FDB_TABLES_BUCKETS:
+			// tables of packed containers only have a hash table while unpacked
+			sqlite3_mutex_enter(info->mutex);
+			if (info->hash_table != NULL) sqlite3_result_int64(ctx, info->hash_table->nbuckets);
+			sqlite3_mutex_leave(info->mutex);
+			break;
+		case FDB_TABLES_MAX_CHAIN:
+			if (ready) sqlite3_result_int64(ctx, info->max_chain);
+			break;
+		case FDB_TABLES_READY:
+			sqlite3_result_int(ctx, ready);
+			break;
+		case FDB_TABLES_PREPARE_US:
+			if (ready) sqlite3_result_int64(ctx, info->prepare_us);
+			break;
+		case FDB_TABLES_PATH:
+			if (fdb->path != NULL) sqlite3_result_text(ctx, fdb->path, -1, SQLITE_TRANSIENT);
+			break;
+		case FDB_TABLES_COLUMNAR_BYTES:
+			if (fdb_columnar_size(info) > 0) sqlite3_result_int64(ctx, fdb_columnar_size(info));
+			break;
+		case FDB_TABLES_INDEX_BYTES:
+			sqlite3_result_int64(ctx, fdb_index_size(info) + fdb_sorted_size(info) + fdb_trigrams_size(info));
+			break;
+	}
+	return SQLITE_OK;
+}
+
+static int fdbTablesRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+	fdb_tables_cursor *pCur = (fdb_tables_cursor*)cur;
+	*pRowid = ((sqlite_int64) pCur->image << 32) | pCur->index;
+	return SQLITE_OK;
+}
+
+static int fdbTablesBestIndex(sqlite3_vtab* tab, sqlite3_index_info* pIdxInfo) {
+	pIdxInfo->estimatedCost = 100;
+	return SQLITE_OK;
+}
+
+static sqlite3_module fdbTablesModule = {
+	/* iVersion		*/ 0,
+	/* xCreate		 */ 0,
+	/* xConnect		*/ fdbTablesConnect,
+	/* xBestIndex	*/ fdbTablesBestIndex,
+	/* xDisconnect */ fdbTablesDisconnect,
+	/* xDestroy		*/ 0,
+	/* xOpen			 */ fdbTablesOpen,
+	/* xClose			*/ fdbTablesClose,
+	/* xFilter		 */ fdbTablesFilter,
+	/* xNext			 */ fdbTablesNext,
+	/* xEof				*/ fdbTablesEof,
+	/* xColumn		 */ fdbTablesColumn,
+	/* xRowid			*/ fdbTablesRowid,
+	/* xUpdate		 */ 0,
+	/* xBegin			*/ 0,
+	/* xSync			 */ 0,
+	/* xCommit		 */ 0,
+	/* xRollback	 */ 0,
+	/* xFindMethod */ 0,
+	/* xRename		 */ 0,
+	/* xSavepoint	*/ 0,
+	/* xRelease		*/ 0,
+	/* xRollbackTo */ 0,
+	/* xShadowName */ 0
+};
+
+/*
+** fdb_stats is an eponymous virtual table of process-wide counters that show how the
+** loaded images are backed by memory. Comparing them before and after a query shows
+** the page faults and TLB misses it caused:
+**
+**   SELECT * FROM fdb_stats;
+**
+** dtlb_misses counts data TLB misses of the thread that first loaded the extension
+** and the threads it starts, and is NULL where hardware counters aren't available.
+*/
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+enum {
+	FDB_STAT_MINOR_FAULTS,
+	FDB_STAT_MAJOR_FAULTS,
+	FDB_STAT_DTLB_MISSES,
+	FDB_STAT_MAPPED_BYTES,
+	FDB_STAT_HUGE_BYTES,
+	FDB_STAT_LOCKED_BYTES,
+	FDB_STAT_COUNT
+};
+
+static const char* FDB_STAT_NAMES[FDB_STAT_COUNT] = {"minor_faults", "major_faults", "dtlb_misses", "mapped_bytes", "huge_bytes", "locked_bytes"};
+
+static int fdb_dtlb_fd = -1;
+
+/*
+** Start counting data TLB misses. Called when the extension is loaded, so the count
+** covers everything the extension does afterwards.
+*/
+void fdb_stats_start() {
+	#ifdef __linux__
+		sqlite3_mutex_enter(fdb_registry_mutex());
+		if (fdb_dtlb_fd != -1) {
+			sqlite3_mutex_leave(fdb_registry_mutex());
+			return;
+		}
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		fdb_dtlb_fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		sqlite3_mutex_leave(fdb_registry_mutex());
+	#endif
+}
+
+typedef struct fdb_stats_cursor fdb_stats_cursor;
+struct fdb_stats_cursor {
+	sqlite3_vtab_cursor base;  /* Base class - must be first */
+	int64_t values[FDB_STAT_COUNT];
+	bool known[FDB_STAT_COUNT];
+	uint32_t index;
+};
+
+static int fdbStatsConnect(
+	sqlite3 *db,
+	void *pAux,
+	int argc, const char *const*argv,
+	sqlite3_vtab **ppVtab,
+	char **pzErr
+){
+	int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(name TEXT, value INTEGER)");
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+	sqlite3_vtab* pNew = sqlite3_malloc(sizeof(*pNew));
+	*ppVtab = pNew;
+	if (pNew == NULL) {
+		return SQLITE_NOMEM;
+	}
+	memset(pNew, 0, sizeof(*pNew));
+	return SQLITE_OK;
+}
+
+static int fdbStatsOpen(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
+	fdb_stats_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+	if (pCur == NULL) return SQLITE_NOMEM;
+	memset(pCur, 0, sizeof(*pCur));
+	*ppCursor = &pCur->base;
+	return SQLITE_OK;
+}
+
+static int fdbStatsClose(sqlite3_vtab_cursor *cur) {
+	sqlite3_free(cur);
+	return SQLITE_OK;
+}
+
+/*
+** All counters are read at once when the scan starts, so they are consistent.
+*/
+static int fdbStatsFilter(
+	sqlite3_vtab_cursor *pVtabCursor,
+	int idxNum, const char *idxStr,
+	int argc, sqlite3_value **argv
+){
+	fdb_stats_cursor *pCur = (fdb_stats_cursor*)pVtabCursor;
+	memset(pCur->known, 0, sizeof(pCur->known));
+	pCur->index = 0;
+
+	#ifndef _WIN32
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) == 0) {
+			pCur->values[FDB_STAT_MINOR_FAULTS] = usage.ru_minflt;
+			pCur->values[FDB_STAT_MAJOR_FAULTS] = usage.ru_majflt;
+			pCur->known[FDB_STAT_MINOR_FAULTS] = true;
+			pCur->known[FDB_STAT_MAJOR_FAULTS] = true;
+		}
+	#endif
+	#ifdef __linux__
+		uint64_t misses;
+		if (fdb_dtlb_fd != -1 && read(fdb_dtlb_fd, &misses, sizeof(misses)) == sizeof(misses)) {
+			pCur->values[FDB_STAT_DTLB_MISSES] = (int64_t) misses;
+			pCur->known[FDB_STAT_DTLB_MISSES] = true;
+		}
+	#endif
+
+	int64_t mapped = 0;
+	int64_t huge = 0;
+	int64_t locked = 0;
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	for (Fdb* fdb = fdb_images; fdb != NULL; fdb = fdb->next) {
+		mapped += fdb->mapped;
+		huge += fdb->huge ? fdb->mapped : 0;
+		for (uint32_t i = 0; i < fdb->ntables; i++) {
+			TableInfo* info = &fdb->info[i];
+			sqlite3_mutex_enter(info->mutex);
+			if (info->locked) {
+				locked += info->packed != NULL ? info->packed->size : info->extent_size;
+			}
+			sqlite3_mutex_leave(info->mutex);
+		}
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+	pCur->values[FDB_STAT_MAPPED_BYTES] = mapped;
+	pCur->values[FDB_STAT_HUGE_BYTES] = huge;
+	pCur->values[FDB_STAT_LOCKED_BYTES] = locked;
+	pCur->known[FDB_STAT_MAPPED_BYTES] = true;
+	pCur->known[FDB_STAT_HUGE_BYTES] = true;
+	pCur->known[FDB_STAT_LOCKED_BYTES] = true;
+	return SQLITE_OK;
+}
+
+static int fdbStatsNext(sqlite3_vtab_cursor *cur) {
+	((fdb_stats_cursor*)cur)->index += 1;
+	return SQLITE_OK;
+}
+
+static int fdbStatsEof(sqlite3_vtab_cursor *cur) {
+	return ((fdb_stats_cursor*)cur)->index >= FDB_STAT_COUNT;
+}
+
+static int fdbStatsColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int i) {
+	fdb_stats_cursor *pCur = (fdb_stats_cursor*)cur;
+	if (i == 0) {
+		sqlite3_result_text(ctx, FDB_STAT_NAMES[pCur->index], -1, SQLITE_STATIC);
+	} else if (pCur->known[pCur->index]) {
+		sqlite3_result_int64(ctx, pCur->values[pCur->index]);
+	}
+	return SQLITE_OK;
+}
+
+static int fdbStatsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+	*pRowid = ((fdb_stats_cursor*)cur)->index;
+	return SQLITE_OK;
+}
+
+static sqlite3_module fdbStatsModule = {
+	/* iVersion		*/ 0,
+	/* xCreate		 */ 0,
+	/* xConnect		*/ fdbStatsConnect,
+	/* xBestIndex	*/ fdbTablesBestIndex,
+	/* xDisconnect */ fdbTablesDisconnect,
+	/* xDestroy		*/ 0,
+	/* xOpen			 */ fdbStatsOpen,
+	/* xClose			*/ fdbStatsClose,
+	/* xFilter		 */ fdbStatsFilter,
+	/* xNext			 */ fdbStatsNext,
+	/* xEof				*/ fdbStatsEof,
+	/* xColumn		 */ fdbStatsColumn,
+	/* xRowid			*/ fdbStatsRowid,
+	/* xUpdate		 */ 0,
+	/* xBegin			*/ 0,
+	/* xSync			 */ 0,
+	/* xCommit		 */ 0,
+	/* xRollback	 */ 0,
+	/* xFindMethod */ 0,
+	/* xRename		 */ 0,
+	/* xSavepoint	*/ 0,
+	/* xRelease		*/ 0,
+	/* xRollbackTo */ 0,
+	/* xShadowName */ 0
+};
@@ -0,0 +1,261 @@
+/*
+** Grow [*lo, *hi) to cover n bytes at p.
+*/
+static inline void extent_add(char** lo, char** hi, const void* p, size_t n) {
+	if ((char*) p < *lo) {
+		*lo = (char*) p;
+	}
+	if ((char*) p + n > *hi) {
+		*hi = (char*) p + n;
+	}
+}
+
+/*
+** Free what fdb_prepare_table() built for a table.
+*/
+void fdb_table_clear(TableInfo* info) {
+	fdb_index_free(info);
+	fdb_sorted_free(info);
+	fdb_trigrams_free(info);
+	fdb_columnar_free(info);
+	free(info->typed);
+	free(info->stats);
+	info->typed = NULL;
+	info->stats = NULL;
+	free(info->rows);
+	free(info->bucket_starts);
+	info->rows = NULL;
+	info->bucket_starts = NULL;
+}
+
+/*
+** Per-table preparation: walk every bucket chain of a table once, touching each row
+** so its pages are faulted in, and record the table's shape and the address range
+** its data occupies in its TableInfo. Chains are walked iteratively, so long chains
+** don't grow the stack.
+**
+** Every row is collected into a dense array in bucket and chain order, which is what
+** cursors iterate over: scans walk it linearly instead of probing empty buckets and
+** following chains, and a bucket's rows are found through bucket_starts.
+**
+** The walk also records what the planner needs to know about the hash table (see
+** fdb_cost.c): how long chains are and the range of integer keys.
+*/
+char* fdb_prepare_table(TableInfo* info) {
+	uint64_t start = fdb_now_us();
+	char* image = info->image;
+	uint32_t nbuckets = info->hash_table->nbuckets;
+	fdb_offset* buckets = hash_table_buckets(image, info->hash_table);
+	uint32_t nrows = 0;
+	uint32_t max_chain = 0;
+	uint64_t chain_squares = 0;
+	int64_t key_min = INT64_MAX;
+	int64_t key_max = INT64_MIN;
+	char* lo = (char*) info->hash_table;
+	char* hi = lo + sizeof(HashTable);
+	extent_add(&lo, &hi, buckets, nbuckets * sizeof(fdb_offset));
+
+	// most tables have about one row per bucket
+	uint32_t capacity = nbuckets > 0 ? nbuckets : 1;
+	Row** rows = malloc(capacity * sizeof(Row*));
+	uint32_t* bucket_starts = malloc(((size_t) nbuckets + 1) * sizeof(uint32_t));
+	if (rows == NULL || bucket_starts == NULL) {
+		free(rows);
+		free(bucket_starts);
+		return sqlite3_mprintf("fdb: out of memory preparing %s", info->name);
+	}
+
+	for (uint32_t i = 0; i < nbuckets; i++) {
+		uint32_t chain = 0;
+		int64_t key;
+		bucket_starts[i] = nrows;
+		for (Bucket* bucket = fdb_at(image, buckets[i]); bucket != NULL; bucket = bucket_next(image, bucket)) {
+			Row* row = bucket_row(image, bucket);
+			Value* values = row_values(image, row);
+			extent_add(&lo, &hi, bucket, sizeof(Bucket));
+			extent_add(&lo, &hi, row, sizeof(Row));
+			extent_add(&lo, &hi, values, row->nvalues * sizeof(Value));
+			for (uint32_t j = 0; j < row->nvalues; j++) {
+				uint32_t data_type = ((volatile Value*) values)[j].data_type;
+				if (data_type == FDB_I64 || data_type == FDB_U64) {
+					extent_add(&lo, &hi, fdb_at(image, values[j].value.offset), sizeof(int64_t));
+				} else if (data_type == FDB_NVARCHAR || data_type == FDB_TEXT) {
+					const char* text = fdb_at(image, values[j].value.offset);
+					extent_add(&lo, &hi, text, strlen(text) + 1);
+				}
+			}
+			if (nrows == capacity) {
+				Row** grown = capacity < UINT32_MAX / 2 ? realloc(rows, (size_t) capacity * 2 * sizeof(Row*)) : NULL;
+				if (grown == NULL) {
+					free(rows);
+					free(bucket_starts);
+					return sqlite3_mprintf("fdb: out of memory preparing %s", info->name);
+				}
+				rows = grown;
+				capacity *= 2;
+			}
+			rows[nrows++] = row;
+			chain += 1;
+			if (row->nvalues > 0 && fdb_value_int(image, &values[0], &key)) {
+				key_min = key < key_min ? key : key_min;
+				key_max = key > key_max ? key : key_max;
+			}
+		}
+		if (chain > max_chain) {
+			max_chain = chain;
+		}
+		chain_squares += (uint64_t) chain * chain;
+	}
+	bucket_starts[nbuckets] = nrows;
+
+	info->rows = rows;
+	info->bucket_starts = bucket_starts;
+	info->nrows = nrows;
+	info->max_chain = max_chain;
+	info->chain_squares = chain_squares;
+	info->key_min = key_min;
+	info->key_max = key_max;
+	info->extent = lo;
+	info->extent_size = hi - lo;
+	info->prepare_us = fdb_now_us() - start;
+	fdb_atomic_store(&info->ready, 1);
+	return NULL;
+}
+
+/*
+** Decompress a table of a packed container into memory and fully validate it.
+*/
+char* fdb_unpack_table(TableInfo* info, const char* base) {
+	const FdbPackEntry* entry = info->packed;
+	char* image = malloc(entry->size > 0 ? entry->size : 1);
+	if (image == NULL) {
+		return sqlite3_mprintf("fdb: out of memory unpacking %s", info->name);
+	}
+	if (!fdb_lz_decompress((const uint8_t*) base + entry->data, entry->packed_size, (uint8_t*) image, entry->size)) {
+		free(image);
+		return sqlite3_mprintf("fdb: table %s: corrupt packed data", info->name);
+	}
+	char* zErr = fdb_validate_header(image, entry->size);
+	if (zErr == NULL && ((FdbHeader*) image)->ntables != 1) {
+		zErr = sqlite3_mprintf("fdb: table %s: corrupt packed data", info->name);
+	}
+	if (zErr == NULL) {
+		info->image = image;
+		info->table = fdb_at(image, ((FdbHeader*) image)->tables);
+		info->desc = table_desc(image, info->table);
+		info->hash_table = table_hash_table(image, info->table);
+		zErr = fdb_validate_table(image, entry->size, info);
+	}
+	if (zErr != NULL) {
+		info->image = NULL;
+		info->table = NULL;
+		info->desc = NULL;
+		info->hash_table = NULL;
+		free(image);
+	}
+	return zErr;
+}
+
+/*
+** Make sure a table has been prepared before it's used, unpacking it first if it comes
+** from a packed container. Tables are prepared the first time a connection references
+** them, so tables nobody queries are never paged in. Returns an error message if the
+** table can't be unpacked.
+*/
+char* fdb_table_ready(Fdb* fdb, TableInfo* info) {
+	if (fdb_atomic_load(&info->ready)) {
+		return NULL;
+	}
+	char* zErr = NULL;
+	sqlite3_mutex_enter(info->mutex);
+	if (!fdb_atomic_load(&info->ready)) {
+		if (info->packed != NULL && info->image == NULL) {
+			zErr = fdb_unpack_table(info, fdb->base);
+		}
+		if (zErr == NULL) {
+			zErr = fdb_prepare_table(info);
+		}
+		if (zErr == NULL) {
+			if (fdb->lock) {
+				fdb_lock_table(info);
+			}
+		}
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return zErr;
+}
+
+void fdb_table_unuse(TableInfo* info) {
+	sqlite3_mutex_enter(info->mutex);
+	info->users -= 1;
+	sqlite3_mutex_leave(info->mutex);
+}
+
+/*
+** Register a user of a table, preparing it if needed: a cursor reading it, a query
+** being planned on it or an UPDATE writing to it. Tables with users are never evicted.
+*/
+char* fdb_table_use(Fdb* fdb, TableInfo* info) {
+	sqlite3_mutex_enter(info->mutex);
+	info->users += 1;
+	sqlite3_mutex_leave(info->mutex);
+	char* zErr = fdb_table_ready(fdb, info);
+	if (zErr != NULL) {
+		fdb_table_unuse(info);
+	}
+	return zErr;
+}
+
+/*
+** Drop the unpacked copy of a table from a packed container, it is unpacked again on
+** next use. Must be called with the table's mutex held.
+*/
+static void fdb_table_reset(TableInfo* info) {
+	fdb_atomic_store(&info->ready, 0);
+	fdb_unlock_table(info);
+	fdb_table_clear(info);
+	free(info->image);
+	info->image = NULL;
+	info->table = NULL;
+	info->desc = NULL;
+	info->hash_table = NULL;
+}
+
+/*
+** Free the unpacked copies of all tables of packed containers that nothing uses right
+** now. Returns the number of tables evicted.
+*/
+uint32_t fdb_evict(Fdb* fdb) {
+	uint32_t evicted = 0;
+	for (uint32_t i = 0; i < fdb->ntables; i++) {
+		TableInfo* info = &fdb->info[i];
+		if (info->packed == NULL) {
+			continue;
+		}
+		sqlite3_mutex_enter(info->mutex);
+		if (info->users == 0 && info->image != NULL) {
+			fdb_table_reset(info);
+			evicted += 1;
+		}
+		sqlite3_mutex_leave(info->mutex);
+	}
+	return evicted;
+}
+
+static void prepare_table_job(void* ctx, uint32_t i) {
+	Fdb* fdb = ctx;
+	char* zErr = fdb_table_ready(fdb, &fdb->info[i]);
+	// a table that fails to unpack reports its error when it's connected to
+	sqlite3_free(zErr);
+}
+
+/*
+** Prepare all tables of an image up front instead of on first use, spread over
+** nthreads worker threads (0 means one per CPU).
+*/
+void fdb_prepare_tables(Fdb* fdb, uint32_t nthreads) {
+	if (nthreads == 0) {
+		nthreads = fdb_cpu_count();
+	}
+	fdb_parallel_for(nthreads, fdb->ntables, prepare_table_job, fdb);
+}
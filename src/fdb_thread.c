@@ -0,0 +1,120 @@
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+** Minimal portable threading helpers, just enough to spread per-table work over a
+** few worker threads.
+*/
+
+#ifdef _MSC_VER
+#define fdb_atomic_fetch_add(ptr, value) InterlockedExchangeAdd((volatile LONG*) (ptr), (value))
+#define fdb_atomic_load(ptr) InterlockedCompareExchange((volatile LONG*) (ptr), 0, 0)
+#define fdb_atomic_store(ptr, value) InterlockedExchange((volatile LONG*) (ptr), (value))
+#else
+#define fdb_atomic_fetch_add(ptr, value) __atomic_fetch_add((ptr), (value), __ATOMIC_SEQ_CST)
+#define fdb_atomic_load(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define fdb_atomic_store(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#endif
+
+uint64_t fdb_now_us() {
+	#ifdef _WIN32
+		LARGE_INTEGER freq, now;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&now);
+		return (uint64_t) (now.QuadPart / (freq.QuadPart / 1000000));
+	#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	#endif
+}
+
+uint32_t fdb_cpu_count() {
+	#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwNumberOfProcessors;
+	#else
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		return n > 0 ? (uint32_t) n : 1;
+	#endif
+}
+
+typedef void (*fdb_job)(void* ctx, uint32_t i);
+
+typedef struct {
+	fdb_job job;
+	void* ctx;
+	uint32_t njobs;
+	volatile int32_t next;
+} ParallelFor;
+
+#ifdef _WIN32
+static DWORD WINAPI parallel_for_worker(void* data) {
+#else
+static void* parallel_for_worker(void* data) {
+#endif
+	ParallelFor* p = data;
+	while (true) {
+		uint32_t i = (uint32_t) fdb_atomic_fetch_add(&p->next, 1);
+		if (i >= p->njobs) {
+			break;
+		}
+		p->job(p->ctx, i);
+	}
+	return 0;
+}
+
+/*
+** Run job(ctx, i) for every i in [0, njobs) on up to nthreads threads, including the
+** calling one. Jobs are handed out one at a time, so uneven jobs still balance out.
+** Returns once all jobs have finished. If threads can't be created the remaining
+** work simply happens on fewer threads.
+*/
+void fdb_parallel_for(uint32_t nthreads, uint32_t njobs, fdb_job job, void* ctx) {
+	ParallelFor p = {job, ctx, njobs, 0};
+	if (nthreads > njobs) {
+		nthreads = njobs;
+	}
+	uint32_t nspawned = 0;
+	#ifdef _WIN32
+		HANDLE* threads = nthreads > 1 ? malloc((nthreads - 1) * sizeof(HANDLE)) : NULL;
+	#else
+		pthread_t* threads = nthreads > 1 ? malloc((nthreads - 1) * sizeof(pthread_t)) : NULL;
+	#endif
+	if (threads != NULL) {
+		for (; nspawned < nthreads - 1; nspawned++) {
+			#ifdef _WIN32
+				threads[nspawned] = CreateThread(NULL, 0, parallel_for_worker, &p, 0, NULL);
+				if (threads[nspawned] == NULL) {
+					break;
+				}
+			#else
+				if (pthread_create(&threads[nspawned], NULL, parallel_for_worker, &p) != 0) {
+					break;
+				}
+			#endif
+		}
+	}
+	parallel_for_worker(&p);
+	for (uint32_t i = 0; i < nspawned; i++) {
+		#ifdef _WIN32
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		#else
+			pthread_join(threads[i], NULL);
+		#endif
+	}
+	free(threads);
+}
@@ -0,0 +1,397 @@
+/*
+** Trigram indexes for substring searches on text columns. A LIKE or GLOB pattern that
+** starts with a wildcard (name LIKE '%dragon%') has no prefix to look up in a sorted
+** view, but every value it matches contains the pattern's literal runs. A trigram
+** index lists, for every three bytes occurring in the column's values, the rows
+** holding them, with ASCII letters lowercased as LIKE compares them. Only the rows on
+** the lists of all trigrams of a pattern are read, and SQLite matches the whole
+** pattern against them.
+**
+** Indexes are optional: fdb_index(table, column, 'trigram') builds one, spreading the
+** rows over worker threads. Only text columns holding nothing but text get one.
+** Searches copy the rows they read, so cursors don't hold on to the index. An UPDATE
+** of the column doesn't rebuild it: the row is added to the index's changed rows,
+** which every search reads as well.
+*/
+
+#define FDB_TRIGRAM_CHUNKS 64  /* Row ranges the rows are split into for building */
+#define FDB_TRIGRAM_MAX 32     /* Trigrams of a pattern looked up at most */
+
+static inline uint32_t trigram_at(const char* text) {
+	return (uint32_t) fold_ascii(text[0]) << 16 | (uint32_t) fold_ascii(text[1]) << 8 | fold_ascii(text[2]);
+}
+
+static void fdb_trigrams_release(FdbTrigrams* trigrams) {
+	if (trigrams != NULL && fdb_atomic_fetch_add(&trigrams->refs, -1) == 1) {
+		free(trigrams->keys);
+		free(trigrams->starts);
+		free(trigrams->rows);
+		free(trigrams->changed);
+		free(trigrams);
+	}
+}
+
+typedef struct {
+	const TableInfo* info;
+	uint32_t j;
+	uint32_t chunk;        /* Rows per chunk */
+	int64_t** pairs;       /* Per chunk, sorted trigram << 32 | row, each once */
+	size_t* npairs;
+	volatile int32_t failed;
+} TrigramBuild;
+
+/*
+** Collect the trigrams of the rows of chunk c.
+*/
+static void trigrams_chunk(void* ctx, uint32_t c) {
+	TrigramBuild* build = ctx;
+	const TableInfo* info = build->info;
+	uint32_t start = c * build->chunk;
+	uint32_t stop = info->nrows - start > build->chunk ? start + build->chunk : info->nrows;
+	int64_t* pairs = NULL;
+	size_t n = 0;
+	size_t capacity = 0;
+	for (uint32_t i = start; i < stop; i++) {
+		const Value* value = batch_value(info, i, build->j);
+		if (value == NULL) {
+			continue;
+		}
+		const char* text = value_text(info->image, value);
+		size_t len = strlen(text);
+		if (len < 3) {
+			continue;
+		}
+		if (n + len - 2 > capacity) {
+			capacity = (n + len) * 2;
+			int64_t* grown = realloc(pairs, capacity * sizeof(int64_t));
+			if (grown == NULL) {
+				free(pairs);
+				fdb_atomic_store(&build->failed, 1);
+				return;
+			}
+			pairs = grown;
+		}
+		for (size_t k = 0; k + 2 < len; k++) {
+			pairs[n++] = (int64_t) trigram_at(text + k) << 32 | i;
+		}
+	}
+	qsort(pairs, n, sizeof(int64_t), compare_ints);
+	size_t unique = 0;
+	for (size_t k = 0; k < n; k++) {
+		if (unique == 0 || pairs[unique - 1] != pairs[k]) {
+			pairs[unique++] = pairs[k];
+		}
+	}
+	build->pairs[c] = pairs;
+	build->npairs[c] = unique;
+}
+
+/*
+** Build the trigram index of text column j of a prepared table, whose values must all
+** be text or NULL. Chunks of rows are collected in parallel, then merged trigram by
+** trigram in row order. Returns NULL if out of memory.
+*/
+static FdbTrigrams* trigrams_build(const TableInfo* info, uint32_t j) {
+	uint32_t chunk = info->nrows / FDB_TRIGRAM_CHUNKS + 1;
+	uint32_t nchunks = (info->nrows + chunk - 1) / chunk;
+	TrigramBuild build = {info, j, chunk, NULL, NULL, 0};
+	build.pairs = calloc(nchunks > 0 ? nchunks : 1, sizeof(int64_t*));
+	build.npairs = calloc(nchunks > 0 ? nchunks : 1, sizeof(size_t));
+	size_t* pos = calloc(nchunks > 0 ? nchunks : 1, sizeof(size_t));
+	FdbTrigrams* trigrams = calloc(1, sizeof(FdbTrigrams));
+	if (build.pairs != NULL && build.npairs != NULL && pos != NULL && trigrams != NULL) {
+		fdb_parallel_for(fdb_cpu_count(), nchunks, trigrams_chunk, &build);
+	}
+	size_t total = 0;
+	for (uint32_t c = 0; build.npairs != NULL && c < nchunks; c++) {
+		total += build.npairs[c];
+	}
+	uint32_t capacity = 0;
+	bool ok = build.pairs != NULL && build.npairs != NULL && pos != NULL && trigrams != NULL && !build.failed && total < UINT32_MAX;
+	if (ok) {
+		trigrams->rows = malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+		ok = trigrams->rows != NULL;
+	}
+	uint32_t n = 0;
+	while (ok) {
+		// the smallest trigram left in any chunk, its rows follow the chunks' order
+		int64_t key = INT64_MAX;
+		for (uint32_t c = 0; c < nchunks; c++) {
+			if (pos[c] < build.npairs[c] && build.pairs[c][pos[c]] >> 32 < key) {
+				key = build.pairs[c][pos[c]] >> 32;
+			}
+		}
+		if (key == INT64_MAX) {
+			break;
+		}
+		if (trigrams->nkeys + 1 >= capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 1024;
+			uint32_t* keys = realloc(trigrams->keys, capacity * sizeof(uint32_t));
+			trigrams->keys = keys != NULL ? keys : trigrams->keys;
+			uint32_t* starts = realloc(trigrams->starts, capacity * sizeof(uint32_t));
+			trigrams->starts = starts != NULL ? starts : trigrams->starts;
+			ok = keys != NULL && starts != NULL;
+			if (!ok) {
+				break;
+			}
+		}
+		trigrams->keys[trigrams->nkeys] = (uint32_t) key;
+		trigrams->starts[trigrams->nkeys] = n;
+		trigrams->nkeys += 1;
+		for (uint32_t c = 0; c < nchunks; c++) {
+			while (pos[c] < build.npairs[c] && build.pairs[c][pos[c]] >> 32 == key) {
+				trigrams->rows[n++] = (uint32_t) build.pairs[c][pos[c]++];
+			}
+		}
+	}
+	if (ok && trigrams->starts == NULL) {
+		trigrams->starts = malloc(sizeof(uint32_t));
+		ok = trigrams->starts != NULL;
+	}
+	for (uint32_t c = 0; build.pairs != NULL && c < nchunks; c++) {
+		free(build.pairs[c]);
+	}
+	free(build.pairs);
+	free(build.npairs);
+	free(pos);
+	if (!ok) {
+		if (trigrams != NULL) {
+			trigrams->refs = 1;
+			fdb_trigrams_release(trigrams);
+		}
+		return NULL;
+	}
+	trigrams->starts[trigrams->nkeys] = n;
+	trigrams->refs = 1;
+	trigrams->size = sizeof(FdbTrigrams) + ((size_t) 2 * trigrams->nkeys + 1 + n) * sizeof(uint32_t);
+	return trigrams;
+}
+
+/*
+** Return the trigram index of column j of a prepared table, with a reference for the
+** caller, or NULL if there is none. If build is set, it is built first if needed;
+** then NULL means the column can't have one or memory ran out.
+*/
+static FdbTrigrams* fdb_table_trigrams(TableInfo* info, uint32_t j, bool build) {
+	// checked before taking the mutex, fdb_column_typed() takes it too
+	build = build && fdb_column_kind(desc_columns(info->image, info->desc)[j].data_type) == FDB_KIND_TEXT && fdb_column_typed(info, j);
+	FdbTrigrams* trigrams = NULL;
+	sqlite3_mutex_enter(info->mutex);
+	if (info->trigrams == NULL && build) {
+		info->trigrams = calloc(info->desc->ncolumns > 0 ? info->desc->ncolumns : 1, sizeof(FdbTrigrams*));
+	}
+	if (info->trigrams != NULL) {
+		if (info->trigrams[j] == NULL && build) {
+			info->trigrams[j] = trigrams_build(info, j);
+		}
+		trigrams = info->trigrams[j];
+		if (trigrams != NULL) {
+			fdb_atomic_fetch_add(&trigrams->refs, 1);
+		}
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return trigrams;
+}
+
+/*
+** Find the rows of a trigram: trigrams->rows[*start, *stop), empty if no value has it.
+*/
+static void trigrams_find(const FdbTrigrams* trigrams, uint32_t key, uint32_t* start, uint32_t* stop) {
+	uint32_t lo = 0;
+	uint32_t hi = trigrams->nkeys;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (trigrams->keys[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	bool found = lo < trigrams->nkeys && trigrams->keys[lo] == key;
+	*start = found ? trigrams->starts[lo] : 0;
+	*stop = found ? trigrams->starts[lo + 1] : 0;
+}
+
+/*
+** Collect the trigrams of the literal runs of a LIKE or GLOB pattern into out, at
+** most FDB_TRIGRAM_MAX of them. Returns how many there are.
+*/
+static uint32_t pattern_trigrams(const char* pattern, int op, uint32_t* out) {
+	bool glob = op == SQLITE_INDEX_CONSTRAINT_GLOB;
+	uint32_t n = 0;
+	size_t run = 0;
+	for (size_t k = 0; pattern[k] != 0 && n < FDB_TRIGRAM_MAX; k++) {
+		char c = pattern[k];
+		if (glob ? c == '*' || c == '?' || c == '[' : c == '%' || c == '_') {
+			run = 0;
+			if (c == '[') {
+				// skip the character class, a ] right after [ or [^ belongs to it
+				k += pattern[k + 1] == '^';
+				k += pattern[k + 1] == ']';
+				while (pattern[k + 1] != 0 && pattern[k + 1] != ']') {
+					k++;
+				}
+				if (pattern[k + 1] == 0) {
+					break;
+				}
+				k++;
+			}
+			continue;
+		}
+		run++;
+		if (run >= 3) {
+			out[n++] = trigram_at(pattern + k - 2);
+		}
+	}
+	return n;
+}
+
+/*
+** Estimate how many rows a search for a pattern reads: the rows of its rarest
+** trigram and the changed ones. Returns UINT32_MAX if column j has no trigram index
+** or the pattern has no trigram.
+*/
+static uint32_t fdb_trigrams_estimate(TableInfo* info, uint32_t j, const char* pattern, int op) {
+	uint32_t keys[FDB_TRIGRAM_MAX];
+	uint32_t nkeys = pattern_trigrams(pattern, op, keys);
+	uint32_t rows = UINT32_MAX;
+	sqlite3_mutex_enter(info->mutex);
+	FdbTrigrams* trigrams = info->trigrams != NULL ? info->trigrams[j] : NULL;
+	for (uint32_t k = 0; trigrams != NULL && k < nkeys; k++) {
+		uint32_t start, stop;
+		trigrams_find(trigrams, keys[k], &start, &stop);
+		rows = stop - start + trigrams->nchanged < rows ? stop - start + trigrams->nchanged : rows;
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return rows;
+}
+
+/*
+** Collect the rows a pattern can match into a new array in *rows, ascending, and
+** their number in *nrows: the rows on the lists of all of the pattern's trigrams,
+** and the rows changed since the index was built. Returns SQLITE_DONE if the pattern
+** has no trigram to narrow the rows down with.
+*/
+static int fdb_trigrams_search(TableInfo* info, const FdbTrigrams* trigrams, const char* pattern, int op, uint32_t** rows, uint32_t* nrows) {
+	uint32_t keys[FDB_TRIGRAM_MAX];
+	uint32_t starts[FDB_TRIGRAM_MAX];
+	uint32_t stops[FDB_TRIGRAM_MAX];
+	uint32_t nkeys = pattern_trigrams(pattern, op, keys);
+	if (nkeys == 0) {
+		return SQLITE_DONE;
+	}
+	uint32_t shortest = 0;
+	for (uint32_t k = 0; k < nkeys; k++) {
+		trigrams_find(trigrams, keys[k], &starts[k], &stops[k]);
+		if (stops[k] - starts[k] < stops[shortest] - starts[shortest]) {
+			shortest = k;
+		}
+	}
+
+	// the changed rows can only grow while the index is used, see fdb_trigrams_changed()
+	sqlite3_mutex_enter(info->mutex);
+	uint32_t nchanged = trigrams->nchanged;
+	uint32_t* found = sqlite3_malloc64(((uint64_t) stops[shortest] - starts[shortest] + nchanged) * sizeof(uint32_t) + 1);
+	if (found == NULL) {
+		sqlite3_mutex_leave(info->mutex);
+		return SQLITE_NOMEM;
+	}
+	uint32_t n = 0;
+	uint32_t c = 0;
+	for (uint32_t r = starts[shortest]; r < stops[shortest]; r++) {
+		uint32_t row = trigrams->rows[r];
+		bool all = true;
+		for (uint32_t k = 0; k < nkeys && all; k++) {
+			// rows come in ascending order, so each list is searched from where it was left
+			uint32_t lo = starts[k];
+			uint32_t hi = stops[k];
+			while (lo < hi) {
+				uint32_t mid = lo + (hi - lo) / 2;
+				if (trigrams->rows[mid] < row) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			starts[k] = k != shortest ? lo : starts[k];
+			all = lo < stops[k] && trigrams->rows[lo] == row;
+		}
+		if (!all) {
+			continue;
+		}
+		while (c < nchanged && trigrams->changed[c] < row) {
+			found[n++] = trigrams->changed[c++];
+		}
+		c += c < nchanged && trigrams->changed[c] == row;
+		found[n++] = row;
+	}
+	while (c < nchanged) {
+		found[n++] = trigrams->changed[c++];
+	}
+	sqlite3_mutex_leave(info->mutex);
+	*rows = found;
+	*nrows = n;
+	return SQLITE_OK;
+}
+
+/*
+** Record that an UPDATE changed row i of column j, so searches read the row whatever
+** trigrams the new value has.
+*/
+static void fdb_trigrams_changed(TableInfo* info, uint32_t j, uint32_t i) {
+	sqlite3_mutex_enter(info->mutex);
+	FdbTrigrams* trigrams = info->trigrams != NULL ? info->trigrams[j] : NULL;
+	if (trigrams != NULL) {
+		uint32_t lo = 0;
+		uint32_t hi = trigrams->nchanged;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (trigrams->changed[mid] < i) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo == trigrams->nchanged || trigrams->changed[lo] != i) {
+			if (trigrams->nchanged == trigrams->capacity) {
+				uint32_t capacity = trigrams->capacity > 0 ? trigrams->capacity * 2 : 16;
+				uint32_t* changed = realloc(trigrams->changed, capacity * sizeof(uint32_t));
+				if (changed == NULL) {
+					// without room to record the row, the index can't be used any more
+					info->trigrams[j] = NULL;
+					sqlite3_mutex_leave(info->mutex);
+					fdb_trigrams_release(trigrams);
+					return;
+				}
+				trigrams->changed = changed;
+				trigrams->capacity = capacity;
+				trigrams->size += (size_t) (capacity - trigrams->nchanged) * sizeof(uint32_t);
+			}
+			memmove(trigrams->changed + lo + 1, trigrams->changed + lo, (size_t) (trigrams->nchanged - lo) * sizeof(uint32_t));
+			trigrams->changed[lo] = i;
+			trigrams->nchanged += 1;
+		}
+	}
+	sqlite3_mutex_leave(info->mutex);
+}
+
+size_t fdb_trigrams_size(TableInfo* info) {
+	size_t size = 0;
+	sqlite3_mutex_enter(info->mutex);
+	for (uint32_t j = 0; info->trigrams != NULL && j < info->desc->ncolumns; j++) {
+		size += info->trigrams[j] != NULL ? info->trigrams[j]->size : 0;
+	}
+	sqlite3_mutex_leave(info->mutex);
+	return size;
+}
+
+/*
+** Free all trigram indexes of a table. Only called when no search can use them.
+*/
+void fdb_trigrams_free(TableInfo* info) {
+	for (uint32_t j = 0; info->trigrams != NULL && j < info->desc->ncolumns; j++) {
+		fdb_trigrams_release(info->trigrams[j]);
+	}
+	free(info->trigrams);
+	info->trigrams = NULL;
+}
@@ -0,0 +1,168 @@
+/*
+** Validation of fdb images read from files, so that a truncated or corrupt file
+** results in an error instead of crashing the process.
+**
+** fdb_validate_header() checks the table list and everything needed to register and
+** connect to tables (names, columns, bucket arrays). It only touches a few bytes per
+** table and is always run for files. fdb_validate() additionally walks every bucket,
+** row and value of every table once, and is enabled with the validate=1 option.
+** Both return NULL if the image is fine, or an error message to be freed with
+** sqlite3_free().
+*/
+
+static inline bool range_ok(size_t size, fdb_offset offset, uint64_t len) {
+	return offset != FDB_NO_OFFSET && offset <= size && len <= size - offset;
+}
+
+static inline bool string_ok(const char* base, size_t size, fdb_offset offset) {
+	return offset != FDB_NO_OFFSET && offset < size && memchr(base + offset, 0, size - offset) != NULL;
+}
+
+char* fdb_validate_header(const char* base, size_t size) {
+	if (size < sizeof(FdbHeader)) {
+		return sqlite3_mprintf("fdb: file too small");
+	}
+	const FdbHeader* header = (const FdbHeader*) base;
+	if (!range_ok(size, header->tables, (uint64_t) header->ntables * sizeof(Table))) {
+		return sqlite3_mprintf("fdb: table list out of range");
+	}
+	const Table* tables = fdb_at(base, header->tables);
+	for (uint32_t i = 0; i < header->ntables; i++) {
+		if (!range_ok(size, tables[i].desc, sizeof(TableDescription)) || !range_ok(size, tables[i].hash_table, sizeof(HashTable))) {
+			return sqlite3_mprintf("fdb: table %u out of range", i);
+		}
+		const TableDescription* desc = table_desc(base, &tables[i]);
+		if (!string_ok(base, size, desc->name)) {
+			return sqlite3_mprintf("fdb: name of table %u out of range", i);
+		}
+		const char* name = desc_name(base, desc);
+		if (!range_ok(size, desc->columns, (uint64_t) desc->ncolumns * sizeof(Column))) {
+			return sqlite3_mprintf("fdb: table %s: columns out of range", name);
+		}
+		const Column* columns = desc_columns(base, desc);
+		for (uint32_t j = 0; j < desc->ncolumns; j++) {
+			if (columns[j].data_type > FDB_TEXT || !string_ok(base, size, columns[j].name)) {
+				return sqlite3_mprintf("fdb: table %s: invalid column %u", name, j);
+			}
+		}
+		const HashTable* hash_table = table_hash_table(base, &tables[i]);
+		if ((hash_table->nbuckets & (hash_table->nbuckets - 1)) != 0) {
+			return sqlite3_mprintf("fdb: table %s: bucket count %u is not a power of two", name, hash_table->nbuckets);
+		}
+		if (!range_ok(size, hash_table->buckets, (uint64_t) hash_table->nbuckets * sizeof(fdb_offset))) {
+			return sqlite3_mprintf("fdb: table %s: buckets out of range", name);
+		}
+	}
+	return NULL;
+}
+
+/*
+** The same for packed containers: check the container's header and entries.
+*/
+char* fdb_validate_pack_header(const char* base, size_t size) {
+	if (size < sizeof(FdbPackHeader)) {
+		return sqlite3_mprintf("fdb: file too small");
+	}
+	const FdbPackHeader* header = (const FdbPackHeader*) base;
+	if (header->version != FDB_PACK_VERSION) {
+		return sqlite3_mprintf("fdb: unsupported packed container version %u", header->version);
+	}
+	if (!range_ok(size, header->entries, (uint64_t) header->ntables * sizeof(FdbPackEntry))) {
+		return sqlite3_mprintf("fdb: table list out of range");
+	}
+	const FdbPackEntry* entries = fdb_at(base, header->entries);
+	for (uint32_t i = 0; i < header->ntables; i++) {
+		if (!string_ok(base, size, entries[i].name) || entries[i].data > size || entries[i].packed_size > size - entries[i].data) {
+			return sqlite3_mprintf("fdb: table %u out of range", i);
+		}
+	}
+	return NULL;
+}
+
+static char* validate_row(const char* base, size_t size, const TableDescription* desc, const Row* row) {
+	if (row->nvalues != desc->ncolumns) {
+		return sqlite3_mprintf("fdb: table %s: row has %u values, expected %u", desc_name(base, desc), row->nvalues, desc->ncolumns);
+	}
+	if (!range_ok(size, row->values, (uint64_t) row->nvalues * sizeof(Value))) {
+		return sqlite3_mprintf("fdb: table %s: row values out of range", desc_name(base, desc));
+	}
+	const Value* values = row_values(base, row);
+	for (uint32_t i = 0; i < row->nvalues; i++) {
+		bool ok;
+		switch (values[i].data_type) {
+			case FDB_NULL:
+			case FDB_I32:
+			case FDB_U32:
+			case FDB_REAL:
+			case FDB_BOOLEAN:
+				ok = true;
+				break;
+			case FDB_I64:
+			case FDB_U64:
+				ok = range_ok(size, values[i].value.offset, sizeof(int64_t));
+				break;
+			case FDB_NVARCHAR:
+			case FDB_TEXT:
+				ok = string_ok(base, size, values[i].value.offset);
+				break;
+			default:
+				ok = false;
+		}
+		if (!ok) {
+			return sqlite3_mprintf("fdb: table %s: invalid value in column %u", desc_name(base, desc), i);
+		}
+	}
+	return NULL;
+}
+
+/*
+** Walk every bucket, row and value of one table. The image must have passed
+** fdb_validate_header().
+*/
+char* fdb_validate_table(const char* base, size_t size, const TableInfo* info) {
+	// a chain can't have more distinct buckets than fit into the file, walking more means it loops
+	uint64_t max_chain = size / sizeof(Bucket);
+	// largest offset a bucket can start at, FDB_NO_OFFSET itself is never valid
+	uint32_t bucket_limit = size - sizeof(Bucket) < FDB_NO_OFFSET ? (uint32_t) (size - sizeof(Bucket)) : FDB_NO_OFFSET - 1;
+
+	const HashTable* hash_table = info->hash_table;
+	const fdb_offset* buckets = hash_table_buckets(base, hash_table);
+	if (!fdb_offsets_in_range(buckets, hash_table->nbuckets, bucket_limit)) {
+		return sqlite3_mprintf("fdb: table %s: bucket out of range", info->name);
+	}
+	for (uint32_t i = 0; i < hash_table->nbuckets; i++) {
+		uint64_t chain = 0;
+		for (fdb_offset offset = buckets[i]; offset != FDB_NO_OFFSET; ) {
+			if (!range_ok(size, offset, sizeof(Bucket)) || ++chain > max_chain) {
+				return sqlite3_mprintf("fdb: table %s: broken chain in bucket %u", info->name, i);
+			}
+			const Bucket* bucket = fdb_at(base, offset);
+			if (!range_ok(size, bucket->row, sizeof(Row))) {
+				return sqlite3_mprintf("fdb: table %s: row out of range", info->name);
+			}
+			char* zErr = validate_row(base, size, info->desc, bucket_row(base, bucket));
+			if (zErr != NULL) {
+				return zErr;
+			}
+			offset = bucket->next;
+		}
+	}
+	return NULL;
+}
+
+/*
+** Validate every table of an image. Tables of packed containers are skipped here,
+** they are validated as they get unpacked.
+*/
+char* fdb_validate(const Fdb* fdb) {
+	for (uint32_t t = 0; t < fdb->ntables; t++) {
+		if (fdb->info[t].packed != NULL) {
+			continue;
+		}
+		char* zErr = fdb_validate_table(fdb->base, fdb->size, &fdb->info[t]);
+		if (zErr != NULL) {
+			return zErr;
+		}
+	}
+	return NULL;
+}
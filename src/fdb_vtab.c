@@ -6,6 +6,21 @@ SQLITE_EXTENSION_INIT1
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include "fdb_thread.c"
+#include "fdb_memory.c"
+#include "fdb_simd.c"
+#include "fdb_validate.c"
+#include "fdb_lz.c"
+#include "fdb_columnar.c"
+#include "fdb_filter.c"
+#include "fdb_index.c"
+#include "fdb_sorted.c"
+#include "fdb_trigram.c"
+#include "fdb_cost.c"
+#include "fdb_table.c"
+#include "fdb_pack.c"
+#include "fdb_file.c"
+#include "fdb_snapshot.c"
 
 /* fdb_vtab is a subclass of sqlite3_vtab which is
 ** underlying representation of the virtual table
@@ -14,9 +29,19 @@ typedef struct fdb_vtab fdb_vtab;
 struct fdb_vtab {
 	sqlite3_vtab base;	/* Base class - must be first */
 	/* Add new fields here, as necessary */
-	Table* table;
+	TableInfo* table;  /* Only in use while planning, in a cursor or in an UPDATE, see fdb_table_use() */
+	Fdb* fdb;    /* Image the table belongs to */
+	Fdb* owner;  /* Image to release on disconnect, if this vtab holds a reference */
+	uint8_t* types;  /* Data type of each column, copied so the table can be evicted in between */
 };
 
+/*
+** idxNum of plans that return rows ordered by the key, see fdbBestIndex()
+*/
+#define FDB_ORDER_ASC 1
+#define FDB_ORDER_DESC 2
+#define FDB_ORDER_ROWID 3  /* Ascending rowid, the order of table->rows */
+
 /* fdb_cursor is a subclass of sqlite3_vtab_cursor which will
 ** serve as the underlying representation of a cursor that scans
 ** over rows of the result
@@ -25,12 +50,32 @@ typedef struct fdb_cursor fdb_cursor;
 struct fdb_cursor {
 	sqlite3_vtab_cursor base;  /* Base class - must be first */
 	/* Add new fields here, as necessary */
-	Table* table;
-	uint64_t bucketIndex;
-	uint64_t stopIndex;
-	Bucket* curBucket;
+	TableInfo* table;
+	uint32_t rowIndex;   /* Current position in table->rows, or in order if set */
+	uint32_t rowStop;    /* End of the run of rows being iterated */
+	uint32_t nextIndex;  /* A second run of rows to continue with, for key ranges */
+	uint32_t nextStop;   /* that wrap around the end of the bucket array */
+	ColumnData* columnar;  /* The table's columnar copy, if it has one */
+	bool compact;          /* Every column the query reads is in columnar */
+	FdbPredicate* preds;   /* Pushed down WHERE terms rows have to pass, see fdb_filter.c */
+	uint32_t npreds;
+	uint32_t batchStart;   /* First row of the batch rowIndex is in */
+	uint64_t batchMask;    /* Rows of that batch from rowIndex on that passed the predicates */
+	const uint32_t* order; /* Row indices to visit instead of table->rows in order, or NULL */
+	FdbIndex* index;       /* Secondary index order points into, referenced by the cursor */
+	FdbSorted* sorted;     /* Or sorted view order points into, referenced by the cursor */
+	uint32_t* keyRows;     /* Or rows of the buckets of an IN list on the key, owned by the cursor */
+	int64_t limit;         /* Rows still to return, negative if there's no LIMIT */
+	bool used;             /* The cursor uses the table, from the first fdbFilter() on */
 };
 
+/*
+** Index into table->rows of the row a cursor is on.
+*/
+static inline uint32_t fdbCursorRow(fdb_cursor *pCur) {
+	return pCur->order != NULL ? pCur->order[pCur->rowIndex] : pCur->rowIndex;
+}
+
 const char* SQLITE_TYPE[9] = {"none", "int32", "uint32", "real", "text_4", "int_bool", "int64", "uint64", "text_8"};
 
 /*
@@ -46,55 +91,158 @@ const char* SQLITE_TYPE[9] = {"none", "int32", "uint32", "real", "text_4", "int_
 **		(2) Tell SQLite (via the sqlite3_declare_vtab() interface) what the
 **				result set of queries against the virtual table will look like.
 */
-static int fdbConnect(
+static int fdbConnectTable(
 	sqlite3 *db,
-	void *pAux,
-	int argc, const char *const*argv,
+	Fdb* fdb,
+	const char* zTable,
 	sqlite3_vtab **ppVtab,
 	char **pzErr
 ){
-	if (argc < 1) {
-		return SQLITE_ERROR;
-	}
-
-  Fdb* fdb = pAux;
-
 	for (uint32_t i = 0; i < fdb->ntables; i++) {
-		TableDescription* desc = fdb->tables[i].desc;
-
-		if (strcmp(desc->name, argv[0]) != 0) {
+		TableInfo* table = &fdb->info[i];
+		if (strcmp(table->name, zTable) != 0) {
 			continue;
 		}
 
-		char declaration[8192];
-		sprintf(declaration, "CREATE TABLE x(");
+		// the table is only used while its columns are declared, a packed one can be
+		// evicted again until a query needs it
+		*pzErr = fdb_table_use(fdb, table);
+		if (*pzErr != NULL) {
+			return SQLITE_ERROR;
+		}
+		TableDescription* desc = table->desc;
+
+		sqlite3_str* declaration = sqlite3_str_new(db);
+		sqlite3_str_appendall(declaration, "CREATE TABLE x(");
+		uint8_t* types = sqlite3_malloc64(desc->ncolumns + 1);
 
+		Column* columns = desc_columns(table->image, desc);
 		for (uint32_t j = 0; j < desc->ncolumns; j++) {
-			uint32_t data_type = desc->columns[j].data_type;
+			uint32_t data_type = columns[j].data_type;
 			if (data_type > 8) {
+				sqlite3_free(sqlite3_str_finish(declaration));
+				sqlite3_free(types);
+				fdb_table_unuse(table);
 				return SQLITE_ERROR;
 			}
-			sprintf(declaration+strlen(declaration), "'%s' %s,", desc->columns[j].name, SQLITE_TYPE[data_type]);
+			if (types != NULL) {
+				types[j] = (uint8_t) data_type;
+			}
+			sqlite3_str_appendf(declaration, "%s'%q' %s", j > 0 ? "," : "", column_name(table->image, &columns[j]), SQLITE_TYPE[data_type]);
 		}
-		sprintf(declaration+strlen(declaration)-(desc->ncolumns > 0), ")");
+		sqlite3_str_appendall(declaration, ")");
+		fdb_table_unuse(table);
 
-		int rc = sqlite3_declare_vtab(db, declaration);
-		//printf("create table statement: %s, rc: %i\n", declaration, rc);
+		char* zDeclaration = sqlite3_str_finish(declaration);
+		if (zDeclaration == NULL || types == NULL) {
+			sqlite3_free(zDeclaration);
+			sqlite3_free(types);
+			return SQLITE_NOMEM;
+		}
+		int rc = sqlite3_declare_vtab(db, zDeclaration);
+		//printf("create table statement: %s, rc: %i\n", zDeclaration, rc);
+		sqlite3_free(zDeclaration);
 		fdb_vtab *pNew;
 
 		if(rc == SQLITE_OK) {
 			pNew = sqlite3_malloc(sizeof(*pNew));
 			*ppVtab = (sqlite3_vtab*)pNew;
 			if (pNew == NULL) {
+				sqlite3_free(types);
 				return SQLITE_NOMEM;
 			}
 			memset(pNew, 0, sizeof(*pNew));
-			pNew->table = &fdb->tables[i];
+			pNew->table = table;
+			pNew->fdb = fdb;
+			pNew->types = types;
+		} else {
+			sqlite3_free(types);
 		}
 		return rc;
-  }
+	}
+
+	*pzErr = sqlite3_mprintf("fdb: no such table: %s", zTable);
+	return SQLITE_ERROR;
+}
 
-  return SQLITE_ERROR;
+/*
+** Modules registered for the individual tables of an image get the image as pAux
+** and the table name as the module name.
+*/
+static int fdbConnect(
+	sqlite3 *db,
+	void *pAux,
+	int argc, const char *const*argv,
+	sqlite3_vtab **ppVtab,
+	char **pzErr
+){
+	if (argc < 1) {
+		return SQLITE_ERROR;
+	}
+	return fdbConnectTable(db, pAux, argv[0], ppVtab, pzErr);
+}
+
+/*
+** The fdb module opens a table of a fdb file given by path:
+**
+**   CREATE VIRTUAL TABLE objects USING fdb('cdclient.fdb', 'Objects');
+**
+** The table name defaults to the name of the virtual table, any further arguments
+** are 'name=value' options (see FdbOptions). The file is loaded through the image
+** registry, so all virtual tables on the same file share one copy.
+*/
+static int fdbFileConnect(
+	sqlite3 *db,
+	void *pAux,
+	int argc, const char *const*argv,
+	sqlite3_vtab **ppVtab,
+	char **pzErr
+){
+	if (argc < 4) {
+		*pzErr = sqlite3_mprintf("fdb: usage: fdb(path [, table] [, option=value ...])");
+		return SQLITE_ERROR;
+	}
+
+	FdbOptions options = {0};
+	char* zTable = NULL;
+	for (int32_t i = 4; i < argc; i++) {
+		char* arg = fdb_dequote(argv[i]);
+		if (arg == NULL) {
+			sqlite3_free(zTable);
+			return SQLITE_NOMEM;
+		}
+		if (i == 4 && strchr(arg, '=') == NULL) {
+			zTable = arg;
+			continue;
+		}
+		bool ok = fdb_parse_option(&options, arg, pzErr);
+		sqlite3_free(arg);
+		if (!ok) {
+			sqlite3_free(zTable);
+			return SQLITE_ERROR;
+		}
+	}
+
+	char* zPath = fdb_dequote(argv[3]);
+	if (zPath == NULL) {
+		sqlite3_free(zTable);
+		return SQLITE_NOMEM;
+	}
+	Fdb* fdb = fdb_open(zPath, &options, pzErr);
+	sqlite3_free(zPath);
+	if (fdb == NULL) {
+		sqlite3_free(zTable);
+		return SQLITE_ERROR;
+	}
+
+	int rc = fdbConnectTable(db, fdb, zTable != NULL ? zTable : argv[2], ppVtab, pzErr);
+	sqlite3_free(zTable);
+	if (rc == SQLITE_OK) {
+		((fdb_vtab*)*ppVtab)->owner = fdb;
+	} else {
+		fdb_release(fdb);
+	}
+	return rc;
 }
 
 /*
@@ -103,6 +251,10 @@ static int fdbConnect(
 static int fdbDisconnect(sqlite3_vtab *pVtab) {
 	//printf("Disconnect!\n");
 	fdb_vtab *p = (fdb_vtab*)pVtab;
+	sqlite3_free(p->types);
+	if (p->owner != NULL) {
+		fdb_release(p->owner);
+	}
 	sqlite3_free(p);
 	return SQLITE_OK;
 }
@@ -112,7 +264,7 @@ static int fdbDisconnect(sqlite3_vtab *pVtab) {
 */
 static int fdbOpen(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
 	fdb_vtab *p = (fdb_vtab*)pVtab;
-	//printf("%s Open!\n", p->table->desc->name);
+	//printf("%s Open!\n", p->table->name);
 	fdb_cursor *pCur;
 	pCur = sqlite3_malloc(sizeof(*pCur));
 	if (pCur == NULL) return SQLITE_NOMEM;
@@ -127,39 +279,107 @@ static int fdbOpen(sqlite3_vtab* pVtab, sqlite3_vtab_cursor** ppCursor) {
 */
 static int fdbClose(sqlite3_vtab_cursor *cur) {
 	fdb_cursor *pCur = (fdb_cursor*)cur;
-	//printf("%s Close!\n", pCur->table->desc->name);
+	fdb_predicates_free(pCur->preds, pCur->npreds);
+	fdb_index_release(pCur->index);
+	fdb_sorted_release(pCur->sorted);
+	sqlite3_free(pCur->keyRows);
+	if (pCur->used) {
+		fdb_table_unuse(pCur->table);
+	}
 	sqlite3_free(pCur);
 	return SQLITE_OK;
 }
 
 /*
-** Advance a fdb_cursor to its next row of output.
+** Move on to the second run of rows once the first one is done.
 */
-static int fdbNext(sqlite3_vtab_cursor *cur) {
-	fdb_cursor *pCur = (fdb_cursor*)cur;
-	//printf("\n%s Next! bucketIndex %lli curBucket %i\n", pCur->table->desc->name, pCur->bucketIndex, (uint32_t) pCur->curBucket);
+static void fdbNextRun(fdb_cursor *pCur) {
+	if (pCur->rowIndex >= pCur->rowStop && pCur->nextIndex < pCur->nextStop) {
+		pCur->rowIndex = pCur->nextIndex;
+		pCur->rowStop = pCur->nextStop;
+		pCur->nextIndex = pCur->nextStop = 0;
+	}
+}
 
-	if (pCur->curBucket != NULL && pCur->curBucket->next != NULL) {
-		pCur->curBucket = pCur->curBucket->next;
-	} else {
-		pCur->curBucket = NULL;
-		uint32_t nbuckets = pCur->table->hash_table->nbuckets;
-		// fast forward the cursor to the first valid bucket
-		for (uint64_t i = pCur->bucketIndex+1; i < pCur->stopIndex; i++) {
-			Bucket* bucket = pCur->table->hash_table->buckets[i % nbuckets];
-			if (bucket == NULL) {
-				//printf("Skipping empty bucket %lli\n", i);
-				continue;
+/*
+** Move to the first row from row index from on that passes the cursor's predicates,
+** testing a batch of rows at a time.
+*/
+static void fdbNextBatch(fdb_cursor *pCur, uint32_t from) {
+	for (;;) {
+		if (from >= pCur->rowStop) {
+			pCur->rowIndex = pCur->rowStop;
+			if (pCur->nextIndex >= pCur->nextStop) {
+				return;
 			}
-			pCur->curBucket = bucket;
-			pCur->bucketIndex = i;
-			break;
+			fdbNextRun(pCur);
+			from = pCur->rowIndex;
+			continue;
+		}
+		uint32_t n = pCur->rowStop - from < FDB_BATCH ? pCur->rowStop - from : FDB_BATCH;
+		uint64_t mask = fdb_predicates_test(pCur->table, pCur->columnar, pCur->preds, pCur->npreds, pCur->order, from, n);
+		if (mask != 0) {
+			pCur->batchStart = from;
+			pCur->batchMask = mask;
+			pCur->rowIndex = from + fdb_ctz64(mask);
+			return;
 		}
-		// fast forwarding skipped the entire remaining table, mark as EOF
-		if (pCur->curBucket == NULL) {
-			pCur->bucketIndex = pCur->stopIndex;
+		from += n;
+	}
+}
+
+/*
+** Skip the next offset rows of output. Without predicates that's arithmetic on the
+** runs; with them, whole batches are skipped by the number of rows that passed.
+*/
+static void fdbSkip(fdb_cursor *pCur, int64_t offset) {
+	if (pCur->npreds == 0) {
+		while (offset > 0 && pCur->rowIndex < pCur->rowStop) {
+			uint32_t n = pCur->rowStop - pCur->rowIndex;
+			if (offset < n) {
+				pCur->rowIndex += (uint32_t) offset;
+				return;
+			}
+			offset -= n;
+			pCur->rowIndex = pCur->rowStop;
+			fdbNextRun(pCur);
 		}
+		return;
 	}
+	while (offset > 0 && pCur->rowIndex < pCur->rowStop) {
+		uint32_t n = fdb_popcount64(pCur->batchMask);
+		if (offset < n) {
+			for (; offset > 0; offset--) {
+				pCur->batchMask &= pCur->batchMask - 1;
+			}
+			pCur->rowIndex = pCur->batchStart + fdb_ctz64(pCur->batchMask);
+			return;
+		}
+		offset -= n;
+		fdbNextBatch(pCur, pCur->batchStart + FDB_BATCH);
+	}
+}
+
+/*
+** Advance a fdb_cursor to its next row of output.
+*/
+static int fdbNext(sqlite3_vtab_cursor *cur) {
+	fdb_cursor *pCur = (fdb_cursor*)cur;
+	//printf("\nNext! rowIndex %u rowStop %u\n", pCur->rowIndex, pCur->rowStop);
+	if (pCur->limit > 0) {
+		pCur->limit -= 1;
+	}
+	if (pCur->npreds > 0) {
+		pCur->batchMask &= pCur->batchMask - 1;
+		if (pCur->batchMask != 0) {
+			pCur->rowIndex = pCur->batchStart + fdb_ctz64(pCur->batchMask);
+		} else {
+			fdbNextBatch(pCur, pCur->batchStart + FDB_BATCH);
+		}
+		return SQLITE_OK;
+	}
+	pCur->rowIndex += 1;
+	fdbNextRun(pCur);
 	return SQLITE_OK;
 }
 
@@ -177,8 +397,34 @@ static int fdbColumn(
 	}
 
 	fdb_cursor *pCur = (fdb_cursor*)cur;
+	char* image = pCur->table->image;
+
+	if (pCur->columnar != NULL && pCur->columnar[i].values != NULL) {
+		ColumnData* column = &pCur->columnar[i];
+		uint32_t r = fdbCursorRow(pCur);
+		if (column->nulls[r >> 3] & (1 << (r & 7))) {
+			sqlite3_result_null(ctx);
+			return SQLITE_OK;
+		}
+		switch (column->data_type) {
+			case FDB_I32: sqlite3_result_int(ctx, ((int32_t*) column->values)[r]); break;
+			case FDB_U32: sqlite3_result_int64(ctx, ((uint32_t*) column->values)[r]); break;
+			case FDB_REAL: sqlite3_result_double(ctx, (double) ((float*) column->values)[r]); break;
+			case FDB_BOOLEAN: sqlite3_result_int(ctx, ((uint8_t*) column->values)[r]); break;
+			case FDB_I64: sqlite3_result_int64(ctx, ((int64_t*) column->values)[r]); break;
+			case FDB_U64: sqlite3_result_int64(ctx, (int64_t) ((uint64_t*) column->values)[r]); break;
+			case FDB_NVARCHAR:
+			case FDB_TEXT: sqlite3_result_text(ctx, ((const char**) column->values)[r], -1, SQLITE_STATIC); break;
+		}
+		return SQLITE_OK;
+	}
 
-	Value value = pCur->curBucket->row->values[i];
+	Row* row = pCur->table->rows[fdbCursorRow(pCur)];
+	if (i >= row->nvalues) {
+		sqlite3_result_null(ctx);
+		return SQLITE_OK;
+	}
+	Value value = row_values(image, row)[i];
 	switch(value.data_type) {
 		case FDB_NULL:
 			//printf("| NULL ");
@@ -189,8 +435,8 @@ static int fdbColumn(
 			sqlite3_result_int(ctx, value.value.i32);
 			break;
 		case FDB_U32:
-			//printf("| %i ", value.value.u32);
-			sqlite3_result_int(ctx, value.value.u32);
+			//printf("| %u ", value.value.u32);
+			sqlite3_result_int64(ctx, value.value.u32);
 			break;
 		case FDB_REAL:
 			//printf("| %f ", value.value.real);
@@ -201,17 +447,17 @@ static int fdbColumn(
 			sqlite3_result_int(ctx, value.value.boolean);
 			break;
 		case FDB_I64:
-			//printf("| %lli ", *value.value.i64p);
-			sqlite3_result_int64(ctx, *value.value.i64p);
+			//printf("| %lli ", *value_i64p(image, &value));
+			sqlite3_result_int64(ctx, *value_i64p(image, &value));
 			break;
 		case FDB_U64:
-			//printf("| %lli ", *value.value.u64p);
-			sqlite3_result_int64(ctx, *value.value.u64p);
+			//printf("| %lli ", *value_u64p(image, &value));
+			sqlite3_result_int64(ctx, *value_u64p(image, &value));
 			break;
 		case FDB_NVARCHAR:
 		case FDB_TEXT:
-			//printf("| %s ", value.value.text);
-			sqlite3_result_text(ctx, value.value.text, -1, SQLITE_STATIC);
+			//printf("| %s ", value_text(image, &value));
+			sqlite3_result_text(ctx, value_text(image, &value), -1, SQLITE_STATIC);
 			break;
 		default:
 			return SQLITE_ERROR;
@@ -220,35 +466,14 @@ static int fdbColumn(
 	return SQLITE_OK;
 }
 
-#ifdef __GNUC__
-#define ctz(x) __builtin_ctz(x)
-#endif
-#ifdef _MSC_VER
-#include <intrin.h>
-uint32_t __inline ctz(uint32_t value) {
-	uint32_t trailing_zero = 0;
-	if (_BitScanForward(&trailing_zero, value)) return trailing_zero;
-	return 0;
-}
-#endif
-
 /*
-** Return the rowid for the current row.	In this implementation, the
-** rowid is the same as the output value.
+** Return the rowid for the current row: its index in table->rows. Rows never move,
+** and are collected in the same order whenever a table is prepared again, so rowids
+** stay valid for the life of the image.
 */
 static int fdbRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
 	fdb_cursor *pCur = (fdb_cursor*)cur;
-	uint32_t nbuckets = pCur->table->hash_table->nbuckets;
-	uint32_t nbits = ctz(nbuckets);
-	uint32_t i = 0;
-	Bucket* bucket = pCur->table->hash_table->buckets[pCur->bucketIndex % nbuckets];
-	while (bucket != pCur->curBucket) {
-		i += 1;
-		bucket = bucket->next;
-	}
-	sqlite3_int64 rowid = pCur->bucketIndex % nbuckets;
-	rowid |= (i << nbits);
-	*pRowid = rowid;
+	*pRowid = fdbCursorRow(pCur);
 	//printf("Rowid = %lli\n", rowid);
 	return SQLITE_OK;
 }
@@ -259,8 +484,8 @@ static int fdbRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
 */
 static int fdbEof(sqlite3_vtab_cursor *cur){
 	fdb_cursor *pCur = (fdb_cursor*)cur;
-	//printf("%s eof! bucketIndex %lli, stopIndex %lli, is eof? %i\n", pCur->table->desc->name, pCur->bucketIndex, pCur->stopIndex, pCur->bucketIndex == pCur->stopIndex);
-	return pCur->bucketIndex == pCur->stopIndex;
+	//printf("eof! rowIndex %u, rowStop %u\n", pCur->rowIndex, pCur->rowStop);
+	return pCur->limit == 0 || pCur->rowIndex >= pCur->rowStop;
 }
 
 void print_sqlite3_value(sqlite3_value* value) {
@@ -288,187 +513,987 @@ void print_sqlite3_value(sqlite3_value* value) {
 }
 
 /*
-** This method is called to "rewind" the fdb_cursor object back
-** to the first row of output.	This method is always called at least
-** once prior to any call to fdbColumn() or fdbRowid() or
-** fdbEof().
+** fdbBestIndex() tells fdbFilter() what each of its arguments is in idxStr, one entry
+** per argument: 'k<column>:<op>;' for a bound on the key, which narrows the buckets to
+** scan, 'i<column>:<op>;' for a whole IN list of keys (see sqlite3_vtab_in()),
+** 'p<column>:<op>;' for a predicate on any column (see fdb_filter.c), 'x<column>:<op>;'
+** for a LIKE or GLOB pattern, 'r0:<op>;' for a bound on the rowid, 'j0:<op>;' for an
+** IN list of rowids, and 'l0:<op>;' and
+** 'o0:<op>;' for the LIMIT and OFFSET of the query. Bounds on the key are tested
+** as predicates as well, other keys share their buckets. A last 'u<mask>;' without an
+** argument gives the columns the query reads (sqlite3_index_info.colUsed).
 */
-static int fdbFilter(
+static bool fdbPlanNext(const char** plan, char* kind, uint32_t* column, int* op) {
+	const char* p = *plan;
+	char* end;
+	if (*p != 'k' && *p != 'i' && *p != 'p' && *p != 'l' && *p != 'o' && *p != 'r' && *p != 'j' && *p != 'x') {
+		return false;
+	}
+	*kind = *p;
+	*column = (uint32_t) strtoul(p + 1, &end, 10);
+	if (*end != ':') {
+		return false;
+	}
+	*op = (int) strtol(end + 1, &end, 10);
+	if (*end != ';') {
+		return false;
+	}
+	*plan = end + 1;
+	return true;
+}
+
+/*
+** Narrow the integer range [*min, *max) to the values an integer predicate lets
+** through. A range nothing can be in ends up with *max < *min.
+*/
+static void fdbNarrowRange(const FdbPredicate* pred, int64_t* min, int64_t* max) {
+	// the predicate has turned reals into integer bounds already
+	switch (pred->op) {
+		case FDB_PRED_NONE:
+			*min = INT64_MAX;
+			*max = INT64_MIN;
+			break;
+		case FDB_PRED_GT:
+			if (pred->i == INT64_MAX) {
+				*min = INT64_MAX;
+				*max = INT64_MIN;
+			} else if (*min < pred->i+1) {
+				*min = pred->i+1;
+			}
+			break;
+		case FDB_PRED_GE:
+			if (*min < pred->i) {
+				*min = pred->i;
+			}
+			break;
+		case FDB_PRED_EQ:
+			if (*min < pred->i) {
+				*min = pred->i;
+			}
+			if (pred->i < INT64_MAX && *max > pred->i+1) {
+				*max = pred->i+1;
+			}
+			break;
+		case FDB_PRED_LE:
+			if (pred->i < INT64_MAX && *max > pred->i+1) {
+				*max = pred->i+1;
+			}
+			break;
+		case FDB_PRED_LT:
+			if (*max > pred->i) {
+				*max = pred->i;
+			}
+			break;
+		default:
+			// decided by SQLite or by the predicate alone
+			break;
+	}
+}
+
+/*
+** Visit the rows of the key column's sorted view between the bounds of the key's
+** predicates, in ascending or descending key order. Rows whose key is NULL or of
+** another type than the column's sort before the rest in the view. If the column has
+** only NULLs there, they stay in place, as SQLite sorts them first too; otherwise
+** those rows are visited last for SQLite to decide on.
+*/
+static int fdbFilterSorted(fdb_cursor *pCur, bool desc) {
+	TableInfo* table = pCur->table;
+	pCur->sorted = fdb_table_sorted(table, 0);
+	if (pCur->sorted == NULL) {
+		return SQLITE_NOMEM;
+	}
+	const uint32_t* rows = desc ? fdb_sorted_reversed(table, pCur->sorted) : pCur->sorted->rows;
+	if (rows == NULL) {
+		return SQLITE_NOMEM;
+	}
+	uint32_t nrows = table->nrows;
+	uint32_t first = pCur->sorted->first;
+	bool typed = fdb_column_typed(table, 0);
+	uint32_t lo = typed ? 0 : first;
+	uint32_t hi = nrows;
+	for (uint32_t p = 0; p < pCur->npreds; p++) {
+		FdbPredicate* pred = &pCur->preds[p];
+		if (pred->column != 0) {
+			continue;
+		}
+		uint32_t pos;
+		switch (pred->op) {
+			case FDB_PRED_NONE:
+				// the cursor is left at EOF
+				return SQLITE_OK;
+			case FDB_PRED_GT:
+				pos = fdb_sorted_search(table, pCur->sorted, pred, true);
+				lo = pos > lo ? pos : lo;
+				break;
+			case FDB_PRED_GE:
+				pos = fdb_sorted_search(table, pCur->sorted, pred, false);
+				lo = pos > lo ? pos : lo;
+				break;
+			case FDB_PRED_EQ:
+				pos = fdb_sorted_search(table, pCur->sorted, pred, false);
+				lo = pos > lo ? pos : lo;
+				pos = fdb_sorted_search(table, pCur->sorted, pred, true);
+				hi = pos < hi ? pos : hi;
+				break;
+			case FDB_PRED_LT:
+				pos = fdb_sorted_search(table, pCur->sorted, pred, false);
+				hi = pos < hi ? pos : hi;
+				break;
+			case FDB_PRED_LE:
+				pos = fdb_sorted_search(table, pCur->sorted, pred, true);
+				hi = pos < hi ? pos : hi;
+				break;
+		}
+	}
+	hi = hi > lo ? hi : lo;
+	pCur->order = rows;
+	pCur->rowIndex = desc ? nrows - hi : lo;
+	pCur->rowStop = desc ? nrows - lo : hi;
+	if (first > 0 && !typed) {
+		pCur->nextIndex = desc ? nrows - first : 0;
+		pCur->nextStop = desc ? nrows : first;
+	}
+	return SQLITE_OK;
+}
+
+/*
+** Return true if fdbFilterRows() will read every row of the table: no key, rowid,
+** key order, secondary index, pattern prefix or trigram narrows the rows down.
+*/
+static bool fdbScansAll(fdb_cursor *pCur, bool keyed, int idxNum, sqlite3_value* pattern, uint32_t patternColumn, int patternOp) {
+	if (keyed || (idxNum != 0 && idxNum != FDB_ORDER_ROWID)) {
+		return false;
+	}
+	for (uint32_t p = 0; p < pCur->npreds; p++) {
+		if (pCur->preds[p].op == FDB_PRED_EQ && fdb_index_rows_per_key(pCur->table, pCur->preds[p].column) > 0) {
+			return false;
+		}
+	}
+	const char* text = pattern != NULL && sqlite3_value_type(pattern) == SQLITE_TEXT ? (const char*) sqlite3_value_text(pattern) : NULL;
+	return text == NULL || (fdb_pattern_prefix(text, patternOp) == 0 && fdb_trigrams_estimate(pCur->table, patternColumn, text, patternOp) == UINT32_MAX);
+}
+
+/*
+** Visit only the rows whose text in column j can match a LIKE or GLOB pattern. Rows
+** starting with the pattern's literal prefix are found in a sorted view of the column:
+** GLOB compares bytes, while LIKE ignores the case of ASCII letters and so uses a view
+** sorted that way. A pattern with a prefix shorter than a trigram goes through the
+** column's trigram index instead, if it has one. SQLite still matches the whole
+** pattern. This assumes the built-in like() and glob(), with their ASCII-only case
+** folding. Returns SQLITE_DONE if the pattern narrows nothing down.
+*/
+static int fdbFilterPattern(fdb_cursor *pCur, uint32_t j, int op, sqlite3_value* pattern) {
+	TableInfo* table = pCur->table;
+	bool glob = op == SQLITE_INDEX_CONSTRAINT_GLOB;
+	const char* text = sqlite3_value_type(pattern) == SQLITE_TEXT ? (const char*) sqlite3_value_text(pattern) : NULL;
+	if (text == NULL) {
+		return SQLITE_DONE;
+	}
+	size_t n = fdb_pattern_prefix(text, op);
+	FdbTrigrams* trigrams = n < 3 ? fdb_table_trigrams(table, j, false) : NULL;
+	if (trigrams != NULL) {
+		uint32_t nrows = 0;
+		int rc = fdb_trigrams_search(table, trigrams, text, op, &pCur->keyRows, &nrows);
+		fdb_trigrams_release(trigrams);
+		if (rc != SQLITE_DONE) {
+			pCur->order = pCur->keyRows;
+			pCur->rowIndex = 0;
+			pCur->rowStop = nrows;
+			return rc;
+		}
+	}
+	if (n == 0) {
+		return SQLITE_DONE;
+	}
+	pCur->sorted = glob ? fdb_table_sorted(table, j) : fdb_table_sorted_nocase(table, j);
+	if (pCur->sorted == NULL) {
+		return SQLITE_NOMEM;
+	}
+	fdb_sorted_prefix(table, pCur->sorted, j, text, n, !glob, &pCur->rowIndex, &pCur->rowStop);
+	pCur->order = pCur->sorted->rows;
+	if (pCur->sorted->first > 0 && !fdb_column_typed(table, j)) {
+		// values of other types sort before the text, their text form may still match
+		pCur->nextIndex = 0;
+		pCur->nextStop = pCur->sorted->first;
+	}
+	return SQLITE_OK;
+}
+
+/*
+** Find the rows to scan for the bounds on a text key. An equal key is looked up in its
+** bucket, other bounds in the sorted view of the keys, which also serves scans in key
+** order.
+*/
+static int fdbFilterTextKey(fdb_cursor *pCur, int idxNum) {
+	TableInfo* table = pCur->table;
+	uint32_t nbuckets = table->hash_table->nbuckets;
+	bool bounded = false;
+	for (uint32_t p = 0; p < pCur->npreds; p++) {
+		FdbPredicate* pred = &pCur->preds[p];
+		if (pred->column != 0) {
+			continue;
+		}
+		if (pred->op == FDB_PRED_NONE) {
+			// the cursor is left at EOF
+			return SQLITE_OK;
+		}
+		if (pred->op == FDB_PRED_EQ && nbuckets > 0) {
+			uint32_t bucket = fdb_sfhash(pred->text, pred->ntext) & (nbuckets - 1);
+			pCur->rowIndex = table->bucket_starts[bucket];
+			pCur->rowStop = table->bucket_starts[bucket + 1];
+			return SQLITE_OK;
+		}
+		bounded = bounded || (pred->op >= FDB_PRED_LT && pred->op <= FDB_PRED_GE);
+	}
+	if (bounded || idxNum != 0) {
+		return fdbFilterSorted(pCur, idxNum == FDB_ORDER_DESC);
+	}
+	pCur->rowStop = table->nrows;
+	return SQLITE_OK;
+}
+
+static int fdbCompareBuckets(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*) a;
+	uint32_t y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
+
+/*
+** Collect the rows of the buckets the keys of an IN list map to, each bucket once and
+** in the order of the bucket array, so the cursor visits them like one run. Reading a
+** row's values takes a chain of dependent loads into the image; the rows some buckets
+** ahead are prefetched while the list is built, so those loads overlap instead of
+** stalling one after another.
+*/
+static int fdbFilterKeyList(fdb_cursor *pCur, const FdbPredicate* pred) {
+	const uint32_t distance = 8;
+	TableInfo* table = pCur->table;
+	uint32_t nbuckets = table->hash_table->nbuckets;
+	if (nbuckets == 0) {
+		return SQLITE_OK;
+	}
+	uint32_t* buckets = sqlite3_malloc64((uint64_t) pred->nlist * sizeof(uint32_t));
+	if (buckets == NULL) {
+		return SQLITE_NOMEM;
+	}
+	for (uint32_t k = 0; k < pred->nlist; k++) {
+		if (pred->kind == FDB_KIND_TEXT) {
+			buckets[k] = fdb_sfhash(pred->texts[k], strlen(pred->texts[k])) & (nbuckets - 1);
+		} else {
+			buckets[k] = (uint64_t) pred->ints[k] & (nbuckets - 1);
+		}
+	}
+	qsort(buckets, pred->nlist, sizeof(uint32_t), fdbCompareBuckets);
+	uint32_t nbucketsUsed = 0;
+	uint64_t nrows = 0;
+	for (uint32_t k = 0; k < pred->nlist; k++) {
+		if (nbucketsUsed == 0 || buckets[nbucketsUsed - 1] != buckets[k]) {
+			buckets[nbucketsUsed++] = buckets[k];
+			nrows += table->bucket_starts[buckets[k] + 1] - table->bucket_starts[buckets[k]];
+		}
+	}
+
+	pCur->keyRows = sqlite3_malloc64((nrows > 0 ? nrows : 1) * sizeof(uint32_t));
+	if (pCur->keyRows == NULL) {
+		sqlite3_free(buckets);
+		return SQLITE_NOMEM;
+	}
+	uint32_t n = 0;
+	for (uint32_t k = 0; k < nbucketsUsed; k++) {
+		// with compact columns (see fdb_columnar.c) the rows themselves aren't read
+		if (!pCur->compact && k + 2 * distance < nbucketsUsed) {
+			fdb_prefetch(&table->rows[table->bucket_starts[buckets[k + 2 * distance]]]);
+		}
+		if (!pCur->compact && k + distance < nbucketsUsed) {
+			uint32_t ahead = table->bucket_starts[buckets[k + distance]];
+			if (ahead < table->bucket_starts[buckets[k + distance] + 1]) {
+				fdb_prefetch(table->rows[ahead]);
+				fdb_prefetch(row_values(table->image, table->rows[ahead]));
+			}
+		}
+		for (uint32_t r = table->bucket_starts[buckets[k]]; r < table->bucket_starts[buckets[k] + 1]; r++) {
+			pCur->keyRows[n++] = r;
+		}
+	}
+	sqlite3_free(buckets);
+	pCur->order = pCur->keyRows;
+	pCur->rowIndex = 0;
+	pCur->rowStop = n;
+	return SQLITE_OK;
+}
+
+/*
+** Position the cursor on the first row matching the plan, see fdbFilter(). The OFFSET
+** of the query, if the plan has one, is returned in *offset to be skipped after.
+*/
+static int fdbFilterRows(
 	sqlite3_vtab_cursor *pVtabCursor,
 	int idxNum, const char *idxStr,
-	int argc, sqlite3_value **argv
+	int argc, sqlite3_value **argv,
+	int64_t* offset
 ){
 	fdb_cursor *pCur = (fdb_cursor *)pVtabCursor;
+	TableInfo* table = pCur->table;
+	Column* columns = desc_columns(table->image, table->desc);
 
-	//printf("%s Filter! idxNum: %i, idxStr: %s, argc: %i\n", pCur->table->desc->name, idxNum, idxStr, argc);
+	//printf("Filter! idxNum: %i, idxStr: %s, argc: %i\n", idxNum, idxStr, argc);
 
-	for (int32_t i = 0; i < argc; i++) {
-		char op = idxStr[i];
-		if (op == SQLITE_INDEX_CONSTRAINT_LT) {
-			//printf("<");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_LE) {
-			//printf("<=");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_EQ) {
-			//printf("=");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_GE) {
-			//printf(">=");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_GT) {
-			//printf(">");
-		} else {
-			//printf("UNKNOWN OP");
+	fdb_predicates_free(pCur->preds, pCur->npreds);
+	pCur->preds = NULL;
+	pCur->npreds = 0;
+	fdb_index_release(pCur->index);
+	fdb_sorted_release(pCur->sorted);
+	pCur->index = NULL;
+	pCur->sorted = NULL;
+	sqlite3_free(pCur->keyRows);
+	pCur->keyRows = NULL;
+	pCur->order = NULL;
+	pCur->limit = -1;
+	if (argc > 0) {
+		pCur->preds = sqlite3_malloc(argc * sizeof(FdbPredicate));
+		if (pCur->preds == NULL) {
+			return SQLITE_NOMEM;
 		}
-		//printf(" ");
-		print_sqlite3_value(argv[i]);
-		//printf("\n");
 	}
 
 	// find min and max of the range to consider
 
 	int64_t min = INT64_MIN;
 	int64_t max = INT64_MAX;
+	bool keyed = false;
+	FdbPredicate* keyList = NULL;
+	int64_t rowMin = 0;  /* Rows [rowMin, rowMax) the bounds on the rowid allow */
+	int64_t rowMax = table->nrows;
+	bool rowids = false;  /* The rows are found by rowid */
+	uint32_t nrowList = 0;  /* Rows of an IN list of rowids in keyRows, if set */
+	sqlite3_value* pattern = NULL;  /* A LIKE or GLOB pattern on patternColumn */
+	uint32_t patternColumn = 0;
+	int patternOp = 0;
+	bool keyOrder = idxNum == FDB_ORDER_ASC || idxNum == FDB_ORDER_DESC;
+	bool textKey = table->desc->ncolumns > 0 && fdb_column_kind(columns[0].data_type) == FDB_KIND_TEXT;
 
+	const char* plan = idxStr;
 	for (int32_t i = 0; i < argc; i++) {
-		char op = idxStr[i];
-		long long value = sqlite3_value_int64(argv[i]);
-		switch (op) {
-			case SQLITE_INDEX_CONSTRAINT_GT:
-				if (min < value+1) {
-					min = value+1;
-				}
-				break;
-			case SQLITE_INDEX_CONSTRAINT_GE:
-				if (min < value) {
-					min = value;
+		char kind;
+		uint32_t column;
+		int op;
+		if (!fdbPlanNext(&plan, &kind, &column, &op) || (column >= table->desc->ncolumns && kind != 'r' && kind != 'j')) {
+			return SQLITE_ERROR;
+		}
+		//printf("%c column %u op %i ", kind, column, op);
+		print_sqlite3_value(argv[i]);
+		//printf("\n");
+		if (kind == 'r' || kind == 'j') {
+			// rowids are integers, and none is NULL
+			FdbPredicate pred;
+			if (kind == 'j') {
+				int rc = fdb_predicate_init_in(&pred, 0, FDB_I64, true, argv[i]);
+				if (rc != SQLITE_OK) {
+					sqlite3_free(pred.ints);
+					return rc;
 				}
-				break;
-			case SQLITE_INDEX_CONSTRAINT_EQ:
-				min = value;
-				max = value+1;
-				break;
-			case SQLITE_INDEX_CONSTRAINT_LE:
-				if (max > value+1) {
-					max = value+1;
+			} else if (!fdb_predicate_init(&pred, 0, FDB_I64, op, argv[i])) {
+				return SQLITE_NOMEM;
+			}
+			if (kind == 'r') {
+				fdb_predicate_typed(&pred, op, argv[i], true);
+				fdbNarrowRange(&pred, &rowMin, &rowMax);
+			} else if (pred.op == FDB_PRED_NONE) {
+				rowMax = rowMin;
+			} else if (pred.op == FDB_PRED_IN && pCur->keyRows == NULL) {
+				pCur->keyRows = sqlite3_malloc64((uint64_t) pred.nlist * sizeof(uint32_t) + 1);
+				for (uint32_t k = 0; pCur->keyRows != NULL && k < pred.nlist; k++) {
+					if (pred.ints[k] >= 0 && pred.ints[k] < table->nrows) {
+						pCur->keyRows[nrowList++] = (uint32_t) pred.ints[k];
+					}
 				}
-				break;
-			case SQLITE_INDEX_CONSTRAINT_LT:
-				if (max > value) {
-					max = value;
+			}
+			sqlite3_free(pred.ints);
+			if (kind == 'j' && pred.op == FDB_PRED_IN && pCur->keyRows == NULL) {
+				return SQLITE_NOMEM;
+			}
+			rowids = true;
+			continue;
+		}
+		if (kind == 'x') {
+			pattern = argv[i];
+			patternColumn = column;
+			patternOp = op;
+			continue;
+		}
+		if (kind == 'l') {
+			pCur->limit = sqlite3_value_int64(argv[i]);
+			continue;
+		}
+		if (kind == 'o') {
+			*offset = sqlite3_value_int64(argv[i]);
+			continue;
+		}
+		if (kind == 'i') {
+			// the whole IN list, argv[i] only gives access to its values
+			int rc = fdb_predicate_init_in(&pCur->preds[pCur->npreds], column, columns[column].data_type, fdb_column_typed(table, column), argv[i]);
+			keyList = &pCur->preds[pCur->npreds];
+			// counted even on errors, so the values read so far are freed with the cursor
+			pCur->npreds += 1;
+			if (rc != SQLITE_OK) {
+				return rc;
+			}
+			keyed = true;
+			continue;
+		}
+		FdbPredicate* pred = &pCur->preds[pCur->npreds];
+		if (!fdb_predicate_init(pred, column, columns[column].data_type, op, argv[i])) {
+			return SQLITE_NOMEM;
+		}
+		if (pred->op == FDB_PRED_ALL || pred->op == FDB_PRED_NONE) {
+			fdb_predicate_typed(pred, op, argv[i], fdb_column_typed(table, column));
+		}
+		pCur->npreds += 1;
+		if (kind != 'k') {
+			continue;
+		}
+
+		keyed = true;
+		if (pred->kind != FDB_KIND_INT) {
+			// bounds on text keys are applied from their predicates, see fdbFilterTextKey()
+			continue;
+		}
+		fdbNarrowRange(pred, &min, &max);
+	}
+
+	uint64_t used = UINT64_MAX;
+	if (plan != NULL && *plan == 'u') {
+		used = strtoull(plan + 1, NULL, 10);
+	}
+
+	pCur->rowIndex = pCur->rowStop = 0;
+	pCur->nextIndex = pCur->nextStop = 0;
+	if (!keyed && ((fdb_vtab*)pVtabCursor->pVtab)->fdb->columnar) {
+		// a full scan, worth building the columnar copy for
+		pCur->columnar = fdb_table_columnar(table);
+	} else if (fdb_atomic_load(&table->columnar_ready)) {
+		pCur->columnar = table->columnar;
+	} else if (used != 0 && used >> 63 == 0 && fdb_popcount64(used) <= FDB_NARROW_COLUMNS) {
+		// a narrow query, only copies of the columns it reads are needed; they are
+		// made for scans, other queries read few rows and only use existing ones
+		pCur->columnar = fdb_table_columns(table, used, fdbScansAll(pCur, keyed || rowids, idxNum, pattern, patternColumn, patternOp));
+	} else {
+		pCur->columnar = NULL;
+	}
+	pCur->compact = pCur->columnar != NULL;
+	for (uint32_t j = 0; j < table->desc->ncolumns && pCur->compact; j++) {
+		pCur->compact = !(used & fdb_column_bit(j)) || pCur->columnar[j].values != NULL;
+	}
+
+	if (rowids) {
+		// rowids are positions in table->rows, the rows are read directly
+		rowMin = rowMin > 0 ? rowMin : 0;
+		rowMax = rowMax < table->nrows ? rowMax : table->nrows;
+		if (pCur->keyRows != NULL) {
+			// the list is sorted, keep the rows within the bounds
+			uint32_t n = 0;
+			for (uint32_t k = 0; k < nrowList; k++) {
+				if (pCur->keyRows[k] >= rowMin && pCur->keyRows[k] < rowMax) {
+					pCur->keyRows[n++] = pCur->keyRows[k];
 				}
-				break;
-			default:
-				//printf("OPERATOR %i NOT HANDLED\n", op);
-				return SQLITE_ERROR;
+			}
+			pCur->order = pCur->keyRows;
+			pCur->rowStop = n;
+		} else if (rowMin < rowMax) {
+			pCur->rowIndex = (uint32_t) rowMin;
+			pCur->rowStop = (uint32_t) rowMax;
+		}
+		if (pCur->npreds > 0) {
+			fdbNextBatch(pCur, pCur->rowIndex);
 		}
+		return SQLITE_OK;
 	}
 
-	// nonsensical range
-	if (max < min) {
-		// this forces EOF to immediately return true
-		max = min;
+	if (!keyed && idxNum == 0) {
+		// instead of scanning, visit the rows of the smallest matching slot of a secondary index
+		for (uint32_t p = 0; p < pCur->npreds; p++) {
+			if (pCur->preds[p].op != FDB_PRED_EQ) {
+				continue;
+			}
+			FdbIndex* index = fdb_table_index(table, pCur->preds[p].column, false);
+			if (index == NULL) {
+				continue;
+			}
+			uint32_t start, stop;
+			fdb_index_lookup(index, &pCur->preds[p], &start, &stop);
+			if (pCur->index != NULL && stop - start >= pCur->rowStop - pCur->rowIndex) {
+				fdb_index_release(index);
+				continue;
+			}
+			fdb_index_release(pCur->index);
+			pCur->index = index;
+			pCur->order = index->rows;
+			pCur->rowIndex = start;
+			pCur->rowStop = stop;
+		}
+		if (pCur->index != NULL) {
+			fdbNextBatch(pCur, pCur->rowIndex);
+			return SQLITE_OK;
+		}
+	}
+
+	if (!keyed && idxNum == 0 && pattern != NULL) {
+		int rc = fdbFilterPattern(pCur, patternColumn, patternOp, pattern);
+		if (rc != SQLITE_DONE) {
+			if (rc == SQLITE_OK) {
+				fdbNextBatch(pCur, pCur->rowIndex);
+			}
+			return rc;
+		}
+	}
+
+	if (keyList != NULL && keyList->op != FDB_PRED_ALL) {
+		// other bounds on the key are tested as predicates on the list's rows
+		if (keyList->op == FDB_PRED_IN) {
+			int rc = fdbFilterKeyList(pCur, keyList);
+			if (rc != SQLITE_OK) {
+				return rc;
+			}
+			fdbNextBatch(pCur, pCur->rowIndex);
+		}
+		return SQLITE_OK;
+	}
+
+	if ((keyed || keyOrder) && textKey) {
+		int rc = fdbFilterTextKey(pCur, idxNum);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+		fdbNextBatch(pCur, pCur->rowIndex);
 		return SQLITE_OK;
 	}
 
-	uint32_t nbuckets = pCur->table->hash_table->nbuckets;
-	uint64_t span = max - min;
-	//printf("filter arrived at a range of [%lli, %lli), max - min: %lli, max - min < nbuckets %i\n", min, max, span, span < nbuckets);
+	// an open upper bound takes in INT64_MAX itself, which [min, max) leaves out
+	uint64_t span = (uint64_t) max - (uint64_t) min;
+	if (max == INT64_MAX && span < UINT64_MAX) {
+		span++;
+	}
+	//printf("filter arrived at a range of [%lli, %lli), max - min: %lli\n", min, max, span);
+
+	// keys of other types lie outside any integer range, but may still match it: text
+	// is greater than every integer, a real may lie between two of them. Only the
+	// sorted view finds those, so anything but a single key below INT64_MAX goes
+	// there, even a range no integer can be in.
+	bool bounded = min != INT64_MIN || max != INT64_MAX;
+	bool untyped = bounded && (max < min || max == INT64_MAX || span != 1) && !fdb_column_typed(table, 0);
+
+	// nonsensical range
+	if (max < min && !untyped) {
+		// the cursor is left at EOF
+		return SQLITE_OK;
+	}
 
-	if (span < nbuckets) {
+	uint32_t nbuckets = table->hash_table->nbuckets;
+	if ((keyOrder && span > 1) || (bounded && span >= nbuckets) || untyped) {
+		// rows in key order, or a range too wide for the buckets to narrow down: find
+		// the range in the sorted view of the keys instead of scanning everything
+		int rc = fdbFilterSorted(pCur, idxNum == FDB_ORDER_DESC);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+	} else if (span < nbuckets) {
 		// min and max are close enough not to span the entire table
-		// so only fetch that range
+		// so only fetch the rows of the buckets they map to
 		//printf("partial table span!\n");
-		pCur->bucketIndex = min,
-		pCur->stopIndex = max;
+		uint32_t first = (uint64_t) min & (nbuckets - 1);
+		uint64_t end = first + span;
+		pCur->rowIndex = table->bucket_starts[first];
+		if (end <= nbuckets) {
+			pCur->rowStop = table->bucket_starts[end];
+		} else {
+			// the range wraps around, continue at the start of the bucket array
+			pCur->rowStop = table->nrows;
+			pCur->nextIndex = 0;
+			pCur->nextStop = table->bucket_starts[end - nbuckets];
+		}
 	} else {
 		// min and max are apart far enough
 		// that we will be traversing the entire table anyway
 		// so no filtering necessary
 		//printf("whole table span!\n");
-		pCur->bucketIndex = 0;
-		pCur->stopIndex = nbuckets;
+		pCur->rowStop = table->nrows;
 	}
 
-	//printf("filter set bucketIndex, stopIndex to [%lli, %lli)\n", pCur->bucketIndex, pCur->stopIndex);
+	//printf("filter set rowIndex, rowStop to [%u, %u)\n", pCur->rowIndex, pCur->rowStop);
+	if (pCur->npreds > 0) {
+		fdbNextBatch(pCur, pCur->rowIndex);
+	} else {
+		fdbNextRun(pCur);
+	}
+	return SQLITE_OK;
+}
 
-	// step back by one to counter the call to fdbNext()
-	pCur->bucketIndex -= 1;
-	pCur->curBucket = NULL;
-	// fast forward the cursor to the first valid bucket
-	return fdbNext(pVtabCursor);
+/*
+** This method is called to "rewind" the fdb_cursor object back
+** to the first row of output.	This method is always called at least
+** once prior to any call to fdbColumn() or fdbRowid() or
+** fdbEof().
+*/
+static int fdbFilter(
+	sqlite3_vtab_cursor *pVtabCursor,
+	int idxNum, const char *idxStr,
+	int argc, sqlite3_value **argv
+){
+	fdb_cursor *pCur = (fdb_cursor*) pVtabCursor;
+	if (!pCur->used) {
+		// the rows stay where they are until the cursor is closed
+		fdb_vtab *pVtab = (fdb_vtab*) pVtabCursor->pVtab;
+		char* zErr = fdb_table_use(pVtab->fdb, pCur->table);
+		if (zErr != NULL) {
+			sqlite3_free(pVtab->base.zErrMsg);
+			pVtab->base.zErrMsg = zErr;
+			return SQLITE_ERROR;
+		}
+		pCur->used = true;
+	}
+	int64_t offset = 0;
+	int rc = fdbFilterRows(pVtabCursor, idxNum, idxStr, argc, argv, &offset);
+	if (rc == SQLITE_OK && offset > 0) {
+		fdbSkip(pCur, offset);
+	}
+	return rc;
 }
 
 /*
-** SQLite will invoke this method one or more times while planning a query
-** that uses the virtual table.	This routine needs to create
-** a query plan for each invocation and compute an estimated cost for that
-** plan.
+** Create the plan and estimate its cost for fdbBestIndex(), the table is in use.
 */
-static int fdbBestIndex(
-	sqlite3_vtab* tab,
+static int fdbPlan(
+	fdb_vtab *pVtab,
 	sqlite3_index_info* pIdxInfo
 ){
-	fdb_vtab *pVtab = (fdb_vtab*)tab;
+	TableInfo* table = pVtab->table;
 
-	//printf("%s BestIndex! nConstraint %i\n", pVtab->table->desc->name, pIdxInfo->nConstraint);
+	//printf("%s BestIndex! nConstraint %i\n", table->name, pIdxInfo->nConstraint);
 
+	const uint8_t* types = pVtab->types;
 	uint32_t curIndex = 0;
+	uint32_t nkeys = 0;
+	uint32_t lookup = 0;  /* Rows read by the best secondary index lookup, 0 for none */
+	bool lists = false;
+	double selectivity = 1;  /* Fraction of the rows the constraints not on the key let through */
+	bool keyEq = false;  /* The key is looked up by equality, see keyValue */
+	bool keyList = false;
+	bool keyExact = false;
+	sqlite3_value* keyValue = NULL;  /* Known constant of the lookup */
+	int64_t keyLo = INT64_MIN;  /* Known bounds on an integer key */
+	int64_t keyHi = INT64_MAX;
+	uint32_t bounds = 0;  /* Bounds on the key */
+	uint32_t guesses = 0;  /* Bounds on the key with a constant not known */
+	bool rowids = false;  /* Rows are found by rowid, see rowEq and the bounds */
+	bool rowEq = false;
+	bool rowList = false;
+	int64_t rowLo = 0;  /* Known bounds on the rowid */
+	int64_t rowHi = (int64_t) table->nrows - 1;
+	uint32_t rowGuesses = 0;
+	bool patterned = false;  /* A LIKE or GLOB pattern can narrow the rows down */
+	double patternFraction = 1;  /* Fraction of the rows the pattern leaves */
+	bool omitted = true;  /* SQLite checks no constraint itself */
+	sqlite3_str* plan = sqlite3_str_new(NULL);
 
 	for (int32_t i = 0; i < pIdxInfo->nConstraint; i++) {
 		struct sqlite3_index_constraint cons = pIdxInfo->aConstraint[i];
-		sqlite3_value* value;
+		sqlite3_value* value = NULL;
 		sqlite3_vtab_rhs_value(pIdxInfo, i, &value);
-		//printf("\tis_usable %i: [column %i] ", cons.usable, cons.iColumn);
-
-		uint32_t op =  cons.op;
-		if (op == SQLITE_INDEX_CONSTRAINT_LT) {
-			//printf("<");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_LE) {
-			//printf("<=");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_EQ) {
-			//printf("=");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_GE) {
-			//printf(">=");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_GT) {
-			//printf(">");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_ISNULL) {
-			//printf("IS NULL\n");
-		} else if (op == SQLITE_INDEX_CONSTRAINT_ISNOTNULL) {
-			//printf("IS NOT NULL\n");
-		} else {
-			//printf("UNKNOWN OP %i\n", op);
-		}
+		//printf("\tis_usable %i: [column %i] op %i ", cons.usable, cons.iColumn, cons.op);
 		print_sqlite3_value(value);
 		//printf("\n");
 
-		if (cons.usable && cons.iColumn == 0 && (
-			// TODO: support string indexes sometime
-			   pVtab->table->desc->columns[0].data_type != FDB_NVARCHAR
-			&& pVtab->table->desc->columns[0].data_type != FDB_TEXT
-		) && (
+		if (cons.op == SQLITE_INDEX_CONSTRAINT_LIMIT || cons.op == SQLITE_INDEX_CONSTRAINT_OFFSET) {
+			continue;
+		}
+		uint32_t op = cons.op;
+		if (cons.usable && cons.iColumn < 0 && (
 			   op == SQLITE_INDEX_CONSTRAINT_LT
 			|| op == SQLITE_INDEX_CONSTRAINT_LE
 			|| op == SQLITE_INDEX_CONSTRAINT_EQ
 			|| op == SQLITE_INDEX_CONSTRAINT_GE
 			|| op == SQLITE_INDEX_CONSTRAINT_GT
 		)) {
+			// rowids are positions in table->rows, the cursor goes to those rows directly;
+			// a second IN list on the rowid is passed a value at a time
+			bool list = op == SQLITE_INDEX_CONSTRAINT_EQ && !rowList && sqlite3_vtab_in(pIdxInfo, i, -1);
+			if (list) {
+				sqlite3_vtab_in(pIdxInfo, i, 1);
+				rowList = true;
+			} else if (op == SQLITE_INDEX_CONSTRAINT_EQ) {
+				rowEq = true;
+			} else {
+				rowGuesses += !fdb_cost_bound(op, value, &rowLo, &rowHi);
+			}
+			rowids = true;
 			curIndex += 1;
 			pIdxInfo->aConstraintUsage[i].argvIndex = curIndex;
+			pIdxInfo->aConstraintUsage[i].omit = true;
+			sqlite3_str_appendf(plan, "%c0:%u;", list ? 'j' : 'r', op);
+			continue;
+		}
+		if (cons.usable && cons.iColumn >= 0 && !patterned
+			&& (op == SQLITE_INDEX_CONSTRAINT_LIKE || op == SQLITE_INDEX_CONSTRAINT_GLOB)
+			&& fdb_column_kind(types[cons.iColumn]) == FDB_KIND_TEXT) {
+			// the pattern's prefix or trigrams pick the rows to read, SQLite matches the rest of it
+			patterned = true;
+			patternFraction = fdb_cost_pattern(table, cons.iColumn, value, op);
+			selectivity *= patternFraction;
+			curIndex += 1;
+			pIdxInfo->aConstraintUsage[i].argvIndex = curIndex;
+			sqlite3_str_appendf(plan, "x%i:%u;", cons.iColumn, op);
+		}
+		if (!cons.usable || cons.iColumn < 0 || !fdb_predicate_op(cons.op)) {
+			omitted = false;
+			continue;
+		}
+		uint32_t data_type = types[cons.iColumn];
+		bool text = data_type == FDB_NVARCHAR || data_type == FDB_TEXT;
+		if (text && sqlite3_stricmp(sqlite3_vtab_collation(pIdxInfo, i), "BINARY") != 0) {
+			// other collations are left to SQLite
+			omitted = false;
+			continue;
 		}
-	}
 
-	if (curIndex == 0) {
-		pIdxInfo->estimatedCost = (double) pVtab->table->hash_table->nbuckets;
-	} else {
-		pIdxInfo->estimatedCost = (double) 1;
-		pIdxInfo->idxStr = sqlite3_malloc(curIndex);
-		pIdxInfo->needToFreeIdxStr = true;
-
-		for (int32_t i = 0; i < pIdxInfo->nConstraint; i++) {
-			uint32_t argvIndex = pIdxInfo->aConstraintUsage[i].argvIndex;
-			if (argvIndex != 0) {
-				pIdxInfo->idxStr[argvIndex-1] = pIdxInfo->aConstraint[i].op;
+		bool key = cons.iColumn == 0 && (
+			   op == SQLITE_INDEX_CONSTRAINT_LT
+			|| op == SQLITE_INDEX_CONSTRAINT_LE
+			|| op == SQLITE_INDEX_CONSTRAINT_EQ
+			|| op == SQLITE_INDEX_CONSTRAINT_GE
+			|| op == SQLITE_INDEX_CONSTRAINT_GT
+		);
+		if (!key && op == SQLITE_INDEX_CONSTRAINT_EQ) {
+			uint32_t rows = fdb_index_rows_per_key(table, cons.iColumn);
+			if (rows > 0 && (lookup == 0 || rows < lookup)) {
+				lookup = rows;
+			}
+		}
+		// an IN list on the key is handed to fdbFilter() whole, instead of a call per value
+		bool list = key && op == SQLITE_INDEX_CONSTRAINT_EQ && sqlite3_vtab_in(pIdxInfo, i, -1);
+		if (list) {
+			sqlite3_vtab_in(pIdxInfo, i, 1);
+			lists = true;
+		}
+		// SQLite leaves the constraint to the cursor if its predicate decides every row
+		// like SQLite would, see fdb_predicate_exact(); an IN list does on integer keys
+		bool exact = list
+			? fdb_column_typed(table, 0) && fdb_column_kind(data_type) == FDB_KIND_INT
+			: fdb_predicate_exact(table, cons.iColumn, op, value);
+		if (key && op == SQLITE_INDEX_CONSTRAINT_EQ) {
+			if (!keyEq) {
+				keyEq = true;
+				keyList = list;
+				keyExact = exact;
+				keyValue = list ? NULL : value;
 			}
+		} else if (key) {
+			bounds += 1;
+			guesses += fdb_column_kind(data_type) != FDB_KIND_INT || !fdb_cost_bound(op, value, &keyLo, &keyHi);
+		} else {
+			selectivity *= fdb_cost_selectivity(table, cons.iColumn, op);
+		}
+		nkeys += key;
+		curIndex += 1;
+		pIdxInfo->aConstraintUsage[i].argvIndex = curIndex;
+		pIdxInfo->aConstraintUsage[i].omit = exact;
+		omitted = omitted && exact;
+		sqlite3_str_appendf(plan, "%c%i:%u;", list ? 'i' : key ? 'k' : 'p', cons.iColumn, op);
+	}
+
+	// the sorted view of the key returns rows in the order SQLite sorts them in (NULLs
+	// first), if the key column holds nothing but values of its type
+	if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == 0 && !lists && !rowids
+		&& fdb_column_kind(types[0]) != FDB_KIND_REAL && fdb_column_typed(table, 0)) {
+		pIdxInfo->orderByConsumed = true;
+		pIdxInfo->idxNum = pIdxInfo->aOrderBy[0].desc ? FDB_ORDER_DESC : FDB_ORDER_ASC;
+	}
+	// scans and rowid lookups return rows in ascending rowid order, unless the key
+	// narrows the scan down to buckets
+	if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn < 0 && !pIdxInfo->aOrderBy[0].desc && (rowids || nkeys == 0)) {
+		pIdxInfo->orderByConsumed = true;
+		pIdxInfo->idxNum = FDB_ORDER_ROWID;
+	}
+	// the cursor's rows are the query's, in its order, so it can count them for LIMIT
+	// and skip the OFFSET itself, without reading the rows in between
+	for (int32_t i = 0; i < pIdxInfo->nConstraint && omitted && (pIdxInfo->nOrderBy == 0 || pIdxInfo->orderByConsumed); i++) {
+		struct sqlite3_index_constraint cons = pIdxInfo->aConstraint[i];
+		if (!cons.usable || (cons.op != SQLITE_INDEX_CONSTRAINT_LIMIT && cons.op != SQLITE_INDEX_CONSTRAINT_OFFSET)) {
+			continue;
+		}
+		curIndex += 1;
+		pIdxInfo->aConstraintUsage[i].argvIndex = curIndex;
+		pIdxInfo->aConstraintUsage[i].omit = cons.op == SQLITE_INDEX_CONSTRAINT_OFFSET;
+		sqlite3_str_appendf(plan, "%c0:%u;", cons.op == SQLITE_INDEX_CONSTRAINT_LIMIT ? 'l' : 'o', cons.op);
+	}
+	// the columns read tell the cursor whether copies of a few columns serve the query
+	sqlite3_str_appendf(plan, "u%llu;", (unsigned long long) pIdxInfo->colUsed);
+
+	char* zPlan = sqlite3_str_finish(plan);
+	if (zPlan == NULL) {
+		return SQLITE_NOMEM;
+	}
+	// costs are the rows read, see fdb_cost.c
+	double rows = table->nrows;
+	double read = table->nrows;
+	if (rowids) {
+		// the rows are read directly, the key is tested like other columns
+		if (rowEq) {
+			rows = 1;
+			pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+		} else if (rowList) {
+			rows = FDB_COST_IN_LIST;
+		} else {
+			rows = rowLo <= rowHi ? (double) rowHi - (double) rowLo + 1 : 0;
+		}
+		for (uint32_t i = 0; i < rowGuesses; i++) {
+			rows *= fdb_cost_selectivity(table, 0, SQLITE_INDEX_CONSTRAINT_LT);
+		}
+		read = rows;
+	} else if (keyEq) {
+		fdb_cost_key_eq(table, keyValue, &rows, &read);
+		if (keyList) {
+			rows *= FDB_COST_IN_LIST;
+			read *= FDB_COST_IN_LIST;
+		} else if (keyExact && fdb_column_stats(table, 0).unique) {
+			pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+		}
+	} else if (bounds > 0) {
+		double fraction = guesses < bounds ? fdb_cost_key_range(table, keyLo, keyHi) : 1;
+		for (uint32_t i = 0; i < guesses; i++) {
+			fraction *= fdb_cost_selectivity(table, 0, SQLITE_INDEX_CONSTRAINT_LT);
+		}
+		rows = fraction * table->nrows;
+		uint32_t nbuckets = table->hash_table->nbuckets;
+		if (guesses == 0 && keyLo <= keyHi && (uint64_t) keyHi - (uint64_t) keyLo < nbuckets && pIdxInfo->idxNum == 0) {
+			// the buckets the range maps to are read
+			read = ((double) keyHi - (double) keyLo + 1) * table->nrows / nbuckets;
+		} else {
+			read = fdb_cost_search(table) + rows;
+		}
+	} else if (lookup > 0 && pIdxInfo->idxNum == 0) {
+		// the rows returned are estimated from the column's statistics with the others
+		read = 1 + lookup;
+	} else if (patterned && patternFraction < 1 && pIdxInfo->idxNum == 0) {
+		read = fdb_cost_search(table) + patternFraction * table->nrows;
+	}
+	rows *= selectivity;
+	pIdxInfo->estimatedCost = read > 1 ? read : 1;
+	pIdxInfo->estimatedRows = rows > 1 ? (sqlite3_int64) rows : 1;
+	pIdxInfo->idxStr = zPlan;
+	pIdxInfo->needToFreeIdxStr = true;
+	return SQLITE_OK;
+}
+
+/*
+** SQLite will invoke this method one or more times while planning a query
+** that uses the virtual table.	This routine needs to create
+** a query plan for each invocation and compute an estimated cost for that
+** plan.
+*/
+static int fdbBestIndex(
+	sqlite3_vtab* tab,
+	sqlite3_index_info* pIdxInfo
+){
+	fdb_vtab *pVtab = (fdb_vtab*)tab;
+	// the costs come from the table's statistics, which are evicted with it
+	char* zErr = fdb_table_use(pVtab->fdb, pVtab->table);
+	if (zErr != NULL) {
+		sqlite3_free(tab->zErrMsg);
+		tab->zErrMsg = zErr;
+		return SQLITE_ERROR;
+	}
+	int rc = fdbPlan(pVtab, pIdxInfo);
+	fdb_table_unuse(pVtab->table);
+	return rc;
+}
+
+/*
+** Write the new column values of an UPDATE into a row.
+*/
+static int fdbUpdateValues(char* image, Value* values, int argc, sqlite3_value **argv) {
+	for (int32_t i = 2; i < argc; i++) {
+		if (sqlite3_value_nochange(argv[i])) {
+			continue;
+		}
+		//printf(" | column %i: ", i-2);
+		print_sqlite3_value(argv[i]);
+		uint32_t sqlite3_type = sqlite3_value_type(argv[i]);
+
+		switch (values[i-2].data_type) {
+			case FDB_I32: {
+				if (sqlite3_type != SQLITE_INTEGER) {
+					return SQLITE_CONSTRAINT_DATATYPE;
+				}
+				int64_t value = sqlite3_value_int64(argv[i]);
+				if (value < INT32_MIN || value > INT32_MAX) {
+					return SQLITE_RANGE;
+				}
+				values[i-2].value.i32 = (int32_t) value;
+				break; }
+
+			case FDB_U32: {
+				if (sqlite3_type != SQLITE_INTEGER) {
+					return SQLITE_CONSTRAINT_DATATYPE;
+				}
+				int64_t value = sqlite3_value_int64(argv[i]);
+				if (value < 0 || value > UINT32_MAX) {
+					return SQLITE_RANGE;
+				}
+				values[i-2].value.u32 = (uint32_t) value;
+				break; }
+
+			case FDB_REAL: {
+				if (sqlite3_type != SQLITE_FLOAT) {
+					return SQLITE_CONSTRAINT_DATATYPE;
+				}
+				double value = sqlite3_value_double(argv[i]);
+				values[i-2].value.real = (float) value;
+				break; }
+
+			case FDB_NVARCHAR:
+			case FDB_TEXT: {
+				if (sqlite3_type != SQLITE_TEXT) {
+					return SQLITE_CONSTRAINT_DATATYPE;
+				}
+				const char* value = (const char*) sqlite3_value_text(argv[i]);
+				char* text = value_text(image, &values[i-2]);
+				if (strlen(value) > strlen(text)) {
+					return SQLITE_TOOBIG;
+				}
+				strcpy(text, value);
+				break; }
+
+			case FDB_BOOLEAN: {
+				if (sqlite3_type != SQLITE_INTEGER) {
+					return SQLITE_CONSTRAINT_DATATYPE;
+				}
+				int64_t value = sqlite3_value_int64(argv[i]);
+				if (value != 0 && value != 1) {
+					return SQLITE_RANGE;
+				}
+				values[i-2].value.boolean = (bool) value;
+				break; }
+
+			case FDB_I64: {
+				if (sqlite3_type != SQLITE_INTEGER) {
+					return SQLITE_CONSTRAINT_DATATYPE;
+				}
+				int64_t value = sqlite3_value_int64(argv[i]);
+				*value_i64p(image, &values[i-2]) = value;
+				break; }
+
+			case FDB_U64: {
+				if (sqlite3_type != SQLITE_INTEGER) {
+					return SQLITE_CONSTRAINT_DATATYPE;
+				}
+				int64_t value = sqlite3_value_int64(argv[i]);
+				*value_u64p(image, &values[i-2]) = value;
+				break; }
+
+			default:
+				//printf("Unexpected FDB data type");
 		}
-		pIdxInfo->idxStr[curIndex] = 0; // terminator
 	}
 	return SQLITE_OK;
 }
@@ -491,100 +1516,36 @@ int fdbUpdate(
 	if (argc > 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
 		// UPDATE
 		int64_t rowid = sqlite3_value_int64(argv[0]);
-		if (rowid > UINT32_MAX) return SQLITE_RANGE;
-		uint32_t nbuckets = pVtab->table->hash_table->nbuckets;
-		uint32_t bucketIndex = rowid & (nbuckets - 1);
-		uint32_t rowIndex = (uint32_t) rowid >> (ctz(nbuckets));
-		Bucket* bucket = pVtab->table->hash_table->buckets[bucketIndex];
-		for (uint32_t i = 0; i < rowIndex; i++) {
-			bucket = bucket->next;
-		}
-		Row* row = bucket->row;
-		//printf("got row %i\n", (uint32_t) row);
+		TableInfo* table = pVtab->table;
+		char* zErr = fdb_table_use(pVtab->fdb, table);
+		if (zErr != NULL) {
+			sqlite3_free(tab->zErrMsg);
+			tab->zErrMsg = zErr;
+			return SQLITE_ERROR;
+		}
+		char* image = table->image;
+		if (rowid < 0 || rowid >= table->nrows) {
+			fdb_table_unuse(table);
+			return SQLITE_RANGE;
+		}
+		// the rowid is the row's index, see fdbRowid()
+		uint32_t rowIndex = (uint32_t) rowid;
+		Row* row = table->rows[rowIndex];
+		Value* values = row_values(image, row);
+		//printf("got row %p\n", row);
+		int rc = fdbUpdateValues(image, values, argc, argv);
+		// keep the columnar copy in sync even if only some columns were written
+		fdb_columnar_update(table, rowIndex);
 		for (int32_t i = 2; i < argc; i++) {
-			if (sqlite3_value_nochange(argv[i])) {
-				continue;
-			}
-			//printf(" | %s: ", pVtab->table->desc->columns[i-2].name);
-			print_sqlite3_value(argv[i]);
-			uint32_t sqlite3_type = sqlite3_value_type(argv[i]);
-
-			switch (row->values[i-2].data_type) {
-				case FDB_I32: {
-					if (sqlite3_type != SQLITE_INTEGER) {
-						return SQLITE_CONSTRAINT_DATATYPE;
-					}
-					int64_t value = sqlite3_value_int64(argv[i]);
-					if (value < INT32_MIN || value > INT32_MAX) {
-						return SQLITE_RANGE;
-					}
-					row->values[i-2].value.i32 = (int32_t) value;
-					break; }
-
-				case FDB_U32: {
-					if (sqlite3_type != SQLITE_INTEGER) {
-						return SQLITE_CONSTRAINT_DATATYPE;
-					}
-					int64_t value = sqlite3_value_int64(argv[i]);
-					if (value < 0 || value > UINT32_MAX) {
-						return SQLITE_RANGE;
-					}
-					row->values[i-2].value.u32 = (uint32_t) value;
-					break; }
-
-				case FDB_REAL: {
-					if (sqlite3_type != SQLITE_FLOAT) {
-						return SQLITE_CONSTRAINT_DATATYPE;
-					}
-					double value = sqlite3_value_double(argv[i]);
-					row->values[i-2].value.real = (float) value;
-					break; }
-
-				case FDB_NVARCHAR:
-				case FDB_TEXT: {
-					if (sqlite3_type != SQLITE_TEXT) {
-						return SQLITE_CONSTRAINT_DATATYPE;
-					}
-					const char* value = (const char*) sqlite3_value_text(argv[i]);
-					if (strlen(value) > strlen(row->values[i-2].value.text)) {
-						return SQLITE_TOOBIG;
-					}
-					strcpy(row->values[i-2].value.text, value);
-					break; }
-
-				case FDB_BOOLEAN: {
-					if (sqlite3_type != SQLITE_INTEGER) {
-						return SQLITE_CONSTRAINT_DATATYPE;
-					}
-					int64_t value = sqlite3_value_int64(argv[i]);
-					if (value != 0 && value != 1) {
-						return SQLITE_RANGE;
-					}
-					row->values[i-2].value.boolean = (bool) value;
-					break; }
-
-				case FDB_I64: {
-					if (sqlite3_type != SQLITE_INTEGER) {
-						return SQLITE_CONSTRAINT_DATATYPE;
-					}
-					int64_t value = sqlite3_value_int64(argv[i]);
-					*row->values[i-2].value.i64p = value;
-					break; }
-
-				case FDB_U64: {
-					if (sqlite3_type != SQLITE_INTEGER) {
-						return SQLITE_CONSTRAINT_DATATYPE;
-					}
-					int64_t value = sqlite3_value_int64(argv[i]);
-					*row->values[i-2].value.u64p = value;
-					break; }
-
-				default:
-					//printf("Unexpected FDB data type");
+			if (!sqlite3_value_nochange(argv[i])) {
+				fdb_index_drop(table, i - 2);
+				fdb_sorted_drop(table, i - 2);
+				fdb_trigrams_changed(table, i - 2, rowIndex);
+				fdb_column_stats_drop(table, i - 2);
 			}
 		}
-		//printf("\n");
-		return SQLITE_OK;
+		fdb_table_unuse(table);
+		return rc;
 	}
 	return SQLITE_ERROR;
 }
@@ -619,3 +1580,33 @@ static sqlite3_module fdbModule = {
 	/* xRollbackTo */ 0,
 	/* xShadowName */ 0
 };
+
+/*
+** Same as fdbModule, but for tables opened by path, see fdbFileConnect().
+*/
+static sqlite3_module fdbFileModule = {
+	/* iVersion		*/ 0,
+	/* xCreate		 */ fdbFileConnect,
+	/* xConnect		*/ fdbFileConnect,
+	/* xBestIndex	*/ fdbBestIndex,
+	/* xDisconnect */ fdbDisconnect,
+	/* xDestroy		*/ fdbDisconnect,
+	/* xOpen			 */ fdbOpen,
+	/* xClose			*/ fdbClose,
+	/* xFilter		 */ fdbFilter,
+	/* xNext			 */ fdbNext,
+	/* xEof				*/ fdbEof,
+	/* xColumn		 */ fdbColumn,
+	/* xRowid			*/ fdbRowid,
+	/* xUpdate		 */ fdbUpdate,
+	/* xBegin			*/ 0,
+	/* xSync			 */ 0,
+	/* xCommit		 */ 0,
+	/* xRollback	 */ 0,
+	/* xFindMethod */ 0,
+	/* xRename		 */ 0,
+	/* xSavepoint	*/ 0,
+	/* xRelease		*/ 0,
+	/* xRollbackTo */ 0,
+	/* xShadowName */ 0
+};
@@ -7,42 +7,191 @@
 #endif
 
 #include "fdb_vtab.c"
+#include "fdb_stats.c"
+#include "fdb_aggregate.c"
 #include <stdlib.h>
 
-Fdb* get_fdb_from_file(const char* path) {
-	FILE* fdbfile = fopen(path, "rb");
-	if (fdbfile == NULL) {
+Fdb* get_fdb_from_legouniverse_exe() {
+	#ifdef _WIN32
+		const uintptr_t FDB_PTR_ADDR = 0x014897DC;
+		static Fdb fdb;
+		uintptr_t base = (uintptr_t) GetModuleHandle(NULL);
+		FdbHeader* header = ***(FdbHeader****) (base + FDB_PTR_ADDR);
+		if (fdb.info == NULL) {
+			// the client has already resolved all offsets to addresses
+			if (!fdb_init(&fdb, NULL, 0, header)) {
+				return NULL;
+			}
+		}
+		return &fdb;
+	#else
 		return NULL;
+	#endif
+}
+
+/*
+** Register a module for every table of the image, so tables can be queried by
+** their own name. Every module holds a reference to the image.
+*/
+int fdb_create_modules(sqlite3* db, Fdb* fdb) {
+	for (uint32_t i = 0; i < fdb->ntables; i++) {
+		fdb_retain(fdb);
+		int rc = sqlite3_create_module_v2(db, fdb->info[i].name, &fdbModule, fdb, fdb_release);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
 	}
-	fseek(fdbfile, 0, SEEK_END);
-	long fsize = ftell(fdbfile);
-	fseek(fdbfile, 0, SEEK_SET);
+	return SQLITE_OK;
+}
 
-	unsigned char* buf = malloc(fsize + 1);
-	if (buf == NULL) {
-		return NULL;
+/*
+** fdb_load(path [, option ...]) makes all tables of a fdb file available on this
+** connection under their own names and returns the number of tables.
+*/
+static void fdbLoadFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+	const char* zPath = (const char*) sqlite3_value_text(argv[0]);
+	if (zPath == NULL) {
+		sqlite3_result_error(ctx, "fdb_load: path required", -1);
+		return;
 	}
+	FdbOptions options = {0};
+	char* zErr = NULL;
+	for (int32_t i = 1; i < argc; i++) {
+		const char* arg = (const char*) sqlite3_value_text(argv[i]);
+		if (arg == NULL || !fdb_parse_option(&options, arg, &zErr)) {
+			sqlite3_result_error(ctx, zErr != NULL ? zErr : "fdb_load: invalid option", -1);
+			sqlite3_free(zErr);
+			return;
+		}
+	}
+	Fdb* fdb = fdb_open(zPath, &options, &zErr);
+	if (fdb == NULL) {
+		sqlite3_result_error(ctx, zErr, -1);
+		sqlite3_free(zErr);
+		return;
+	}
+	int rc = fdb_create_modules(sqlite3_context_db_handle(ctx), fdb);
+	uint32_t ntables = fdb->ntables;
+	fdb_release(fdb);
+	if (rc != SQLITE_OK) {
+		sqlite3_result_error_code(ctx, rc);
+		return;
+	}
+	sqlite3_result_int64(ctx, ntables);
+}
 
-	size_t nread = fread(buf, 1, fsize, fdbfile);
-	fclose(fdbfile);
-	if (nread != fsize) {
-		return NULL;
+/*
+** fdb_pack(source, destination) writes the tables of a fdb file into a
+** packed container, which fdb_load() and the fdb module open on demand table by table.
+** The file is packed as it is on disk, UPDATEs made to loaded images aren't saved.
+*/
+static void fdbPackFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+	const char* zSource = (const char*) sqlite3_value_text(argv[0]);
+	const char* zDest = (const char*) sqlite3_value_text(argv[1]);
+	if (zSource == NULL || zDest == NULL) {
+		sqlite3_result_error(ctx, "fdb_pack: source and destination required", -1);
+		return;
 	}
+	if (fdb_path_loaded(zDest)) {
+		// its image would stay mapped while the file is replaced under it
+		sqlite3_result_error(ctx, "fdb_pack: destination is loaded", -1);
+		return;
+	}
+	char* zErr = NULL;
+	uint32_t ntables = 0;
+	Fdb* fdb = fdb_acquire_private(zSource, &zErr);
+	if (fdb != NULL) {
+		zErr = fdb_pack(fdb, zDest);
+		ntables = fdb->ntables;
+		fdb_release(fdb);
+	}
+	if (zErr != NULL) {
+		sqlite3_result_error(ctx, zErr, -1);
+		sqlite3_free(zErr);
+		return;
+	}
+	sqlite3_result_int64(ctx, ntables);
+}
 
-	Fdb* fdb = (Fdb*) buf;
-	fix_pointers(fdb);
-	return fdb;
+/*
+** fdb_evict() frees the unpacked tables of packed containers that no open query
+** currently reads, and returns how many were freed. Their in-memory UPDATEs are discarded with them.
+*/
+static void fdbEvictFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+	uint32_t evicted = 0;
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	for (Fdb* fdb = fdb_images; fdb != NULL; fdb = fdb->next) {
+		evicted += fdb_evict(fdb);
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+	sqlite3_result_int64(ctx, evicted);
 }
 
-Fdb* get_fdb_from_legouniverse_exe() {
-	#ifdef _WIN32
-		const unsigned int FDB_PTR_ADDR = 0x014897DC;
-		unsigned int base = (unsigned int) GetModuleHandle(NULL);
-		Fdb* fdb = ***(Fdb****) (base + FDB_PTR_ADDR);
-		return fdb;
-	#else
-		return NULL;
-	#endif
+/*
+** fdb_index(table, column) builds a secondary hash index on a column of every loaded
+** table of that name, so equality lookups on the column no longer scan the table.
+** fdb_index(table, column, 'trigram') builds a trigram index on a text column instead,
+** for LIKE and GLOB patterns without a literal prefix. Returns the number of indexes
+** built or already present.
+*/
+static void fdbIndexFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+	const char* zTable = (const char*) sqlite3_value_text(argv[0]);
+	const char* zColumn = (const char*) sqlite3_value_text(argv[1]);
+	if (zTable == NULL || zColumn == NULL) {
+		sqlite3_result_error(ctx, "fdb_index: table and column required", -1);
+		return;
+	}
+	const char* zKind = argc > 2 ? (const char*) sqlite3_value_text(argv[2]) : "hash";
+	bool trigram = zKind != NULL && sqlite3_stricmp(zKind, "trigram") == 0;
+	if (zKind == NULL || (!trigram && sqlite3_stricmp(zKind, "hash") != 0)) {
+		sqlite3_result_error(ctx, "fdb_index: kind must be 'hash' or 'trigram'", -1);
+		return;
+	}
+	uint32_t built = 0;
+	char* zErr = NULL;
+	sqlite3_mutex_enter(fdb_registry_mutex());
+	for (Fdb* fdb = fdb_images; fdb != NULL && zErr == NULL; fdb = fdb->next) {
+		for (uint32_t i = 0; i < fdb->ntables && zErr == NULL; i++) {
+			TableInfo* info = &fdb->info[i];
+			if (strcmp(info->name, zTable) != 0) {
+				continue;
+			}
+			zErr = fdb_table_use(fdb, info);
+			if (zErr != NULL) {
+				break;
+			}
+			const Column* columns = desc_columns(info->image, info->desc);
+			uint32_t j = 0;
+			while (j < info->desc->ncolumns && strcmp(column_name(info->image, &columns[j]), zColumn) != 0) {
+				j++;
+			}
+			if (j == info->desc->ncolumns) {
+				zErr = sqlite3_mprintf("fdb_index: no such column: %s.%s", zTable, zColumn);
+			} else if (trigram) {
+				FdbTrigrams* trigrams = fdb_table_trigrams(info, j, true);
+				if (trigrams == NULL) {
+					zErr = sqlite3_mprintf("fdb_index: can't build a trigram index on %s.%s", zTable, zColumn);
+				}
+				built += trigrams != NULL;
+				fdb_trigrams_release(trigrams);
+			} else {
+				FdbIndex* index = fdb_table_index(info, j, true);
+				if (index == NULL) {
+					zErr = sqlite3_mprintf("fdb_index: can't index %s.%s", zTable, zColumn);
+				}
+				built += index != NULL;
+				fdb_index_release(index);
+			}
+			fdb_table_unuse(info);
+		}
+	}
+	sqlite3_mutex_leave(fdb_registry_mutex());
+	if (zErr != NULL) {
+		sqlite3_result_error(ctx, zErr, -1);
+		sqlite3_free(zErr);
+		return;
+	}
+	sqlite3_result_int64(ctx, built);
 }
 
 #ifdef _WIN32
@@ -55,18 +204,40 @@ int sqlite3_fdb_init(
 ){
 	SQLITE_EXTENSION_INIT2(pApi);
 
-	Fdb* fdb = get_fdb_from_legouniverse_exe();
-	if (fdb == NULL) {
-		return SQLITE_ERROR;
+	int rc = sqlite3_create_module(db, "fdb", &fdbFileModule, NULL);
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_module(db, "fdb_tables", &fdbTablesModule, NULL);
 	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_module(db, "fdb_stats", &fdbStatsModule, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_module(db, "fdb_aggregate", &fdbAggregateModule, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_function(db, "fdb_load", -1, SQLITE_UTF8, NULL, fdbLoadFunc, NULL, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_function(db, "fdb_pack", 2, SQLITE_UTF8, NULL, fdbPackFunc, NULL, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_function(db, "fdb_evict", 0, SQLITE_UTF8, NULL, fdbEvictFunc, NULL, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_function(db, "fdb_index", 2, SQLITE_UTF8, NULL, fdbIndexFunc, NULL, NULL);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_create_function(db, "fdb_index", 3, SQLITE_UTF8, NULL, fdbIndexFunc, NULL, NULL);
+	}
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+	fdb_stats_start();
 
-	int rc = SQLITE_OK;
-
-	for (unsigned int i = 0; i < fdb->ntables; i++) {
-		rc = sqlite3_create_module(db, fdb->tables[i].desc->name, &fdbModule, fdb);
-		if (rc != SQLITE_OK) {
-			return rc;
-		}
+	Fdb* fdb = get_fdb_from_legouniverse_exe();
+	if (fdb != NULL) {
+		fdb_register_image(fdb);
+		rc = fdb_create_modules(db, fdb);
 	}
 	return rc;
 }